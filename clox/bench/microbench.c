@@ -0,0 +1,326 @@
+// Times the runtime's hot primitives in isolation: the hash table, string
+// interning, object allocation and collection. Each case runs in a VM of
+// its own and reports the best of a few runs.
+//
+//   microbench [-o results] [-c baseline] [filter]
+//
+// -o saves the times so that a later run can -c compare against them.
+// Only cases whose name contains filter are run.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/object.h"
+#include "../src/table.h"
+#include "../src/vm.h"
+
+#define RUNS 3
+#define MIN_OPS 1000000
+
+typedef struct {
+    char name[64];
+    double ns;
+} Result;
+
+static char* filter;
+static FILE* out;
+static Result* baseline;
+static int nbaseline;
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static u32 rng = 2463534242u;
+
+static u32 next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static void shuffle(ObjString** a, int n) {
+    for (int i = n - 1; i > 0; i--) {
+        int j = next_rand() % (i + 1);
+        ObjString* t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+    }
+}
+
+static bool wanted(char* name) {
+    return !filter || strstr(name, filter);
+}
+
+static void report(char* name, double ns, double bytes) {
+    printf("%-40s %10.1f %10.1f", name, ns, bytes);
+    for (int i = 0; i < nbaseline; i++) {
+        if (!strcmp(baseline[i].name, name)) {
+            printf(" %+8.1f%%", 100 * (ns / baseline[i].ns - 1));
+        }
+    }
+    printf("\n");
+    if (out) fprintf(out, "%s %f\n", name, ns);
+}
+
+// Distinct strings of len bytes, interned in the current VM
+static ObjString** make_keys(int n, int len, char tag) {
+    ObjString** keys = malloc(n * sizeof *keys);
+    char* buf = malloc(len + 1);
+    for (int i = 0; i < n; i++) {
+        memset(buf, tag, len);
+        snprintf(buf, len + 1, "%c%d", tag, i);
+        buf[strlen(buf)] = tag;
+        keys[i] = create_string(buf, len);
+    }
+    free(buf);
+    return keys;
+}
+
+static void fill(Table* t, ObjString** keys, int n) {
+    table_init(t);
+    for (int i = 0; i < n; i++) table_set(t, keys[i], INT_VAL(i));
+}
+
+static void bench_table_set(int n) {
+    char name[64];
+    snprintf(name, sizeof name, "table_set n=%d", n);
+    if (!wanted(name)) return;
+    VM* v = VM_init();
+    ObjString** keys = make_keys(n, 12, 'k');
+    int reps = n < MIN_OPS ? MIN_OPS / n : 1;
+    double best = 1e30, bytes = 0;
+    for (int run = 0; run < RUNS; run++) {
+        u64 start = now_ns();
+        for (int r = 0; r < reps; r++) {
+            Table t;
+            fill(&t, keys, n);
+            bytes = (double) t.cap * sizeof(Entry) / n;
+            table_free(&t);
+        }
+        double ns = (double) (now_ns() - start) / reps / n;
+        if (ns < best) best = ns;
+    }
+    report(name, best, bytes);
+    free(keys);
+    VM_free(v);
+}
+
+// Looks up every key in a random order, the table filled to the given
+// fraction of its capacity
+static void bench_table_get(int cap, double load, bool hit) {
+    int n = cap * load;
+    char name[64];
+    snprintf(name, sizeof name, "table_get %s n=%d load=%.2f",
+             hit ? "hit" : "miss", n, load);
+    if (!wanted(name)) return;
+    VM* v = VM_init();
+    ObjString** keys = make_keys(n, 12, 'k');
+    ObjString** probes = hit ? keys : make_keys(n, 12, 'm');
+    Table t;
+    fill(&t, keys, n);
+    shuffle(probes, n);
+    int reps = n < MIN_OPS ? MIN_OPS / n : 1;
+    double best = 1e30;
+    int found = 0;
+    for (int run = 0; run < RUNS; run++) {
+        u64 start = now_ns();
+        for (int r = 0; r < reps; r++) {
+            for (int i = 0; i < n; i++) {
+                Value val;
+                found += table_get(&t, probes[i], &val);
+            }
+        }
+        double ns = (double) (now_ns() - start) / reps / n;
+        if (ns < best) best = ns;
+    }
+    if (found != (hit ? RUNS * reps * n : 0)) {
+        eprintf("%s: wrong lookups\n", name);
+        exit(1);
+    }
+    report(name, best, 0);
+    table_free(&t);
+    if (!hit) free(probes);
+    free(keys);
+    VM_free(v);
+}
+
+// Deletes every key, which leaves tombstones and shrinks the table
+static void bench_table_delete(int n) {
+    char name[64];
+    snprintf(name, sizeof name, "table_delete n=%d", n);
+    if (!wanted(name)) return;
+    VM* v = VM_init();
+    ObjString** keys = make_keys(n, 12, 'k');
+    int reps = n < MIN_OPS ? MIN_OPS / n : 1;
+    double best = 1e30;
+    for (int run = 0; run < RUNS; run++) {
+        u64 total = 0;
+        for (int r = 0; r < reps; r++) {
+            Table t;
+            fill(&t, keys, n);
+            shuffle(keys, n);
+            u64 start = now_ns();
+            for (int i = 0; i < n; i++) table_delete(&t, keys[i]);
+            total += now_ns() - start;
+            table_free(&t);
+        }
+        double ns = (double) total / reps / n;
+        if (ns < best) best = ns;
+    }
+    report(name, best, 0);
+    free(keys);
+    VM_free(v);
+}
+
+// create_string of strings already interned, or of new ones
+static void bench_intern(int len, bool hit) {
+    char name[64];
+    snprintf(name, sizeof name, "create_string %s len=%d",
+             hit ? "hit" : "miss", len);
+    if (!wanted(name)) return;
+    int n = 100000;
+    char* bufs = malloc((size_t) n * len);
+    for (int i = 0; i < n; i++) {
+        char* p = bufs + (size_t) i * len;
+        memset(p, 's', len);
+        memcpy(p, &i, len < sizeof i ? len : sizeof i);
+    }
+    double best = 1e30, bytes = 0;
+    for (int run = 0; run < RUNS; run++) {
+        VM* v = VM_init();
+        if (hit) {
+            for (int i = 0; i < n; i++) {
+                create_string(bufs + (size_t) i * len, len);
+            }
+        }
+        size_t before = vm.alloc_bytes;
+        u64 start = now_ns();
+        for (int i = 0; i < n; i++) {
+            create_string(bufs + (size_t) i * len, len);
+        }
+        double ns = (double) (now_ns() - start) / n;
+        bytes = (double) (vm.alloc_bytes - before) / n;
+        if (ns < best) best = ns;
+        VM_free(v);
+    }
+    report(name, best, bytes);
+    free(bufs);
+}
+
+// Arrays of len values, with the collector off
+static void bench_alloc(int len) {
+    char name[64];
+    snprintf(name, sizeof name, "alloc_obj array len=%d", len);
+    if (!wanted(name)) return;
+    int n = 200000;
+    double best = 1e30, bytes = 0;
+    for (int run = 0; run < RUNS; run++) {
+        VM* v = VM_init();
+        size_t before = vm.alloc_bytes;
+        u64 start = now_ns();
+        for (int i = 0; i < n; i++) create_array(len);
+        double ns = (double) (now_ns() - start) / n;
+        bytes = (double) (vm.alloc_bytes - before) / n;
+        if (ns < best) best = ns;
+        VM_free(v);
+    }
+    report(name, best, bytes);
+}
+
+// One collection over live instances held by an array and as many
+// unreachable ones, per object in the heap
+static void bench_gc(int live) {
+    char name[64];
+    snprintf(name, sizeof name, "collect_garbage live=%d dead=%d", live,
+             live);
+    if (!wanted(name)) return;
+    double best = 1e30, bytes = 0;
+    for (int run = 0; run < RUNS; run++) {
+        VM* v = VM_init();
+        ObjClass* cls = create_class(CREATE_STRING_LITERAL("C"));
+        ObjArray* root = create_array(live);
+        Vec_push(vm.api_stack, OBJ_VAL(root));
+        Vec_push(vm.api_stack, OBJ_VAL(cls));
+        for (int i = 0; i < live; i++) {
+            root->data[i] = OBJ_VAL(create_instance(cls));
+            create_instance(cls);
+        }
+        int objs = vm.alloc_objs;
+        size_t before = vm.alloc_bytes;
+        gc_enable();
+        u64 start = now_ns();
+        collect_garbage();
+        double ns = (double) (now_ns() - start) / objs;
+        gc_disable();
+        bytes = (double) (before - vm.alloc_bytes) / objs;
+        if (ns < best) best = ns;
+        VM_free(v);
+    }
+    report(name, best, bytes);
+}
+
+static void load_baseline(char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    char line[128];
+    while (fgets(line, sizeof line, fp)) {
+        char* sp = strrchr(line, ' ');
+        if (!sp) continue;
+        baseline = realloc(baseline, (nbaseline + 1) * sizeof *baseline);
+        Result* r = &baseline[nbaseline++];
+        snprintf(r->name, sizeof r->name, "%.*s", (int) (sp - line), line);
+        r->ns = atof(sp + 1);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            out = fopen(argv[++i], "w");
+            if (!out) {
+                perror(argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            load_baseline(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            filter = argv[i];
+        } else {
+            eprintf("Usage: microbench [-o results] [-c baseline] "
+                    "[filter]\n");
+            return 1;
+        }
+    }
+
+    printf("%-40s %10s %10s%s\n", "case", "ns/op", "bytes/op",
+           nbaseline ? "    change" : "");
+    int sizes[] = {16, 1024, 65536};
+    for (int i = 0; i < 3; i++) bench_table_set(sizes[i]);
+    // The table doubles past LOAD_FACTOR, so these all have 2^16 slots
+    double loads[] = {0.4, 0.55, 0.74};
+    for (int i = 0; i < 3; i++) bench_table_get(1 << 16, loads[i], true);
+    for (int i = 0; i < 3; i++) bench_table_get(1 << 16, loads[i], false);
+    bench_table_get(64, 0.5, true);
+    for (int i = 0; i < 3; i++) bench_table_delete(sizes[i]);
+    int lens[] = {4, 16, 64, 256};
+    for (int i = 0; i < 4; i++) bench_intern(lens[i], false);
+    for (int i = 0; i < 4; i++) bench_intern(lens[i], true);
+    int alens[] = {0, 4, 16, 64};
+    for (int i = 0; i < 4; i++) bench_alloc(alens[i]);
+    bench_gc(10000);
+    bench_gc(200000);
+
+    if (out) fclose(out);
+    free(baseline);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+# Runs the benchmark suite and reports the median wall time of each program
+# with a confidence interval, optionally against a saved baseline.
+#
+#   bench/run.py [--clox path] [options] [name...]
+#
+# --args=... passes arguments on to clox, as in --args=--reg. --save file
+# writes the results as a baseline and --compare file reads one back. A
+# change only counts as faster or slower when the two intervals do not
+# overlap. --jlox cmd also times the programs with cmd, say
+# "java -cp ../jlox/out Main", though jlox only runs the ones in its
+# dialect.
+
+import argparse
+import json
+import math
+import os
+import shlex
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+SUITE = [
+    ("binary_trees", "bench/binary_trees.lox"),
+    ("nbody", "bench/nbody.lox"),
+    ("strings", "bench/strings.lox"),
+    ("dispatch", "bench/dispatch.lox"),
+    ("closures", "bench/closures.lox"),
+    ("fields", "bench/fields.lox"),
+    ("switch", "bench/switch.lox"),
+    ("timingtest", "tests/timingtest.lox"),
+    ("tabletest", "tests/tabletest.lox"),
+    ("garbagetest", "tests/garbagetest.lox"),
+    ("matmultest", "tests/matmultest.lox"),
+]
+
+
+def time_run(cmd):
+    start = time.perf_counter_ns()
+    try:
+        r = subprocess.run(cmd, cwd=ROOT, stdin=subprocess.DEVNULL,
+                           stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    except OSError as e:
+        raise RuntimeError(str(e))
+    end = time.perf_counter_ns()
+    if r.returncode:
+        err = r.stderr.decode(errors="replace").strip().splitlines()
+        raise RuntimeError(err[-1] if err else "exit %d" % r.returncode)
+    return (end - start) / 1e9
+
+
+def measure(cmd, warmup, reps):
+    for _ in range(warmup):
+        time_run(cmd)
+    return [time_run(cmd) for _ in range(reps)]
+
+
+def median(xs):
+    xs = sorted(xs)
+    n = len(xs)
+    return xs[n // 2] if n % 2 else (xs[n // 2 - 1] + xs[n // 2]) / 2
+
+
+def median_ci(xs, conf=0.95):
+    # The order statistics around the median, as far in as still covers
+    # conf of the time. Below about six runs that is just the extremes.
+    xs = sorted(xs)
+    n = len(xs)
+    cdf = 0
+    k = 0
+    for i in range(n // 2):
+        cdf += math.comb(n, i) / 2 ** n
+        if 1 - 2 * cdf < conf:
+            break
+        k = i + 1
+    return xs[k], xs[n - 1 - k]
+
+
+def summarize(samples):
+    lo, hi = median_ci(samples)
+    return {"samples": samples, "median": median(samples), "ci": [lo, hi]}
+
+
+def verdict(new, old):
+    if new["ci"][1] < old["ci"][0]:
+        return "faster"
+    if new["ci"][0] > old["ci"][1]:
+        return "slower"
+    return "~"
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Times the Lox benchmarks.")
+    ap.add_argument("names", nargs="*", help="only run these benchmarks")
+    ap.add_argument("--clox", default="build/release/clox")
+    ap.add_argument("--args", default="", help="extra arguments for clox")
+    ap.add_argument("--warmup", type=int, default=1)
+    ap.add_argument("--reps", type=int, default=5)
+    ap.add_argument("--save", metavar="FILE")
+    ap.add_argument("--compare", metavar="FILE")
+    ap.add_argument("--jlox", metavar="CMD")
+    opts = ap.parse_args()
+
+    suite = [b for b in SUITE if not opts.names or b[0] in opts.names]
+    unknown = set(opts.names) - {b[0] for b in SUITE}
+    if unknown:
+        sys.exit("unknown benchmark: " + ", ".join(sorted(unknown)))
+    baseline = {}
+    if opts.compare:
+        with open(opts.compare) as f:
+            baseline = json.load(f)["results"]
+
+    clox = [os.path.join(ROOT, opts.clox)] + shlex.split(opts.args)
+    print("%-14s %9s %21s" % ("benchmark", "median", "95% CI"), end="")
+    if baseline:
+        print(" %9s %8s %6s" % ("baseline", "change", ""), end="")
+    if opts.jlox:
+        print(" %9s" % "jlox", end="")
+    print()
+
+    results = {}
+    failed = False
+    for name, path in suite:
+        print("%-14s" % name, end=" ", flush=True)
+        try:
+            r = summarize(measure(clox + [path], opts.warmup, opts.reps))
+        except RuntimeError as e:
+            print("failed: %s" % e)
+            failed = True
+            continue
+        results[name] = r
+        print("%8.3fs [%8.3f, %8.3f]" % (r["median"], *r["ci"]), end="")
+        if baseline:
+            old = baseline.get(name)
+            if old:
+                change = r["median"] / old["median"] - 1
+                print(" %8.3fs %+7.1f%% %-6s" % (old["median"], 100 * change,
+                                                 verdict(r, old)), end="")
+            else:
+                print(" %9s %15s" % ("-", ""), end="")
+        if opts.jlox:
+            try:
+                cmd = shlex.split(opts.jlox) + [path]
+                j = median(measure(cmd, opts.warmup, opts.reps))
+                print(" %8.3fs" % j, end="")
+            except RuntimeError:
+                print(" %9s" % "failed", end="")
+        print(flush=True)
+
+    if opts.save:
+        with open(opts.save, "w") as f:
+            json.dump({"clox_args": opts.args, "results": results}, f,
+                      indent=1)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -2,7 +2,8 @@
 
 #include <time.h>
 
-#include "compiler.h"
+#include "heapdump.h"
+#include "module.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
@@ -47,7 +48,7 @@ DECL_BUILTIN(getc) {
 
 DECL_BUILTIN(exit) {
     int exitcode;
-    if (argc > 0 && argv[1].type == VT_NUMBER) exitcode = argv[1].num;
+    if (argc > 0 && IS_NUMBER(argv[1])) exitcode = AS_NUMBER(argv[1]);
     else exitcode = 0;
     exit(exitcode);
 }
@@ -57,29 +58,29 @@ DECL_BUILTIN(random) {
     return OK;
 }
 
-DECL_BUILTIN(loadModule) {
+static int load_module(int argc, Value* argv, bool reload) {
     if (argc < 1) return RUNTIME_ERROR;
     if (!isObjType(argv[1], OT_STRING)) return RUNTIME_ERROR;
 
-    ObjString* filename = (ObjString*) argv[1].obj;
+    ObjFunction* f = module_load(((ObjString*) argv[1].obj)->data, reload);
+    if (!f) return RUNTIME_ERROR;
 
-    FILE* fp = fopen(filename->data, "r");
-    if (!fp) return RUNTIME_ERROR;
-    fseek(fp, 0, SEEK_END);
-    int len = ftell(fp);
-    char* program = malloc(len + 1);
-    program[len] = '\0';
-    fseek(fp, 0, SEEK_SET);
-    (void) !fread(program, 1, len, fp);
-    fclose(fp);
+    argv[0] = OBJ_VAL(f);
+    return OK;
+}
 
-    gc_disable();
-    ObjFunction* compiled = compile(program);
-    free(program);
+DECL_BUILTIN(loadModule) {
+    return load_module(argc, argv, false);
+}
 
-    if (!compiled) return RUNTIME_ERROR;
+DECL_BUILTIN(reloadModule) {
+    return load_module(argc, argv, true);
+}
 
-    gc_enable();
-    argv[0] = OBJ_VAL(compiled);
+DECL_BUILTIN(dumpHeap) {
+    if (argc < 1) return RUNTIME_ERROR;
+    if (!isObjType(argv[1], OT_STRING)) return RUNTIME_ERROR;
+    if (!heap_dump(((ObjString*) argv[1].obj)->data)) return RUNTIME_ERROR;
+    argv[0] = NIL_VAL;
     return OK;
 }
@@ -18,5 +18,8 @@ DECL_BUILTIN(getc);
 DECL_BUILTIN(exit);
 
 DECL_BUILTIN(loadModule);
+DECL_BUILTIN(reloadModule);
+
+DECL_BUILTIN(dumpHeap);
 
 #endif
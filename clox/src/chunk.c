@@ -11,44 +11,76 @@ void chunk_init(Chunk* c) {
     Vec_init(c->code);
     Vec_init(c->constants);
     Vec_init(c->lines);
-
-    c->linesStart = -1;
+    Vec_init(c->inlined);
 }
 
 void chunk_free(Chunk* c) {
-    Vec_free(c->code);
-    Vec_free(c->constants);
-    Vec_free(c->lines);
+    // Code loaded from a .loxc file lives in the mapping, with no capacity
+    if (c->code.cap) Vec_free_heap(c->code);
+    Vec_free_heap(c->constants);
+    Vec_free_heap(c->lines);
+    Vec_free_heap(c->inlined);
 }
 
 void chunk_write(Chunk* c, u8 b, int line) {
-    Vec_push(c->code, b);
-    if (c->linesStart == -1) {
-        c->linesStart = line;
-        Vec_push(c->lines, c->code.size - 1);
-    } else {
-        line -= c->linesStart;
-        if (line > c->lines.size - 1) {
-            int last_instr =
-                c->lines.size == 0 ? 0 : c->lines.d[c->lines.size - 1];
-            int n = line - c->lines.size;
-            for (int i = 0; i < n; i++) {
-                Vec_push(c->lines, last_instr);
-            }
-            Vec_push(c->lines, c->code.size - 1);
-        }
+    Vec_push_heap(c->code, b);
+    if (!c->lines.size || c->lines.d[c->lines.size - 1].line != line) {
+        Vec_push_heap(c->lines, ((LineRun){c->code.size - 1, line}));
+    }
+}
+
+static int cut_pos(int pos, int start, int end) {
+    if (pos >= end) return pos - (end - start);
+    return pos > start ? start : pos;
+}
+
+void chunk_cut(Chunk* c, int start, int end) {
+    memmove(c->code.d + start, c->code.d + end, c->code.size - end);
+    c->code.size -= end - start;
+
+    // Of the runs that now start at the same place, the last one holds
+    int n = 0;
+    for (int i = 0; i < c->lines.size; i++) {
+        LineRun r = c->lines.d[i];
+        r.start = cut_pos(r.start, start, end);
+        if (r.start >= c->code.size && r.start) continue;
+        if (n && c->lines.d[n - 1].start == r.start) n--;
+        if (n && c->lines.d[n - 1].line == r.line) continue;
+        c->lines.d[n++] = r;
+    }
+    c->lines.size = n;
+
+    n = 0;
+    for (int i = 0; i < c->inlined.size; i++) {
+        Inlined in = c->inlined.d[i];
+        in.start = cut_pos(in.start, start, end);
+        in.end = cut_pos(in.end, start, end);
+        if (in.start < in.end) c->inlined.d[n++] = in;
     }
+    c->inlined.size = n;
 }
 
 int chunk_get_instr_line(Chunk* c, u8* pc) {
-    if (c->lines.size == 0) return c->linesStart;
+    if (!c->lines.size) return 0;
     int off = pc - c->code.d;
-    for (int i = 0; i < c->lines.size; i++) {
-        if (c->lines.d[i] > off) {
-            return i + c->linesStart;
-        }
+    int lo = 0, hi = c->lines.size - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (c->lines.d[mid].start <= off) lo = mid;
+        else hi = mid - 1;
+    }
+    return c->lines.d[lo].line;
+}
+
+int chunk_inlined_at(Chunk* c, u8* pc, Inlined** found) {
+    int off = pc - c->code.d;
+    int n = 0;
+    for (int i = 0; i < c->inlined.size && n < MAX_INLINED; i++) {
+        Inlined* in = &c->inlined.d[i];
+        if (in->start > off) break;
+        if (off < in->end) found[n++] = in;
     }
-    return c->lines.size - 1 + c->linesStart;
+    return n;
 }
 
 void chunk_push_const(Chunk* c, Value v, int line) {
@@ -57,10 +89,151 @@ void chunk_push_const(Chunk* c, Value v, int line) {
 }
 
 int add_constant(Chunk* c, Value v) {
-    Vec_push(c->constants, v);
+    Vec_push_heap(c->constants, v);
     return c->constants.size - 1;
 }
 
+int instr_len(u8* ip) {
+    switch (*ip) {
+        case OP_DEF_GLOBAL:
+        case OP_PUSH_GLOBAL:
+        case OP_POP_GLOBAL:
+        case OP_PUSH_LOCAL:
+        case OP_POP_LOCAL:
+        case OP_PUSH_UPVALUE:
+        case OP_POP_UPVALUE:
+        case OP_PUSH_CLOSURE:
+        case OP_PUSH_ARRAY_INIT:
+        case OP_PUSH_CONST:
+        case OP_POPN:
+        case OP_GETATTR:
+        case OP_SETATTR:
+        case OP_CALL:
+        case OP_INLINE_RET:
+        case OP_PUSH_STACK:
+        case OP_POP_STACK:
+            return 2;
+        case OP_JMP:
+        case OP_JMP_TRUE:
+        case OP_JMP_FALSE:
+            return 3;
+        case OP_INLINE:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+int instr_stack_effect(u8* ip) {
+    switch (*ip) {
+        case OP_PUSH_GLOBAL:
+        case OP_PUSH_LOCAL:
+        case OP_PUSH_UPVALUE:
+        case OP_PUSH_CLOSURE:
+        case OP_PUSH_CONST:
+        case OP_PUSH_NIL:
+        case OP_PUSH_TRUE:
+        case OP_PUSH_FALSE:
+        case OP_PUSH:
+        case OP_PUSH_STACK:
+            return 1;
+        case OP_DEF_GLOBAL:
+        case OP_POP_GLOBAL:
+        case OP_POP_LOCAL:
+        case OP_POP_UPVALUE:
+        case OP_POP:
+        case OP_SETATTR:
+        case OP_GETITEM:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_TEQ:
+        case OP_TGT:
+        case OP_TLT:
+        case OP_JMP_TRUE:
+        case OP_JMP_FALSE:
+        case OP_POP_STACK:
+        case OP_RET:
+            return -1;
+        case OP_SETITEM:
+            return -2;
+        case OP_PUSH_ARRAY_INIT:
+            return 1 - ip[1];
+        case OP_POPN:
+        case OP_CALL:
+        case OP_INLINE_RET:
+            return -ip[1];
+        default:
+            return 0;
+    }
+}
+
+// Destination of a jump relative to the instruction's own address.
+int instr_jmp_dest(u8* ip) {
+    int off = ip[1] | ip[2] << 8;
+    off = off << 16 >> 16;
+    return off + instr_len(ip);
+}
+
+// Computes the stack depth (relative to the frame pointer) before every
+// instruction, given base values on the stack at entry. Unreachable
+// instructions are left at -1. Returns NULL if the code isn't balanced.
+int* chunk_stack_depths(Chunk* c, int base) {
+    int* depths = malloc(c->code.size * sizeof *depths);
+    for (int i = 0; i < c->code.size; i++) depths[i] = -1;
+
+    Vector(int) work;
+    Vec_init(work);
+
+#define VISIT(dst, d)                                                          \
+    do {                                                                       \
+        int _dst = (dst);                                                      \
+        if (_dst < 0 || _dst >= c->code.size || (d) < 0) goto fail;            \
+        if (depths[_dst] == -1) {                                              \
+            depths[_dst] = d;                                                  \
+            Vec_push(work, _dst);                                              \
+        } else if (depths[_dst] != (d)) goto fail;                             \
+    } while (false)
+
+    if (c->code.size) VISIT(0, base);
+    while (work.size) {
+        int off = work.d[--work.size];
+        u8* ip = &c->code.d[off];
+        int d = depths[off] + instr_stack_effect(ip);
+        int next = off + instr_len(ip);
+        switch (*ip) {
+            case OP_RET:
+            case OP_LAZY:
+                continue;
+            case OP_INLINE_RET:
+                // Skips the fallback call that follows the inlined body.
+                VISIT(next + 2, d);
+                continue;
+            case OP_JMP:
+                VISIT(off + instr_jmp_dest(ip), d);
+                continue;
+            case OP_JMP_TRUE:
+            case OP_JMP_FALSE:
+                VISIT(off + instr_jmp_dest(ip), d);
+                break;
+            case OP_INLINE:
+                VISIT(off + instr_jmp_dest(ip), d);
+                break;
+        }
+        if (next < c->code.size) VISIT(next, d);
+    }
+#undef VISIT
+
+    Vec_free(work);
+    return depths;
+fail:
+    Vec_free(work);
+    free(depths);
+    return NULL;
+}
+
 int disassemble_instr(Chunk* c, int off) {
     switch (c->code.d[off++]) {
         case OP_NOP:
@@ -238,6 +411,30 @@ int disassemble_instr(Chunk* c, int off) {
         case OP_RET:
             eprintf("ret");
             break;
+        case OP_INLINE: {
+            int dst = c->code.d[off++];
+            dst |= c->code.d[off++] << 8;
+            dst = dst << 16 >> 16;
+            dst += off + 2;
+            eprintf("inline <");
+            int const_ind = c->code.d[off++];
+            eprint_value(c->constants.d[const_ind]);
+            eprintf("> (@%d) (%d) else %04x", const_ind, c->code.d[off++],
+                    dst);
+            break;
+        }
+        case OP_INLINE_RET:
+            eprintf("inline ret (%d)", c->code.d[off++]);
+            break;
+        case OP_PUSH_STACK:
+            eprintf("push stack$-%d", c->code.d[off++]);
+            break;
+        case OP_POP_STACK:
+            eprintf("pop stack$-%d", c->code.d[off++]);
+            break;
+        case OP_LAZY:
+            eprintf("lazy");
+            break;
         default:
             eprintf("unknown");
             break;
@@ -252,4 +449,154 @@ void disassemble_chunk(Chunk* c) {
         off = disassemble_instr(c, off);
         eprintf("\n");
     }
-}
\ No newline at end of file
+}
+static void eprint_k(Chunk* c, int k) {
+    eprintf("<");
+    eprint_value(c->constants.d[k]);
+    eprintf("> (@%d)", k);
+}
+
+static char* rinstr_names[] = {
+    [R_ADD] = "add", [R_SUB] = "sub", [R_MUL] = "mul", [R_DIV] = "div",
+    [R_MOD] = "mod", [R_TEQ] = "teq", [R_TGT] = "tgt", [R_TLT] = "tlt",
+    [R_JEQ] = "jeq", [R_JGT] = "jgt", [R_JLT] = "jlt",
+};
+
+int disassemble_rinstr(Chunk* c, int off) {
+    u8* ip = &c->code.d[off];
+    int op = *ip;
+    switch (op) {
+        case R_MOV:
+            eprintf("mov $%d, $%d", ip[1], ip[2]);
+            return off + 3;
+        case R_LOADK:
+            eprintf("loadk $%d, ", ip[1]);
+            eprint_k(c, ip[2]);
+            return off + 3;
+        case R_DEF_GLOBAL:
+            eprintf("def %s (@%d), $%d",
+                    ((ObjString*) c->constants.d[ip[2]].obj)->data, ip[2],
+                    ip[1]);
+            return off + 3;
+        case R_GET_GLOBAL:
+            eprintf("mov $%d, %s (@%d)", ip[1],
+                    ((ObjString*) c->constants.d[ip[2]].obj)->data, ip[2]);
+            return off + 3;
+        case R_SET_GLOBAL:
+            eprintf("mov %s (@%d), $%d",
+                    ((ObjString*) c->constants.d[ip[2]].obj)->data, ip[2],
+                    ip[1]);
+            return off + 3;
+        case R_GET_UPVALUE:
+            eprintf("mov $%d, upvalue$%d", ip[1], ip[2]);
+            return off + 3;
+        case R_SET_UPVALUE:
+            eprintf("mov upvalue$%d, $%d", ip[2], ip[1]);
+            return off + 3;
+        case R_CLOSURE:
+            eprintf("closure $%d, ", ip[1]);
+            eprint_k(c, ip[2]);
+            return off + 3;
+        case R_ARRAY:
+            eprintf("array $%d, [$%d]", ip[1], ip[2]);
+            return off + 3;
+        case R_ARRAY_INIT:
+            eprintf("array inited $%d, [%d]", ip[1], ip[2]);
+            return off + 3;
+        case R_GETATTR:
+            eprintf("getattr $%d, $%d.%s (@%d)", ip[1], ip[2],
+                    ((ObjString*) c->constants.d[ip[3]].obj)->data, ip[3]);
+            return off + 4;
+        case R_SETATTR:
+            eprintf("setattr $%d.%s (@%d), $%d", ip[1],
+                    ((ObjString*) c->constants.d[ip[2]].obj)->data, ip[2],
+                    ip[3]);
+            return off + 4;
+        case R_GETITEM:
+            eprintf("getitem $%d, $%d[$%d]", ip[1], ip[2], ip[3]);
+            return off + 4;
+        case R_SETITEM:
+            eprintf("setitem $%d[$%d], $%d", ip[1], ip[2], ip[3]);
+            return off + 4;
+        case R_NEG:
+            eprintf("neg $%d, $%d", ip[1], ip[2]);
+            return off + 3;
+        case R_NOT:
+            eprintf("not $%d, $%d", ip[1], ip[2]);
+            return off + 3;
+        case R_ADD:
+        case R_SUB:
+        case R_MUL:
+        case R_DIV:
+        case R_MOD:
+        case R_TEQ:
+        case R_TGT:
+        case R_TLT:
+            eprintf("%s $%d, $%d, $%d", rinstr_names[op], ip[1], ip[2], ip[3]);
+            return off + 4;
+        case R_ADDK:
+        case R_SUBK:
+        case R_MULK:
+        case R_DIVK:
+        case R_MODK:
+        case R_TEQK:
+        case R_TGTK:
+        case R_TLTK:
+            eprintf("%s $%d, $%d, ", rinstr_names[op - 1], ip[1], ip[2]);
+            eprint_k(c, ip[3]);
+            return off + 4;
+        case R_JMP:
+            eprintf("jmp %04x", off + 3 + (int16_t) (ip[1] | ip[2] << 8));
+            return off + 3;
+        case R_JMP_TRUE:
+        case R_JMP_FALSE:
+            eprintf("jmp,%s $%d, %04x", op == R_JMP_TRUE ? "true" : "false",
+                    ip[1], off + 4 + (int16_t) (ip[2] | ip[3] << 8));
+            return off + 4;
+        case R_JEQ:
+        case R_JGT:
+        case R_JLT:
+            eprintf("%s,%s $%d, $%d, %04x", rinstr_names[op],
+                    ip[1] ? "true" : "false", ip[2], ip[3],
+                    off + 6 + (int16_t) (ip[4] | ip[5] << 8));
+            return off + 6;
+        case R_JEQK:
+        case R_JGTK:
+        case R_JLTK:
+            eprintf("%s,%s $%d, ", rinstr_names[op - 1],
+                    ip[1] ? "true" : "false", ip[2]);
+            eprint_k(c, ip[3]);
+            eprintf(", %04x", off + 6 + (int16_t) (ip[4] | ip[5] << 8));
+            return off + 6;
+        case R_CALL:
+            eprintf("call $%d (%d)", ip[1], ip[2]);
+            return off + 3;
+        case R_INLINE:
+            eprintf("inline $%d <", ip[1]);
+            eprint_value(c->constants.d[ip[2]]);
+            eprintf("> (@%d) else ret %04x", ip[2],
+                    off + 5 + (int16_t) (ip[3] | ip[4] << 8));
+            return off + 5;
+        case R_CLOSE:
+            eprintf("close $%d", ip[1]);
+            return off + 2;
+        case R_RET:
+            eprintf("ret $%d", ip[1]);
+            return off + 2;
+        case R_LAZY:
+            eprintf("lazy");
+            return off + 1;
+        default:
+            eprintf("unknown");
+            return off + 1;
+    }
+}
+
+void disassemble_rchunk(Chunk* c) {
+    int off = 0;
+    while (off < c->code.size) {
+        eprintf("%04x: ", off);
+        off = disassemble_rinstr(c, off);
+        eprintf("\n");
+    }
+}
@@ -41,30 +41,114 @@ enum {
     OP_JMP_FALSE,
     OP_CALL,
     OP_RET,
+    OP_INLINE,
+    OP_INLINE_RET,
+    OP_PUSH_STACK,
+    OP_POP_STACK,
+    OP_LAZY,
+};
+
+// Register-based instructions, translated from the above. Operands are
+// frame slots unless marked K (constant index).
+enum {
+    R_MOV,
+    R_LOADK,
+    R_DEF_GLOBAL,
+    R_GET_GLOBAL,
+    R_SET_GLOBAL,
+    R_GET_UPVALUE,
+    R_SET_UPVALUE,
+    R_CLOSURE,
+    R_ARRAY,
+    R_ARRAY_INIT,
+    R_GETATTR,
+    R_SETATTR,
+    R_GETITEM,
+    R_SETITEM,
+    R_NEG,
+    R_NOT,
+    R_ADD,
+    R_ADDK,
+    R_SUB,
+    R_SUBK,
+    R_MUL,
+    R_MULK,
+    R_DIV,
+    R_DIVK,
+    R_MOD,
+    R_MODK,
+    R_TEQ,
+    R_TEQK,
+    R_TGT,
+    R_TGTK,
+    R_TLT,
+    R_TLTK,
+    R_JMP,
+    R_JMP_TRUE,
+    R_JMP_FALSE,
+    R_JEQ,
+    R_JEQK,
+    R_JGT,
+    R_JGTK,
+    R_JLT,
+    R_JLTK,
+    R_CALL,
+    R_INLINE,
+    R_CLOSE,
+    R_RET,
+    R_LAZY,
 };
 
 typedef struct _Value Value;
 
+// Code from one line of source, up to where the next run starts
+typedef struct {
+    int start;
+    int line;
+} LineRun;
+
+// Code copied into a chunk from the function in constant f, by a call at
+// line
+typedef struct {
+    int start, end;
+    int f;
+    int line;
+} Inlined;
+
+// Deepest nesting of inlined calls, which the size limit on what gets
+// inlined keeps well below this
+#define MAX_INLINED 16
+
 typedef struct _Chunk {
     Vector(u8) code;
 
     Vector(Value) constants;
 
-    Vector(int) lines;
-    int linesStart;
-
+    Vector(LineRun) lines;
+    // Sorted by start, with a copy before the ones nested in it
+    Vector(Inlined) inlined;
 } Chunk;
 
 void chunk_init(Chunk* c);
 void chunk_free(Chunk* c);
 void chunk_write(Chunk* c, u8 b, int line);
+void chunk_cut(Chunk* c, int start, int end);
 
 int chunk_get_instr_line(Chunk* c, u8* pc);
+// The inlined copies pc is in, outermost first, at most MAX_INLINED
+int chunk_inlined_at(Chunk* c, u8* pc, Inlined** found);
 
 void chunk_push_const(Chunk* c, Value v, int line);
 int add_constant(Chunk* c, Value v);
 
+int instr_len(u8* ip);
+int instr_stack_effect(u8* ip);
+int instr_jmp_dest(u8* ip);
+int* chunk_stack_depths(Chunk* c, int base);
+
 int disassemble_instr(Chunk* c, int off);
 void disassemble_chunk(Chunk* c);
+int disassemble_rinstr(Chunk* c, int off);
+void disassemble_rchunk(Chunk* c);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include "clox.h"
+
+#include <string.h>
+
+#include "debugger.h"
+#include "object.h"
+#include "vm.h"
+
+_Static_assert((int) CLOX_OK == OK && (int) CLOX_NO_FILE == NO_FILE &&
+                   (int) CLOX_COMPILE_ERROR == COMPILE_ERROR &&
+                   (int) CLOX_RUNTIME_ERROR == RUNTIME_ERROR &&
+                   (int) CLOX_HALTED == HALTED,
+               "clox.h has the status codes of value.h");
+
+VM* clox_new() {
+    return VM_init();
+}
+
+void clox_free(VM* v) {
+    VM_free(v);
+}
+
+int clox_run(VM* v, char* source) {
+    VM_enter(v);
+    if (vm.gc_on) return RUNTIME_ERROR; // already running code
+    return interpret(source);
+}
+
+void clox_register(VM* v, char* name, BuiltinFn* fn) {
+    VM_enter(v);
+    table_set(&vm.globals, create_string(name, strlen(name)), BUILTIN_VAL(fn));
+}
+
+bool clox_get_global(VM* v, char* name) {
+    VM_enter(v);
+    Value val;
+    if (!table_get(&vm.globals, create_string(name, strlen(name)), &val)) {
+        return false;
+    }
+    Vec_push_heap(vm.api_stack, val);
+    return true;
+}
+
+void clox_push(VM* v, Value* val) {
+    VM_enter(v);
+    // val may be on the stack, which pushing can move
+    Value copy = *val;
+    Vec_push_heap(vm.api_stack, copy);
+}
+
+void clox_push_nil(VM* v) {
+    VM_enter(v);
+    Vec_push_heap(vm.api_stack, NIL_VAL);
+}
+
+void clox_push_bool(VM* v, bool b) {
+    VM_enter(v);
+    Vec_push_heap(vm.api_stack, BOOL_VAL(b));
+}
+
+void clox_push_number(VM* v, double d) {
+    VM_enter(v);
+    Vec_push_heap(vm.api_stack, NUMBER_VAL(d));
+}
+
+void clox_push_string(VM* v, char* s, size_t len) {
+    VM_enter(v);
+    Vec_push_heap(vm.api_stack, OBJ_VAL(create_string(s, len)));
+}
+
+Value* clox_peek(VM* v, int n) {
+    VM_enter(v);
+    if (n < 0 || n >= vm.api_stack.size) return NULL;
+    return &vm.api_stack.d[vm.api_stack.size - 1 - n];
+}
+
+void clox_pop(VM* v) {
+    VM_enter(v);
+    if (vm.api_stack.size) vm.api_stack.size--;
+}
+
+int clox_top(VM* v) {
+    VM_enter(v);
+    return vm.api_stack.size;
+}
+
+int clox_call(VM* v, int nargs) {
+    VM_enter(v);
+    if (vm.gc_on || nargs < 0 || nargs >= vm.api_stack.size) {
+        return RUNTIME_ERROR;
+    }
+    // Call on a copy, the stack may grow under a builtin
+    Value argv[nargs + 1];
+    vm.api_stack.size -= nargs + 1;
+    memcpy(argv, vm.api_stack.d + vm.api_stack.size, sizeof argv);
+    int code = VM_call(nargs, argv);
+    Vec_push_heap(vm.api_stack, code == OK ? argv[0] : NIL_VAL);
+    return code;
+}
+
+Value* clox_arg(Value* argv, int i) {
+    return &argv[i];
+}
+
+bool clox_is_nil(Value* val) {
+    return val->type == VT_NIL;
+}
+
+bool clox_is_number(Value* val) {
+    return IS_NUMBER(*val);
+}
+
+double clox_number(Value* val) {
+    return IS_NUMBER(*val) ? AS_NUMBER(*val) : 0;
+}
+
+bool clox_truthy(Value* val) {
+    return truthy(*val);
+}
+
+char* clox_string(Value* val) {
+    return isObjType(*val, OT_STRING) ? ((ObjString*) val->obj)->data : NULL;
+}
+
+void clox_set_nil(Value* val) {
+    *val = NIL_VAL;
+}
+
+void clox_set_bool(Value* val, bool b) {
+    *val = BOOL_VAL(b);
+}
+
+void clox_set_number(Value* val, double d) {
+    *val = NUMBER_VAL(d);
+}
+
+void clox_set_string(VM* v, Value* val, char* s, size_t len) {
+    VM_enter(v);
+    ObjString* str = create_string(s, len);
+    *val = OBJ_VAL(str);
+}
+
+void clox_heap_limits(VM* v, double growth, size_t min_heap,
+                      size_t max_heap) {
+    VM_enter(v);
+    heap_configure(growth, min_heap, max_heap);
+}
+
+void clox_trace_ops(bool on) {
+    debug_trace_ops(on);
+}
+
+void clox_break(int line) {
+    debug_break(line);
+}
+
+void clox_attach() {
+    debug_attach();
+}
@@ -0,0 +1,90 @@
+#ifndef CLOX_H
+#define CLOX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Interface for embedding the interpreter, built as libclox by make lib.
+//
+// Every VM is a separate isolate. The host talks to it through a stack of
+// values: push a function and its arguments, call it, read the result and
+// pop it. Values are opaque, the host only holds pointers to them: the
+// arguments of a builtin, and the slots of the stack.
+
+typedef struct VM VM;
+typedef struct _Value Value;
+
+// What running code ends with, builtins included. A builtin returns
+// CLOX_HALTED to stop the script without an error.
+enum {
+    CLOX_OK,
+    CLOX_NO_FILE,
+    CLOX_COMPILE_ERROR,
+    CLOX_RUNTIME_ERROR,
+    CLOX_HALTED,
+};
+
+// A builtin gets its arguments as clox_arg(argv, 1) to clox_arg(argv, argc)
+// and leaves its result in *argv
+typedef int (BuiltinFn)(int argc, Value* argv);
+#define CLOX_BUILTIN(name) int builtin_##name(int argc, Value* argv)
+Value* clox_arg(Value* argv, int i);
+
+VM* clox_new();
+void clox_free(VM* v);
+
+// Compiles and runs source once, defining its globals
+int clox_run(VM* v, char* source);
+
+// Makes fn, declared with CLOX_BUILTIN, a global called name
+void clox_register(VM* v, char* name, BuiltinFn* fn);
+#define CLOX_REGISTER(v, name) clox_register(v, #name, builtin_##name)
+
+// Pushes the global called name, or returns false if it is undefined
+bool clox_get_global(VM* v, char* name);
+// Pushes a copy of val, such as an argument of a builtin
+void clox_push(VM* v, Value* val);
+void clox_push_nil(VM* v);
+void clox_push_bool(VM* v, bool b);
+void clox_push_number(VM* v, double d);
+void clox_push_string(VM* v, char* s, size_t len);
+// The value n below the top, 0 being the top, or NULL past the bottom. It
+// stays in place until the stack changes, and strings and other objects it
+// holds stay valid until the next clox_run or clox_call on that VM.
+Value* clox_peek(VM* v, int n);
+void clox_pop(VM* v);
+int clox_top(VM* v);
+
+// Calls the value below the top nargs values with them as arguments and
+// replaces all of them with the result, which is nil on an error. Not to
+// be used from inside a builtin.
+int clox_call(VM* v, int nargs);
+
+bool clox_is_nil(Value* val);
+bool clox_is_number(Value* val);
+// The number in val, or 0 for anything else
+double clox_number(Value* val);
+bool clox_truthy(Value* val);
+// The characters of a string value, or NULL for anything else
+char* clox_string(Value* val);
+
+// Results of builtins, stored into argv[0]
+void clox_set_nil(Value* val);
+void clox_set_bool(Value* val, bool b);
+void clox_set_number(Value* val, double d);
+void clox_set_string(VM* v, Value* val, char* s, size_t len);
+
+// After a collection the heap may grow to growth times what survived, and
+// to at least min_heap, before the next. Past max_heap, unless it is 0,
+// running code stops with a runtime error.
+void clox_heap_limits(VM* v, double growth, size_t min_heap, size_t max_heap);
+
+// Debugging for every VM in the process, to set up before running. The
+// interpreter switches to its instrumented loop at the next call or jump,
+// and back once none of these is on. Tracing prints each instruction to
+// stderr; the debugger stops at breakpoints and reads commands from stdin.
+void clox_trace_ops(bool on);
+void clox_break(int line);
+void clox_attach();
+
+#endif
@@ -1,17 +1,21 @@
 #include "compiler.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "object.h"
+#include "regcode.h"
 #include "scanner.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
 #define MAX_GLOBAL_REFS 256
+#define MAX_INLINE_CANDIDATES 256
+#define MAX_INLINE_CODE 64
 
 enum {
     PREC_0,
@@ -60,14 +64,6 @@ int infix_prec[TOKEN_MAX] = {
     [TOKEN_DOT] = PREC_POSTFIX,
 };
 
-struct {
-    Token cur;
-    Token prev;
-
-    bool hadError;
-    bool curError;
-} parser;
-
 typedef struct _Compiler {
     ObjFunction* f;
     struct _Compiler* parent;
@@ -87,6 +83,9 @@ typedef struct _Compiler {
         bool local;
     } upvalues[MAX_LOCALS];
     int nupvalues;
+    // Names of the upvalues a lazily compiled function starts with, or of
+    // those a skimmed one ends up with
+    Token* captured;
 
     int depth;
 
@@ -94,44 +93,85 @@ typedef struct _Compiler {
     int continueDepth;
     Vector(int) breakSrcs;
     int breakDepth;
-} Compiler;
 
-Compiler* curState;
+    bool deadCode;
+} Compiler;
 
-#define EMIT(b) chunk_write(&curState->f->chunk, b, parser.prev.line)
+// Everything one compile works on, so that several can run at once on
+// different threads.
+typedef struct {
+    Scanner scanner;
+    struct {
+        Token cur;
+        Token prev;
+
+        bool hadError;
+        bool curError;
+    } parser;
+    bool quiet; // don't print errors
+    bool lazy;  // skim function bodies, see skim_body
+    char* source;
+    ObjString* source_str; // copy of source kept by skimmed functions
+
+    Compiler* state;
+
+    // Global functions small enough to be copied into their call sites. A
+    // name is forgotten as soon as the compiler sees it being reassigned,
+    // and every inlined call is guarded by a check of the callee it pushed
+    // at runtime.
+    struct {
+        struct {
+            ObjString* name;
+            ObjFunction* f;
+        } cands[MAX_INLINE_CANDIDATES];
+        int ncands;
+    } inliner;
+} CompileCtx;
+
+#define EMIT(b) chunk_write(&ctx->state->f->chunk, b, ctx->parser.prev.line)
 #define EMIT2(b1, b2) (EMIT(b1), EMIT(b2))
-#define EMIT_CONST(v) chunk_push_const(&curState->f->chunk, v, parser.prev.line)
+#define EMIT_CONST(v)                                                          \
+    chunk_push_const(&ctx->state->f->chunk, v, ctx->parser.prev.line)
 
-void compiler_init(Compiler* c) {
-    c->f = create_function();
-    c->parent = curState;
+void compiler_init(CompileCtx* ctx, Compiler* c, ObjFunction* f) {
+    c->f = f;
+    c->parent = ctx->state;
     c->nglobalrefs = 0;
     c->locals[0].name.start = "";
     c->locals[0].name.len = 0;
     c->locals[0].depth = -1;
     c->nlocals = 1;
     c->nupvalues = 0;
-    c->depth = curState ? curState->depth : 0;
+    c->captured = NULL;
+    c->depth = ctx->state ? ctx->state->depth : 0;
     c->continueDepth = -1;
+    Vec_init(c->breakSrcs);
     c->breakDepth = -1;
-    curState = c;
+    c->deadCode = false;
+    ctx->state = c;
 }
 
-ObjFunction* compiler_end(bool ret_nil) {
-    if (ret_nil) {
+void parse_error(CompileCtx* ctx, char* message);
+
+ObjFunction* compiler_end(CompileCtx* ctx, bool ret_nil) {
+    if (ret_nil && !ctx->state->deadCode) {
         EMIT(OP_PUSH_NIL);
         EMIT(OP_RET);
     }
-    ObjFunction* f = curState->f;
-    f->nupvalues = curState->nupvalues;
+    ObjFunction* f = ctx->state->f;
+    f->nupvalues = ctx->state->nupvalues;
     if (f->nupvalues) {
-        f->upvalues = malloc(f->nupvalues * sizeof *f->upvalues);
-        memcpy(f->upvalues, curState->upvalues,
+        f->upvalues =
+            reallocate(NULL, 0, f->nupvalues * sizeof *f->upvalues);
+        memcpy(f->upvalues, ctx->state->upvalues,
                f->nupvalues * sizeof *f->upvalues);
     }
-    curState = curState->parent;
+    ctx->state = ctx->state->parent;
+    if (vm.regvm && !ctx->parser.hadError && !regcode_translate(f)) {
+        parse_error(ctx, "Function too large for register code.");
+    }
 #ifdef DEBUG_DISASM
-    if (!parser.hadError) disassemble_function(f);
+    if (!ctx->parser.hadError) disassemble_function(f);
     if (f->nupvalues) {
         eprintf("Closes over:");
         for (int i = 0; i < f->nupvalues; i++) {
@@ -144,93 +184,427 @@ ObjFunction* compiler_end(bool ret_nil) {
     return f;
 }
 
-void parse_error(char* message) {
-    parser.hadError = true;
-    if (parser.curError) return;
-    parser.curError = true;
+void parse_error(CompileCtx* ctx, char* message) {
+    ctx->parser.hadError = true;
+    if (ctx->parser.curError) return;
+    ctx->parser.curError = true;
+    if (ctx->quiet) return;
 
-    eprintf("Error line %d: ", parser.cur.line);
-    if (parser.cur.type == TOKEN_ERROR) {
-        eprintf("%s\n", parser.cur.start);
+    eprintf("Error line %d: ", ctx->parser.cur.line);
+    if (ctx->parser.cur.type == TOKEN_ERROR) {
+        eprintf("%s\n", ctx->parser.cur.start);
         return;
     }
-    if (parser.cur.type == TOKEN_EOF) {
+    if (ctx->parser.cur.type == TOKEN_EOF) {
         eprintf("at EOF: ");
     } else {
-        eprintf("at '%.*s': ", parser.cur.len, parser.cur.start);
+        eprintf("at '%.*s': ", ctx->parser.cur.len, ctx->parser.cur.start);
     }
     eprintf("%s\n", message);
 }
 
-void advance() {
-    parser.prev = parser.cur;
+void advance(CompileCtx* ctx) {
+    ctx->parser.prev = ctx->parser.cur;
 
     while (true) {
-        parser.cur = next_token();
-        if (parser.cur.type != TOKEN_ERROR) break;
-        parse_error(NULL);
+        ctx->parser.cur = next_token(&ctx->scanner);
+        if (ctx->parser.cur.type != TOKEN_ERROR) break;
+        parse_error(ctx, NULL);
     }
 }
 
-void parse_expr();
+void parse_expr(CompileCtx* ctx);
 
 #define IDENTS_EQUAL(a, b) (a.len == b.len && !memcmp(a.start, b.start, a.len))
 
-u8 global_ref_id(Token tok) {
-    for (int i = 0; i < curState->nglobalrefs; i++) {
-        if (IDENTS_EQUAL(curState->globalRefs[i].tok, tok)) {
-            return curState->globalRefs[i].id;
+u8 global_ref_id(CompileCtx* ctx, Token tok) {
+    for (int i = 0; i < ctx->state->nglobalrefs; i++) {
+        if (IDENTS_EQUAL(ctx->state->globalRefs[i].tok, tok)) {
+            return ctx->state->globalRefs[i].id;
         }
     }
-    u8 id = add_constant(&curState->f->chunk,
+    u8 id = add_constant(&ctx->state->f->chunk,
                          OBJ_VAL(create_string(tok.start, tok.len)));
-    curState->globalRefs[curState->nglobalrefs].tok = tok;
-    curState->globalRefs[curState->nglobalrefs].id = id;
-    curState->nglobalrefs++;
+    ctx->state->globalRefs[ctx->state->nglobalrefs].tok = tok;
+    ctx->state->globalRefs[ctx->state->nglobalrefs].id = id;
+    ctx->state->nglobalrefs++;
     return id;
 }
 
-#define EXPECT(t)                                                              \
-    if (parser.cur.type != t) {                                                \
-        parse_error("Expected " #t ".");                                       \
-        return;                                                                \
-    } else advance();
+#define GET_STRING(id) ((ObjString*) ctx->state->f->chunk.constants.d[id].obj)
+
+ObjFunction* inline_candidate(CompileCtx* ctx, ObjString* name) {
+    for (int i = 0; i < ctx->inliner.ncands; i++) {
+        if (ctx->inliner.cands[i].name == name) return ctx->inliner.cands[i].f;
+    }
+    return NULL;
+}
+
+void forget_inline(CompileCtx* ctx, ObjString* name) {
+    for (int i = 0; i < ctx->inliner.ncands; i++) {
+        if (ctx->inliner.cands[i].name == name) {
+            ctx->inliner.cands[i] = ctx->inliner.cands[--ctx->inliner.ncands];
+            return;
+        }
+    }
+}
+
+bool inlinable(ObjFunction* f) {
+    Chunk* c = &f->chunk;
+    if (f->nupvalues || c->code.size > MAX_INLINE_CODE ||
+        c->code.d[c->code.size - 1] != OP_RET)
+        return false;
+    int* depths = chunk_stack_depths(c, f->nargs + 1);
+    if (!depths) return false;
+    bool ok = true;
+    for (int off = 0; ok && off < c->code.size;
+         off += instr_len(&c->code.d[off])) {
+        u8* ip = &c->code.d[off];
+        switch (*ip) {
+            case OP_PUSH_CLOSURE:
+            case OP_PUSH_UPVALUE:
+            case OP_POP_UPVALUE:
+            case OP_DEF_GLOBAL:
+                ok = false;
+                break;
+            case OP_PUSH_GLOBAL:
+                ok = c->constants.d[ip[1]].obj != (Obj*) f->name;
+                break;
+            case OP_RET:
+                ok = off == c->code.size - 1 && depths[off] >= 2 &&
+                     depths[off] - 1 <= 255;
+                break;
+            case OP_PUSH_LOCAL:
+                ok = ip[1] > 0 && depths[off] > ip[1] &&
+                     depths[off] - ip[1] <= 255;
+                break;
+            case OP_POP_LOCAL:
+                ok = ip[1] > 0 && depths[off] - 1 > ip[1] &&
+                     depths[off] - 1 - ip[1] <= 255;
+                break;
+        }
+    }
+    free(depths);
+    return ok;
+}
+
+void register_inline(CompileCtx* ctx, ObjFunction* f) {
+    forget_inline(ctx, f->name);
+    if (ctx->inliner.ncands == MAX_INLINE_CANDIDATES || !inlinable(f)) return;
+    ctx->inliner.cands[ctx->inliner.ncands].name = f->name;
+    ctx->inliner.cands[ctx->inliner.ncands].f = f;
+    ctx->inliner.ncands++;
+}
 
-#define PARSE_RHS_LA() parse_precedence(infix_prec[parser.prev.type] + 1)
-#define PARSE_RHS_RA() parse_precedence(infix_prec[parser.prev.type])
+u8 global_string_id(CompileCtx* ctx, ObjString* str) {
+    Token tok;
+    tok.start = str->data;
+    tok.len = str->len;
+    return global_ref_id(ctx, tok);
+}
 
-#define CUR_POS (curState->f->chunk.code.size)
+#define EXPECT_OR(t, fail)                                                     \
+    if (ctx->parser.cur.type != t) {                                           \
+        parse_error(ctx, "Expected " #t ".");                                  \
+        return fail;                                                           \
+    } else advance(ctx);
+#define EXPECT(t) EXPECT_OR(t, )
 
-int emit_jmp(u8 opcode) {
+#define PARSE_RHS_LA()                                                         \
+    parse_precedence(ctx, infix_prec[ctx->parser.prev.type] + 1)
+#define PARSE_RHS_RA()                                                         \
+    parse_precedence(ctx, infix_prec[ctx->parser.prev.type])
+
+#define CUR_POS (ctx->state->f->chunk.code.size)
+#define NCONSTS (ctx->state->f->chunk.constants.size)
+
+int emit_jmp(CompileCtx* ctx, u8 opcode) {
     int instr = CUR_POS;
     EMIT(opcode);
     EMIT2(0, 0);
+    if (opcode == OP_JMP) ctx->state->deadCode = true;
     return instr;
 }
 
-void patch_jmp(int instr) {
+void patch_jmp(CompileCtx* ctx, int instr) {
     int off = CUR_POS - (instr + 3);
-    curState->f->chunk.code.d[instr + 1] = off & 0xff;
-    curState->f->chunk.code.d[instr + 2] = (off >> 8) & 0xff;
+    ctx->state->f->chunk.code.d[instr + 1] = off & 0xff;
+    ctx->state->f->chunk.code.d[instr + 2] = (off >> 8) & 0xff;
+    ctx->state->deadCode = false;
 }
 
-void emit_jmp_back(u8 opcode, int dest) {
+void emit_jmp_back(CompileCtx* ctx, u8 opcode, int dest) {
     int off = dest - (CUR_POS + 3);
     EMIT(opcode);
     EMIT2(off & 0xff, (off >> 8) & 0xff);
+    if (opcode == OP_JMP) ctx->state->deadCode = true;
+}
+
+// Copies the body of f in place of a call with nargs arguments. Its locals
+// are addressed relative to the top of the stack, which holds the callee
+// and the arguments where a real frame would. The guard falls back to the
+// OP_CALL following the body if the callee pushed before the arguments
+// turns out not to be f, and OP_INLINE_RET skips over that call. The copy
+// keeps the lines of f and is recorded in the chunk, along with the copies
+// nested in it, so that errors and profiles can still tell f's code apart.
+bool emit_inline(CompileCtx* ctx, ObjFunction* f, int nargs) {
+    Chunk* src = &f->chunk;
+    Chunk* dst = &ctx->state->f->chunk;
+    if (nargs != f->nargs || NCONSTS + src->constants.size + 1 > 256)
+        return false;
+    int* depths = chunk_stack_depths(src, nargs + 1);
+    if (!depths) return false;
+
+    int guard = CUR_POS;
+    u8 fconst = add_constant(dst, OBJ_VAL(f));
+    EMIT2(OP_INLINE, 0);
+    EMIT2(0, fconst);
+    EMIT(nargs);
+
+    int body = CUR_POS;
+    Vec_push_heap(dst->inlined,
+                  ((Inlined){body, body, fconst, ctx->parser.prev.line}));
+    int span = dst->inlined.size - 1;
+    // Where the constants of f holding functions inlined into it went
+    int kmap[256];
+
+#define EMIT_SRC(b) chunk_write(dst, b, line)
+#define EMIT_SRC2(b1, b2) (EMIT_SRC(b1), EMIT_SRC(b2))
+    for (int off = 0; off < src->code.size;
+         off += instr_len(&src->code.d[off])) {
+        u8* ip = &src->code.d[off];
+        int d = depths[off];
+        int line = chunk_get_instr_line(src, ip);
+        switch (*ip) {
+            case OP_PUSH_LOCAL:
+                EMIT_SRC2(OP_PUSH_STACK, d - ip[1]);
+                break;
+            case OP_POP_LOCAL:
+                EMIT_SRC2(OP_POP_STACK, d - 1 - ip[1]);
+                break;
+            case OP_RET:
+                EMIT_SRC2(OP_INLINE_RET, d - 1);
+                break;
+            case OP_PUSH_GLOBAL:
+            case OP_POP_GLOBAL:
+            case OP_GETATTR:
+            case OP_SETATTR: {
+                ObjString* name = (ObjString*) src->constants.d[ip[1]].obj;
+                EMIT_SRC2(*ip, global_string_id(ctx, name));
+                break;
+            }
+            case OP_PUSH_CONST:
+                EMIT_SRC2(*ip, add_constant(dst, src->constants.d[ip[1]]));
+                break;
+            case OP_INLINE:
+                kmap[ip[3]] = add_constant(dst, src->constants.d[ip[3]]);
+                EMIT_SRC2(*ip, ip[1]);
+                EMIT_SRC2(ip[2], kmap[ip[3]]);
+                EMIT_SRC(ip[4]);
+                break;
+            default:
+                for (int i = 0; i < instr_len(ip); i++) EMIT_SRC(ip[i]);
+        }
+    }
+#undef EMIT_SRC
+#undef EMIT_SRC2
+    free(depths);
+
+    dst->inlined.d[span].end = CUR_POS;
+    for (int i = 0; i < src->inlined.size; i++) {
+        Inlined in = src->inlined.d[i];
+        in.start += body;
+        in.end += body;
+        in.f = kmap[in.f];
+        Vec_push_heap(dst->inlined, in);
+    }
+
+    int off = CUR_POS - (guard + 5);
+    dst->code.d[guard + 1] = off & 0xff;
+    dst->code.d[guard + 2] = (off >> 8) & 0xff;
+    EMIT2(OP_CALL, nargs);
+    return true;
+}
+
+// Throws away everything emitted since pos, along with the constants that
+// only that code could have referenced.
+void rewind_code(CompileCtx* ctx, int pos, int nconsts) {
+    Chunk* c = &ctx->state->f->chunk;
+    chunk_cut(c, pos, c->code.size);
+    c->constants.size = nconsts;
+
+    int n = 0;
+    for (int i = 0; i < ctx->state->nglobalrefs; i++) {
+        if (ctx->state->globalRefs[i].id < nconsts) {
+            ctx->state->globalRefs[n++] = ctx->state->globalRefs[i];
+        }
+    }
+    ctx->state->nglobalrefs = n;
+
+    n = 0;
+    for (int i = 0; i < ctx->state->breakSrcs.size; i++) {
+        if (ctx->state->breakSrcs.d[i] < pos) {
+            ctx->state->breakSrcs.d[n++] = ctx->state->breakSrcs.d[i];
+        }
+    }
+    ctx->state->breakSrcs.size = n;
+}
+
+bool const_instr(CompileCtx* ctx, int start, int end, Value* v) {
+    Chunk* c = &ctx->state->f->chunk;
+    if (start >= end) return false;
+    switch (c->code.d[start]) {
+        case OP_PUSH_NIL:
+            *v = NIL_VAL;
+            return start + 1 == end;
+        case OP_PUSH_TRUE:
+            *v = BOOL_VAL(true);
+            return start + 1 == end;
+        case OP_PUSH_FALSE:
+            *v = BOOL_VAL(false);
+            return start + 1 == end;
+        case OP_PUSH_CONST:
+            *v = c->constants.d[c->code.d[start + 1]];
+            return start + 2 == end &&
+                   (v->type != VT_OBJ || v->obj->type == OT_STRING);
+        default:
+            return false;
+    }
+}
+
+void emit_value(CompileCtx* ctx, Value v) {
+    switch (v.type) {
+        case VT_NIL:
+            EMIT(OP_PUSH_NIL);
+            break;
+        case VT_BOOL:
+            EMIT(v.b ? OP_PUSH_TRUE : OP_PUSH_FALSE);
+            break;
+        default:
+            EMIT_CONST(v);
+    }
+}
+
+// Literals without a fraction that fit in 32 bits start out as integers
+void emit_number(CompileCtx* ctx) {
+    Token t = ctx->parser.prev;
+    double d = strtod(t.start, NULL);
+    if (!memchr(t.start, '.', t.len) && d <= INT32_MAX) {
+        EMIT_CONST(INT_VAL(d));
+    } else {
+        EMIT_CONST(NUMBER_VAL(d));
+    }
+}
+
+bool fold_int(u8 op, i32 a, i32 b, Value* res) {
+    i32 r;
+    switch (op) {
+        case OP_ADD:
+            if (!int_add(a, b, &r)) return false;
+            break;
+        case OP_SUB:
+            if (!int_sub(a, b, &r)) return false;
+            break;
+        case OP_MUL:
+            if (!int_mul(a, b, &r)) return false;
+            break;
+        case OP_MOD:
+            if (!int_mod(a, b, &r)) return false;
+            break;
+        default:
+            return false;
+    }
+    *res = INT_VAL(r);
+    return true;
+}
+
+bool fold_binary(u8 op, Value a, Value b, Value* res) {
+    if (a.type == VT_INT && b.type == VT_INT && fold_int(op, a.i, b.i, res)) {
+        return true;
+    }
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a), y = AS_NUMBER(b);
+        switch (op) {
+            case OP_ADD:
+                *res = NUMBER_VAL(x + y);
+                return true;
+            case OP_SUB:
+                *res = NUMBER_VAL(x - y);
+                return true;
+            case OP_MUL:
+                *res = NUMBER_VAL(x * y);
+                return true;
+            case OP_DIV:
+                *res = NUMBER_VAL(x / y);
+                return true;
+            case OP_MOD:
+                *res = NUMBER_VAL(fmod(x, y));
+                return true;
+            case OP_TGT:
+                *res = BOOL_VAL(x > y);
+                return true;
+            case OP_TLT:
+                *res = BOOL_VAL(x < y);
+                return true;
+        }
+    }
+    if (op == OP_TEQ) {
+        *res = BOOL_VAL(value_equal(a, b));
+        return true;
+    }
+    if (op == OP_ADD && isObjType(a, OT_STRING)) {
+        ObjString* bstr = isObjType(b, OT_STRING) ? (ObjString*) b.obj
+                                                  : string_value(b);
+        *res = OBJ_VAL(concat_string((ObjString*) a.obj, bstr));
+        return true;
+    }
+    return false;
+}
+
+void emit_unary(CompileCtx* ctx, int start, int nconsts, u8 op) {
+    Value a;
+    if (const_instr(ctx, start, CUR_POS, &a)) {
+        if (op == OP_NOT) {
+            rewind_code(ctx, start, nconsts);
+            emit_value(ctx, BOOL_VAL(!truthy(a)));
+            return;
+        } else if (a.type == VT_INT && a.i && a.i != INT32_MIN) {
+            rewind_code(ctx, start, nconsts);
+            emit_value(ctx, INT_VAL(-a.i));
+            return;
+        } else if (IS_NUMBER(a)) {
+            rewind_code(ctx, start, nconsts);
+            emit_value(ctx, NUMBER_VAL(-AS_NUMBER(a)));
+            return;
+        }
+    }
+    EMIT(op);
+}
+
+void emit_binary(CompileCtx* ctx, int start, int nconsts, int rhs, u8 op,
+                 bool negate) {
+    Value a, b, res;
+    if (const_instr(ctx, start, rhs, &a) &&
+        const_instr(ctx, rhs, CUR_POS, &b) && fold_binary(op, a, b, &res)) {
+        rewind_code(ctx, start, nconsts);
+        emit_value(ctx, negate ? BOOL_VAL(!res.b) : res);
+        return;
+    }
+    EMIT(op);
+    if (negate) EMIT(OP_NOT);
 }
 
-void parse_decl_or_stmt();
+void parse_decl_or_stmt(CompileCtx* ctx);
 
-void enter_scope() {
-    curState->depth++;
+void enter_scope(CompileCtx* ctx) {
+    ctx->state->depth++;
 }
 
-int pop_to_depth(int d) {
-    int npop = curState->nlocals;
-    for (int i = curState->nlocals - 1; i >= 0; i--) {
-        if (curState->locals[i].depth <= d) {
-            npop = curState->nlocals - i - 1;
+int pop_to_depth(CompileCtx* ctx, int d) {
+    int npop = ctx->state->nlocals;
+    for (int i = ctx->state->nlocals - 1; i >= 0; i--) {
+        if (ctx->state->locals[i].depth <= d) {
+            npop = ctx->state->nlocals - i - 1;
             break;
         }
     }
@@ -239,91 +613,155 @@ int pop_to_depth(int d) {
     return npop;
 }
 
-void leave_scope() {
-    curState->depth--;
-    curState->nlocals -= pop_to_depth(curState->depth);
+void leave_scope(CompileCtx* ctx) {
+    ctx->state->depth--;
+    ctx->state->nlocals -= pop_to_depth(ctx, ctx->state->depth);
 }
 
-void synchronize() {
-    advance();
-    while (parser.cur.type != TOKEN_EOF &&
-           parser.cur.type != TOKEN_LEFT_CURLY &&
-           parser.cur.type != TOKEN_RIGHT_CURLY &&
-           parser.prev.type != TOKEN_SEMICOLON)
-        advance();
-    parser.curError = false;
+void synchronize(CompileCtx* ctx) {
+    advance(ctx);
+    while (ctx->parser.cur.type != TOKEN_EOF &&
+           ctx->parser.cur.type != TOKEN_LEFT_CURLY &&
+           ctx->parser.cur.type != TOKEN_RIGHT_CURLY &&
+           ctx->parser.prev.type != TOKEN_SEMICOLON)
+        advance(ctx);
+    ctx->parser.curError = false;
 }
 
-void parse_block() {
-    while (parser.cur.type != TOKEN_EOF &&
-           parser.cur.type != TOKEN_RIGHT_CURLY) {
-        parse_decl_or_stmt();
-        if (parser.curError) synchronize();
+void parse_block(CompileCtx* ctx) {
+    int dead = -1, deadConsts = 0;
+    while (ctx->parser.cur.type != TOKEN_EOF &&
+           ctx->parser.cur.type != TOKEN_RIGHT_CURLY) {
+        parse_decl_or_stmt(ctx);
+        if (ctx->parser.curError) synchronize(ctx);
+        if (dead == -1 && ctx->state->deadCode) {
+            dead = CUR_POS;
+            deadConsts = NCONSTS;
+        }
+    }
+    if (dead != -1) {
+        rewind_code(ctx, dead, deadConsts);
+        ctx->state->deadCode = true;
     }
     EXPECT(TOKEN_RIGHT_CURLY);
 }
 
-void define_var(Token id_tok) {
-    if (curState->depth == 0) {
-        u8 id = global_ref_id(id_tok);
+void define_var(CompileCtx* ctx, Token id_tok) {
+    if (ctx->state->depth == 0) {
+        u8 id = global_ref_id(ctx, id_tok);
+        forget_inline(ctx, GET_STRING(id));
         EMIT2(OP_DEF_GLOBAL, id);
     } else {
-        curState->locals[curState->nlocals].name = id_tok;
-        curState->locals[curState->nlocals].depth = curState->depth;
-        curState->nlocals++;
+        ctx->state->locals[ctx->state->nlocals].name = id_tok;
+        ctx->state->locals[ctx->state->nlocals].depth = ctx->state->depth;
+        ctx->state->nlocals++;
     }
 }
 
-void parse_precedence(int prec);
+void parse_precedence(CompileCtx* ctx, int prec);
 
-void parse_function(ObjString* name, bool expr) {
-    Compiler compiler;
-    compiler_init(&compiler);
-
-    enter_scope();
-    EXPECT(TOKEN_LEFT_PAREN);
-    while (parser.cur.type != TOKEN_EOF &&
-           parser.cur.type != TOKEN_RIGHT_PAREN) {
-        EXPECT(TOKEN_IDENTIFIER);
-        define_var(parser.prev);
-        if (parser.cur.type != TOKEN_RIGHT_PAREN) {
-            EXPECT(TOKEN_COMMA);
+int resolve_local(Compiler* compiler, Token id_tok);
+int resolve_upvalue(Compiler* compiler, Token id_tok);
+
+// Parses a function body and throws its code away, leaving OP_LAZY in
+// its place to compile it on the first call. Syntax errors come out here
+// just as in a full compile, and the upvalues are the ones a full compile
+// finds, so the closures come out the same.
+void skim_body(CompileCtx* ctx, Token params) {
+    Compiler* c = ctx->state;
+    if (!ctx->source_str) {
+        ctx->source_str = create_string(ctx->source, strlen(ctx->source));
+    }
+    int pos = CUR_POS, nconsts = NCONSTS;
+    int nlocals = c->nlocals, depth = c->depth;
+    Token names[MAX_LOCALS];
+    c->captured = names;
+    enter_scope(ctx);
+    parse_block(ctx);
+    rewind_code(ctx, pos, nconsts);
+    c->captured = NULL;
+    c->nlocals = nlocals;
+    c->depth = depth;
+    c->deadCode = false;
+
+    LazyBody* body = ALLOCATE(LazyBody, 1);
+    body->source = ctx->source_str;
+    body->start = params.start - ctx->source;
+    body->line = params.line;
+    body->names = reallocate(NULL, 0, (c->nupvalues + 1) * sizeof *body->names);
+    for (int i = 0; i < c->nupvalues; i++) {
+        body->names[i].start = names[i].start - ctx->source;
+        body->names[i].len = names[i].len;
+    }
+    c->f->lazy = body;
+    EMIT(OP_LAZY);
+}
+
+// Parses the parameters and body into the current compiler and finishes
+// it. Returns NULL if it had to give up.
+ObjFunction* parse_function_body(CompileCtx* ctx, ObjString* name, bool expr,
+                                 bool lazy) {
+    Token params = ctx->parser.cur;
+    enter_scope(ctx);
+    EXPECT_OR(TOKEN_LEFT_PAREN, NULL);
+    while (ctx->parser.cur.type != TOKEN_EOF &&
+           ctx->parser.cur.type != TOKEN_RIGHT_PAREN) {
+        EXPECT_OR(TOKEN_IDENTIFIER, NULL);
+        define_var(ctx, ctx->parser.prev);
+        if (ctx->parser.cur.type != TOKEN_RIGHT_PAREN) {
+            EXPECT_OR(TOKEN_COMMA, NULL);
         }
     }
-    EXPECT(TOKEN_RIGHT_PAREN);
+    EXPECT_OR(TOKEN_RIGHT_PAREN, NULL);
 
-    curState->f->name = name;
-    curState->f->nargs = curState->nlocals - 1;
+    ctx->state->f->name = name;
+    ctx->state->f->nargs = ctx->state->nlocals - 1;
 
     bool nil_ret;
 
-    switch (parser.cur.type) {
+    switch (ctx->parser.cur.type) {
         case TOKEN_LEFT_CURLY: {
-            advance();
-            enter_scope();
-            parse_block();
+            advance(ctx);
+            if (lazy) {
+                skim_body(ctx, params);
+                nil_ret = false;
+                break;
+            }
+            enter_scope(ctx);
+            parse_block(ctx);
             nil_ret = true;
             break;
         }
         case TOKEN_ARROW: {
-            advance();
-            parse_precedence(PREC_ASSN);
+            advance(ctx);
+            parse_precedence(ctx, PREC_ASSN);
             EMIT(OP_RET);
             if (!expr) {
-                EXPECT(TOKEN_SEMICOLON)
+                EXPECT_OR(TOKEN_SEMICOLON, NULL)
             }
             nil_ret = false;
             break;
         }
         default:
-            parse_error("Expected block or arrow function.");
-            return;
+            parse_error(ctx, "Expected block or arrow function.");
+            return NULL;
     }
 
-    ObjFunction* func = compiler_end(nil_ret);
+    return compiler_end(ctx, nil_ret);
+}
+
+void parse_function(CompileCtx* ctx, ObjString* name, bool expr) {
+    Compiler compiler;
+    compiler_init(ctx, &compiler, create_function());
+
+    ObjFunction* func = parse_function_body(ctx, name, expr, ctx->lazy);
+    if (!func) {
+        ctx->state = compiler.parent;
+        return;
+    }
 
     if (func->nupvalues) {
-        u8 id = add_constant(&curState->f->chunk, OBJ_VAL(func));
+        u8 id = add_constant(&ctx->state->f->chunk, OBJ_VAL(func));
         EMIT2(OP_PUSH_CLOSURE, id);
     } else {
         EMIT_CONST(OBJ_VAL(func));
@@ -338,7 +776,13 @@ int resolve_local(Compiler* compiler, Token id_tok) {
 }
 
 int resolve_upvalue(Compiler* compiler, Token id_tok) {
-    if (!compiler->parent) return -1;
+    if (!compiler->parent) {
+        // A lazily compiled function can only see what was captured for it
+        for (int i = 0; compiler->captured && i < compiler->nupvalues; i++) {
+            if (IDENTS_EQUAL(compiler->captured[i], id_tok)) return i;
+        }
+        return -1;
+    }
     int id = resolve_local(compiler->parent, id_tok);
     bool local = true;
     if (id == -1) {
@@ -353,9 +797,15 @@ int resolve_upvalue(Compiler* compiler, Token id_tok) {
     }
     compiler->upvalues[compiler->nupvalues].id = id;
     compiler->upvalues[compiler->nupvalues].local = local;
+    if (compiler->captured) compiler->captured[compiler->nupvalues] = id_tok;
     return compiler->nupvalues++;
 }
 
+void emit_store(CompileCtx* ctx, u8 pop_op, u8 id) {
+    if (pop_op == OP_POP_GLOBAL) forget_inline(ctx, GET_STRING(id));
+    EMIT2(pop_op, id);
+}
+
 char escape_char(char c) {
     switch (c) {
         case 'n':
@@ -369,49 +819,51 @@ char escape_char(char c) {
     }
 }
 
-void parse_precedence(int prec) {
-    switch (parser.cur.type) {
+void parse_precedence(CompileCtx* ctx, int prec) {
+    int start = CUR_POS, startConsts = NCONSTS;
+
+    switch (ctx->parser.cur.type) {
         case TOKEN_MINUS:
-            advance();
-            parse_precedence(PREC_PREFIX);
-            EMIT(OP_NEG);
+            advance(ctx);
+            parse_precedence(ctx, PREC_PREFIX);
+            emit_unary(ctx, start, startConsts, OP_NEG);
             break;
         case TOKEN_NOT:
-            advance();
-            parse_precedence(PREC_PREFIX);
-            EMIT(OP_NOT);
+            advance(ctx);
+            parse_precedence(ctx, PREC_PREFIX);
+            emit_unary(ctx, start, startConsts, OP_NOT);
             break;
         case TOKEN_LEFT_PAREN:
-            advance();
-            parse_precedence(PREC_NONE);
+            advance(ctx);
+            parse_precedence(ctx, PREC_NONE);
             EXPECT(TOKEN_RIGHT_PAREN);
             break;
         case TOKEN_NUMBER:
-            advance();
-            EMIT_CONST(NUMBER_VAL(strtod(parser.prev.start, NULL)));
+            advance(ctx);
+            emit_number(ctx);
             break;
         case TOKEN_TRUE:
-            advance();
+            advance(ctx);
             EMIT(OP_PUSH_TRUE);
             break;
         case TOKEN_FALSE:
-            advance();
+            advance(ctx);
             EMIT(OP_PUSH_FALSE);
             break;
         case TOKEN_NIL:
-            advance();
+            advance(ctx);
             EMIT(OP_PUSH_NIL);
             break;
         case TOKEN_STRING: {
-            advance();
-            char* buf = malloc(parser.prev.len);
+            advance(ctx);
+            char* buf = malloc(ctx->parser.prev.len);
             char* p = buf;
-            for (int i = 1; i < parser.prev.len - 1; i++) {
-                if (parser.prev.start[i] == '\\') {
+            for (int i = 1; i < ctx->parser.prev.len - 1; i++) {
+                if (ctx->parser.prev.start[i] == '\\') {
                     i++;
-                    *p++ = escape_char(parser.prev.start[i]);
+                    *p++ = escape_char(ctx->parser.prev.start[i]);
                 } else {
-                    *p++ = parser.prev.start[i];
+                    *p++ = ctx->parser.prev.start[i];
                 }
             }
             EMIT_CONST(OBJ_VAL(create_string(buf, p - buf)));
@@ -419,70 +871,70 @@ void parse_precedence(int prec) {
             break;
         }
         case TOKEN_CHAR: {
-            advance();
+            advance(ctx);
             char c;
-            if (parser.prev.start[1] == '\\') {
-                c = escape_char(parser.prev.start[2]);
+            if (ctx->parser.prev.start[1] == '\\') {
+                c = escape_char(ctx->parser.prev.start[2]);
             } else {
-                c = parser.prev.start[1];
+                c = ctx->parser.prev.start[1];
             }
             EMIT_CONST(CHAR_VAL(c));
             break;
         }
         case TOKEN_IDENTIFIER:
-            advance();
+            advance(ctx);
 
             u8 push_op = OP_PUSH_LOCAL, pop_op = OP_POP_LOCAL;
 
-            int id = resolve_local(curState, parser.prev);
+            int id = resolve_local(ctx->state, ctx->parser.prev);
 
             if (id == -1) {
-                id = resolve_upvalue(curState, parser.prev);
+                id = resolve_upvalue(ctx->state, ctx->parser.prev);
                 push_op = OP_PUSH_UPVALUE, pop_op = OP_POP_UPVALUE;
                 if (id == -1) {
-                    id = global_ref_id(parser.prev);
+                    id = global_ref_id(ctx, ctx->parser.prev);
                     push_op = OP_PUSH_GLOBAL, pop_op = OP_POP_GLOBAL;
                 }
             }
 
             if (prec <= PREC_ASSN) {
-                switch (parser.cur.type) {
+                switch (ctx->parser.cur.type) {
                     case TOKEN_EQUAL:
-                        advance();
+                        advance(ctx);
                         PARSE_RHS_RA();
-                        EMIT2(pop_op, id);
+                        emit_store(ctx, pop_op, id);
                         EMIT(OP_PUSH);
                         break;
                     case TOKEN_PLUS_EQUAL:
-                        advance();
+                        advance(ctx);
                         EMIT2(push_op, id);
                         PARSE_RHS_RA();
                         EMIT(OP_ADD);
-                        EMIT2(pop_op, id);
+                        emit_store(ctx, pop_op, id);
                         EMIT(OP_PUSH);
                         break;
                     case TOKEN_MINUS_EQUAL:
-                        advance();
+                        advance(ctx);
                         EMIT2(push_op, id);
                         PARSE_RHS_RA();
                         EMIT(OP_SUB);
-                        EMIT2(pop_op, id);
+                        emit_store(ctx, pop_op, id);
                         EMIT(OP_PUSH);
                         break;
                     case TOKEN_STAR_EQUAL:
-                        advance();
+                        advance(ctx);
                         EMIT2(push_op, id);
                         PARSE_RHS_RA();
                         EMIT(OP_MUL);
-                        EMIT2(pop_op, id);
+                        emit_store(ctx, pop_op, id);
                         EMIT(OP_PUSH);
                         break;
                     case TOKEN_SLASH_EQUAL:
-                        advance();
+                        advance(ctx);
                         EMIT2(push_op, id);
                         PARSE_RHS_RA();
                         EMIT(OP_DIV);
-                        EMIT2(pop_op, id);
+                        emit_store(ctx, pop_op, id);
                         EMIT(OP_PUSH);
                         break;
                     default:
@@ -493,27 +945,27 @@ void parse_precedence(int prec) {
             }
             break;
         case TOKEN_FUN: {
-            advance();
+            advance(ctx);
 
-            parse_function(NULL, true);
+            parse_function(ctx, NULL, true);
             break;
         }
         case TOKEN_ARRAY: {
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_LEFT_SQUARE);
-            parse_expr();
+            parse_expr(ctx);
             EXPECT(TOKEN_RIGHT_SQUARE);
             EMIT(OP_PUSH_ARRAY);
             break;
         }
         case TOKEN_LEFT_SQUARE: {
-            advance();
+            advance(ctx);
             int len = 0;
-            while (parser.cur.type != TOKEN_EOF &&
-                   parser.cur.type != TOKEN_RIGHT_SQUARE) {
-                parse_precedence(PREC_ASSN);
+            while (ctx->parser.cur.type != TOKEN_EOF &&
+                   ctx->parser.cur.type != TOKEN_RIGHT_SQUARE) {
+                parse_precedence(ctx, PREC_ASSN);
                 len++;
-                if (parser.cur.type != TOKEN_RIGHT_SQUARE) {
+                if (ctx->parser.cur.type != TOKEN_RIGHT_SQUARE) {
                     EXPECT(TOKEN_COMMA);
                 }
             }
@@ -522,141 +974,207 @@ void parse_precedence(int prec) {
             break;
         }
         default:
-            parse_error("Unexpected token.");
+            parse_error(ctx, "Unexpected token.");
             return;
     }
 
-    while (infix_prec[parser.cur.type] >= prec) {
-        switch (parser.cur.type) {
-            case TOKEN_COMMA:
-                advance();
-                EMIT(OP_POP);
+    while (infix_prec[ctx->parser.cur.type] >= prec) {
+        switch (ctx->parser.cur.type) {
+            case TOKEN_COMMA: {
+                advance(ctx);
+                Value v;
+                if (const_instr(ctx, start, CUR_POS, &v)) {
+                    rewind_code(ctx, start, startConsts);
+                } else {
+                    EMIT(OP_POP);
+                }
                 PARSE_RHS_RA();
                 break;
+            }
             case TOKEN_EQUAL:
-                parse_error("Invalid assignment.");
+                parse_error(ctx, "Invalid assignment.");
                 return;
             case TOKEN_PLUS_EQUAL:
-                parse_error("Invalid assignment.");
+                parse_error(ctx, "Invalid assignment.");
                 return;
             case TOKEN_MINUS_EQUAL:
-                parse_error("Invalid assignment.");
+                parse_error(ctx, "Invalid assignment.");
                 return;
             case TOKEN_STAR_EQUAL:
-                parse_error("Invalid assignment.");
+                parse_error(ctx, "Invalid assignment.");
                 return;
             case TOKEN_SLASH_EQUAL:
-                parse_error("Invalid assignment.");
+                parse_error(ctx, "Invalid assignment.");
                 return;
             case TOKEN_QUESTION: {
-                advance();
-                int ifjmp = emit_jmp(OP_JMP_FALSE);
+                advance(ctx);
+                Value cond;
+                if (const_instr(ctx, start, CUR_POS, &cond)) {
+                    bool taken = truthy(cond);
+                    rewind_code(ctx, start, startConsts);
+                    int branch = CUR_POS, branchConsts = NCONSTS;
+                    PARSE_RHS_RA();
+                    EXPECT(TOKEN_COLON);
+                    if (!taken) rewind_code(ctx, branch, branchConsts);
+                    branch = CUR_POS, branchConsts = NCONSTS;
+                    PARSE_RHS_RA();
+                    if (taken) rewind_code(ctx, branch, branchConsts);
+                    break;
+                }
+                int ifjmp = emit_jmp(ctx, OP_JMP_FALSE);
                 PARSE_RHS_RA();
                 EXPECT(TOKEN_COLON);
-                int elsejmp = emit_jmp(OP_JMP);
-                patch_jmp(ifjmp);
+                int elsejmp = emit_jmp(ctx, OP_JMP);
+                patch_jmp(ctx, ifjmp);
                 PARSE_RHS_RA();
-                patch_jmp(elsejmp);
+                patch_jmp(ctx, elsejmp);
                 break;
             }
             case TOKEN_COLON:
                 return;
             case TOKEN_OR: {
-                advance();
-                int jmpsc = emit_jmp(OP_JMP_TRUE);
+                advance(ctx);
+                Value lhs;
+                if (const_instr(ctx, start, CUR_POS, &lhs)) {
+                    int rhs = CUR_POS, rhsConsts = NCONSTS;
+                    PARSE_RHS_RA();
+                    if (truthy(lhs)) rewind_code(ctx, rhs, rhsConsts);
+                    else chunk_cut(&ctx->state->f->chunk, start, rhs);
+                    break;
+                }
+                int jmpsc = emit_jmp(ctx, OP_JMP_TRUE);
                 PARSE_RHS_RA();
                 EMIT(OP_POP);
-                patch_jmp(jmpsc);
+                patch_jmp(ctx, jmpsc);
                 EMIT(OP_PUSH);
                 break;
             }
             case TOKEN_AND: {
-                advance();
-                int jmpsc = emit_jmp(OP_JMP_FALSE);
+                advance(ctx);
+                Value lhs;
+                if (const_instr(ctx, start, CUR_POS, &lhs)) {
+                    int rhs = CUR_POS, rhsConsts = NCONSTS;
+                    PARSE_RHS_RA();
+                    if (!truthy(lhs)) rewind_code(ctx, rhs, rhsConsts);
+                    else chunk_cut(&ctx->state->f->chunk, start, rhs);
+                    break;
+                }
+                int jmpsc = emit_jmp(ctx, OP_JMP_FALSE);
                 PARSE_RHS_RA();
                 EMIT(OP_POP);
-                patch_jmp(jmpsc);
+                patch_jmp(ctx, jmpsc);
                 EMIT(OP_PUSH);
                 break;
             }
-            case TOKEN_EQUAL_EQUAL:
-                advance();
+            case TOKEN_EQUAL_EQUAL: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_TEQ);
+                emit_binary(ctx, start, startConsts, rhs, OP_TEQ, false);
                 break;
-            case TOKEN_NOT_EQUAL:
-                advance();
+            }
+            case TOKEN_NOT_EQUAL: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT2(OP_TEQ, OP_NOT);
+                emit_binary(ctx, start, startConsts, rhs, OP_TEQ, true);
                 break;
-            case TOKEN_LESS:
-                advance();
+            }
+            case TOKEN_LESS: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_TLT);
+                emit_binary(ctx, start, startConsts, rhs, OP_TLT, false);
                 break;
-            case TOKEN_LESS_EQUAL:
-                advance();
+            }
+            case TOKEN_LESS_EQUAL: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT2(OP_TGT, OP_NOT);
+                emit_binary(ctx, start, startConsts, rhs, OP_TGT, true);
                 break;
-            case TOKEN_GREATER:
-                advance();
+            }
+            case TOKEN_GREATER: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_TGT);
+                emit_binary(ctx, start, startConsts, rhs, OP_TGT, false);
                 break;
-            case TOKEN_GREATER_EQUAL:
-                advance();
+            }
+            case TOKEN_GREATER_EQUAL: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT2(OP_TLT, OP_NOT);
+                emit_binary(ctx, start, startConsts, rhs, OP_TLT, true);
                 break;
-            case TOKEN_PLUS:
-                advance();
+            }
+            case TOKEN_PLUS: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_ADD);
+                emit_binary(ctx, start, startConsts, rhs, OP_ADD, false);
                 break;
-            case TOKEN_MINUS:
-                advance();
+            }
+            case TOKEN_MINUS: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_SUB);
+                emit_binary(ctx, start, startConsts, rhs, OP_SUB, false);
                 break;
-            case TOKEN_STAR:
-                advance();
+            }
+            case TOKEN_STAR: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_MUL);
+                emit_binary(ctx, start, startConsts, rhs, OP_MUL, false);
                 break;
-            case TOKEN_SLASH:
-                advance();
+            }
+            case TOKEN_SLASH: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_DIV);
+                emit_binary(ctx, start, startConsts, rhs, OP_DIV, false);
                 break;
-            case TOKEN_PERCENT:
-                advance();
+            }
+            case TOKEN_PERCENT: {
+                advance(ctx);
+                int rhs = CUR_POS;
                 PARSE_RHS_LA();
-                EMIT(OP_MOD);
+                emit_binary(ctx, start, startConsts, rhs, OP_MOD, false);
                 break;
+            }
             case TOKEN_LEFT_PAREN: {
-                advance();
+                advance(ctx);
+                ObjString* callee = NULL;
+                if (start + 2 == CUR_POS &&
+                    ctx->state->f->chunk.code.d[start] == OP_PUSH_GLOBAL) {
+                    callee = GET_STRING(ctx->state->f->chunk.code.d[start + 1]);
+                }
                 int nargs = 0;
-                while (parser.cur.type != TOKEN_EOF &&
-                       parser.cur.type != TOKEN_RIGHT_PAREN) {
-                    parse_precedence(PREC_ASSN);
+                while (ctx->parser.cur.type != TOKEN_EOF &&
+                       ctx->parser.cur.type != TOKEN_RIGHT_PAREN) {
+                    parse_precedence(ctx, PREC_ASSN);
                     nargs++;
-                    if (parser.cur.type != TOKEN_RIGHT_PAREN) {
+                    if (ctx->parser.cur.type != TOKEN_RIGHT_PAREN) {
                         EXPECT(TOKEN_COMMA);
                     }
                 }
                 EXPECT(TOKEN_RIGHT_PAREN);
-                EMIT2(OP_CALL, nargs);
+                ObjFunction* inl =
+                    callee ? inline_candidate(ctx, callee) : NULL;
+                if (!inl || !emit_inline(ctx, inl, nargs)) {
+                    EMIT2(OP_CALL, nargs);
+                }
                 break;
             }
             case TOKEN_LEFT_SQUARE: {
-                advance();
+                advance(ctx);
 
-                parse_expr();
+                parse_expr(ctx);
                 EXPECT(TOKEN_RIGHT_SQUARE);
 
-                if (prec <= PREC_ASSN && parser.cur.type == TOKEN_EQUAL) {
-                    advance();
+                if (prec <= PREC_ASSN && ctx->parser.cur.type == TOKEN_EQUAL) {
+                    advance(ctx);
                     PARSE_RHS_RA();
                     EMIT(OP_SETITEM);
                 } else {
@@ -665,11 +1183,11 @@ void parse_precedence(int prec) {
                 break;
             }
             case TOKEN_DOT: {
-                advance();
+                advance(ctx);
                 EXPECT(TOKEN_IDENTIFIER);
-                u8 id = global_ref_id(parser.prev);
-                if (prec <= PREC_ASSN && parser.cur.type == TOKEN_EQUAL) {
-                    advance();
+                u8 id = global_ref_id(ctx, ctx->parser.prev);
+                if (prec <= PREC_ASSN && ctx->parser.cur.type == TOKEN_EQUAL) {
+                    advance(ctx);
                     PARSE_RHS_RA();
                     EMIT2(OP_SETATTR, id);
                 } else {
@@ -683,349 +1201,490 @@ void parse_precedence(int prec) {
     }
 }
 
-void parse_expr() {
-    parse_precedence(PREC_NONE);
+void parse_expr(CompileCtx* ctx) {
+    parse_precedence(ctx, PREC_NONE);
 }
 
-void parse_stmt() {
-    switch (parser.cur.type) {
+void parse_stmt(CompileCtx* ctx) {
+    switch (ctx->parser.cur.type) {
         case TOKEN_LEFT_CURLY:
-            advance();
-            enter_scope();
-            parse_block();
-            leave_scope();
+            advance(ctx);
+            enter_scope(ctx);
+            parse_block(ctx);
+            leave_scope(ctx);
             break;
         case TOKEN_IF: {
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_LEFT_PAREN);
-            parse_expr();
+            int cond = CUR_POS, condConsts = NCONSTS;
+            parse_expr(ctx);
             EXPECT(TOKEN_RIGHT_PAREN);
-            int ifjmp = emit_jmp(OP_JMP_FALSE);
-            parse_stmt();
-            if (parser.cur.type == TOKEN_ELSE) {
-                advance();
-                int elsejmp = emit_jmp(OP_JMP);
-                patch_jmp(ifjmp);
-                parse_stmt();
-                patch_jmp(elsejmp);
+            Value v;
+            if (const_instr(ctx, cond, CUR_POS, &v)) {
+                bool taken = truthy(v);
+                rewind_code(ctx, cond, condConsts);
+                bool dead = ctx->state->deadCode;
+                int branch = CUR_POS, branchConsts = NCONSTS;
+                parse_stmt(ctx);
+                if (!taken) {
+                    rewind_code(ctx, branch, branchConsts);
+                    ctx->state->deadCode = dead;
+                }
+                if (ctx->parser.cur.type == TOKEN_ELSE) {
+                    advance(ctx);
+                    dead = ctx->state->deadCode;
+                    branch = CUR_POS, branchConsts = NCONSTS;
+                    parse_stmt(ctx);
+                    if (taken) {
+                        rewind_code(ctx, branch, branchConsts);
+                        ctx->state->deadCode = dead;
+                    }
+                }
+                break;
+            }
+            int ifjmp = emit_jmp(ctx, OP_JMP_FALSE);
+            parse_stmt(ctx);
+            if (ctx->parser.cur.type == TOKEN_ELSE) {
+                advance(ctx);
+                int elsejmp = emit_jmp(ctx, OP_JMP);
+                patch_jmp(ctx, ifjmp);
+                parse_stmt(ctx);
+                patch_jmp(ctx, elsejmp);
             } else {
-                patch_jmp(ifjmp);
+                patch_jmp(ctx, ifjmp);
             }
             break;
         }
         case TOKEN_WHILE: {
-            advance();
+            advance(ctx);
 
-            int loopdest = CUR_POS;
+            int loopdest = CUR_POS, loopConsts = NCONSTS;
+            bool dead = ctx->state->deadCode;
 
-            int oldContinueDest = curState->continueDest;
-            int oldContinueDepth = curState->continueDepth;
-            curState->continueDest = loopdest;
-            curState->continueDepth = curState->depth;
+            int oldContinueDest = ctx->state->continueDest;
+            int oldContinueDepth = ctx->state->continueDepth;
+            ctx->state->continueDest = loopdest;
+            ctx->state->continueDepth = ctx->state->depth;
 
             EXPECT(TOKEN_LEFT_PAREN);
-            parse_expr();
+            parse_expr(ctx);
             EXPECT(TOKEN_RIGHT_PAREN);
 
-            int breakjmp = emit_jmp(OP_JMP_FALSE);
+            Value cond;
+            int breakjmp = -1;
+            bool never = false;
+            if (const_instr(ctx, loopdest, CUR_POS, &cond)) {
+                never = !truthy(cond);
+                rewind_code(ctx, loopdest, loopConsts);
+            } else {
+                breakjmp = emit_jmp(ctx, OP_JMP_FALSE);
+            }
 
             Vector(int) oldBreakSrcs;
-            Vec_copy(oldBreakSrcs, curState->breakSrcs);
-            int oldBreakDepth = curState->breakDepth;
-            Vec_init(curState->breakSrcs);
-            curState->breakDepth = curState->depth;
+            Vec_copy(oldBreakSrcs, ctx->state->breakSrcs);
+            int oldBreakDepth = ctx->state->breakDepth;
+            Vec_init(ctx->state->breakSrcs);
+            ctx->state->breakDepth = ctx->state->depth;
 
-            parse_stmt();
+            parse_stmt(ctx);
 
-            emit_jmp_back(OP_JMP, loopdest);
-            patch_jmp(breakjmp);
-            for (int i = 0; i < curState->breakSrcs.size; i++) {
-                patch_jmp(curState->breakSrcs.d[i]);
+            if (!ctx->state->deadCode) emit_jmp_back(ctx, OP_JMP, loopdest);
+            if (never) {
+                rewind_code(ctx, loopdest, loopConsts);
+                ctx->state->deadCode = dead;
+            }
+            if (breakjmp != -1) patch_jmp(ctx, breakjmp);
+            for (int i = 0; i < ctx->state->breakSrcs.size; i++) {
+                patch_jmp(ctx, ctx->state->breakSrcs.d[i]);
             }
 
-            Vec_free(curState->breakSrcs);
-            Vec_copy(curState->breakSrcs, oldBreakSrcs);
-            curState->breakDepth = oldBreakDepth;
-            curState->continueDest = oldContinueDest;
-            curState->continueDepth = oldContinueDepth;
+            Vec_free(ctx->state->breakSrcs);
+            Vec_copy(ctx->state->breakSrcs, oldBreakSrcs);
+            ctx->state->breakDepth = oldBreakDepth;
+            ctx->state->continueDest = oldContinueDest;
+            ctx->state->continueDepth = oldContinueDepth;
             break;
         }
         case TOKEN_FOR: {
-            advance();
+            advance(ctx);
 
-            enter_scope();
+            enter_scope(ctx);
 
             EXPECT(TOKEN_LEFT_PAREN);
-            parse_decl_or_stmt();
+            parse_decl_or_stmt(ctx);
 
-            int loopdest = CUR_POS;
+            int loopdest = CUR_POS, loopConsts = NCONSTS;
+            bool dead = ctx->state->deadCode;
 
-            if (parser.cur.type == TOKEN_SEMICOLON) {
-                advance();
-                EMIT(OP_PUSH_TRUE);
+            Value cond = BOOL_VAL(true);
+            if (ctx->parser.cur.type == TOKEN_SEMICOLON) {
+                advance(ctx);
             } else {
-                parse_expr();
+                parse_expr(ctx);
                 EXPECT(TOKEN_SEMICOLON);
             }
 
-            int jmpbreak = emit_jmp(OP_JMP_FALSE);
-            int jmpbody = emit_jmp(OP_JMP);
+            int jmpbreak = -1;
+            bool never = false;
+            if (loopdest == CUR_POS ||
+                const_instr(ctx, loopdest, CUR_POS, &cond)) {
+                never = !truthy(cond);
+                rewind_code(ctx, loopdest, loopConsts);
+            } else {
+                jmpbreak = emit_jmp(ctx, OP_JMP_FALSE);
+            }
+            int jmpbody = emit_jmp(ctx, OP_JMP);
 
             int assndest = CUR_POS;
-            int oldContinueDest = curState->continueDest;
-            int oldContinueDepth = curState->continueDepth;
-            curState->continueDest = assndest;
-            curState->continueDepth = curState->depth;
-            if (parser.cur.type == TOKEN_RIGHT_PAREN) {
-                advance();
+            int oldContinueDest = ctx->state->continueDest;
+            int oldContinueDepth = ctx->state->continueDepth;
+            ctx->state->continueDest = assndest;
+            ctx->state->continueDepth = ctx->state->depth;
+            if (ctx->parser.cur.type == TOKEN_RIGHT_PAREN) {
+                advance(ctx);
             } else {
-                parse_expr();
+                parse_expr(ctx);
                 EMIT(OP_POP);
                 EXPECT(TOKEN_RIGHT_PAREN);
             }
-            emit_jmp_back(OP_JMP, loopdest);
-            patch_jmp(jmpbody);
+            emit_jmp_back(ctx, OP_JMP, loopdest);
+            patch_jmp(ctx, jmpbody);
 
             Vector(int) oldBreakSrcs;
-            Vec_copy(oldBreakSrcs, curState->breakSrcs);
-            int oldBreakDepth = curState->breakDepth;
-            Vec_init(curState->breakSrcs);
-            curState->breakDepth = curState->depth;
+            Vec_copy(oldBreakSrcs, ctx->state->breakSrcs);
+            int oldBreakDepth = ctx->state->breakDepth;
+            Vec_init(ctx->state->breakSrcs);
+            ctx->state->breakDepth = ctx->state->depth;
 
-            parse_stmt();
-            emit_jmp_back(OP_JMP, assndest);
+            parse_stmt(ctx);
+            if (!ctx->state->deadCode) emit_jmp_back(ctx, OP_JMP, assndest);
 
-            patch_jmp(jmpbreak);
-            for (int i = 0; i < curState->breakSrcs.size; i++) {
-                patch_jmp(curState->breakSrcs.d[i]);
+            if (never) {
+                rewind_code(ctx, loopdest, loopConsts);
+                ctx->state->deadCode = dead;
+            }
+            if (jmpbreak != -1) patch_jmp(ctx, jmpbreak);
+            for (int i = 0; i < ctx->state->breakSrcs.size; i++) {
+                patch_jmp(ctx, ctx->state->breakSrcs.d[i]);
             }
 
-            Vec_free(curState->breakSrcs);
-            Vec_copy(curState->breakSrcs, oldBreakSrcs);
-            curState->breakDepth = oldBreakDepth;
+            Vec_free(ctx->state->breakSrcs);
+            Vec_copy(ctx->state->breakSrcs, oldBreakSrcs);
+            ctx->state->breakDepth = oldBreakDepth;
 
-            curState->continueDest = oldContinueDest;
-            curState->continueDepth = oldContinueDepth;
+            ctx->state->continueDest = oldContinueDest;
+            ctx->state->continueDepth = oldContinueDepth;
 
-            leave_scope();
+            leave_scope(ctx);
             break;
         }
         case TOKEN_DO: {
-            advance();
+            advance(ctx);
 
             int loopdest = CUR_POS;
 
             Vector(int) oldBreakSrcs;
-            Vec_copy(oldBreakSrcs, curState->breakSrcs);
-            int oldBreakDepth = curState->breakDepth;
-            Vec_init(curState->breakSrcs);
-            curState->breakDepth = curState->depth;
+            Vec_copy(oldBreakSrcs, ctx->state->breakSrcs);
+            int oldBreakDepth = ctx->state->breakDepth;
+            Vec_init(ctx->state->breakSrcs);
+            ctx->state->breakDepth = ctx->state->depth;
 
-            int oldContinueDest = curState->continueDest;
-            int oldContinueDepth = curState->continueDepth;
-            curState->continueDest = loopdest;
-            curState->continueDepth = curState->depth;
+            int oldContinueDest = ctx->state->continueDest;
+            int oldContinueDepth = ctx->state->continueDepth;
+            ctx->state->continueDest = loopdest;
+            ctx->state->continueDepth = ctx->state->depth;
 
-            parse_stmt();
+            parse_stmt(ctx);
 
             EXPECT(TOKEN_WHILE);
             EXPECT(TOKEN_LEFT_PAREN);
-            parse_expr();
+            int cond = CUR_POS, condConsts = NCONSTS;
+            parse_expr(ctx);
             EXPECT(TOKEN_RIGHT_PAREN);
             EXPECT(TOKEN_SEMICOLON);
-            emit_jmp_back(OP_JMP_TRUE, loopdest);
+            Value v;
+            if (const_instr(ctx, cond, CUR_POS, &v)) {
+                rewind_code(ctx, cond, condConsts);
+                if (truthy(v)) emit_jmp_back(ctx, OP_JMP, loopdest);
+            } else {
+                emit_jmp_back(ctx, OP_JMP_TRUE, loopdest);
+            }
 
-            for (int i = 0; i < curState->breakSrcs.size; i++) {
-                patch_jmp(curState->breakSrcs.d[i]);
+            for (int i = 0; i < ctx->state->breakSrcs.size; i++) {
+                patch_jmp(ctx, ctx->state->breakSrcs.d[i]);
             }
 
-            Vec_free(curState->breakSrcs);
-            Vec_copy(curState->breakSrcs, oldBreakSrcs);
-            curState->breakDepth = oldBreakDepth;
-            curState->continueDest = oldContinueDest;
-            curState->continueDepth = oldContinueDepth;
+            Vec_free(ctx->state->breakSrcs);
+            Vec_copy(ctx->state->breakSrcs, oldBreakSrcs);
+            ctx->state->breakDepth = oldBreakDepth;
+            ctx->state->continueDest = oldContinueDest;
+            ctx->state->continueDepth = oldContinueDepth;
 
             break;
         }
         case TOKEN_SWITCH: {
-            advance();
+            advance(ctx);
 
-            enter_scope();
+            enter_scope(ctx);
 
             EXPECT(TOKEN_LEFT_PAREN);
-            parse_expr();
+            parse_expr(ctx);
             EXPECT(TOKEN_RIGHT_PAREN);
-            curState->locals[curState->nlocals].name.start = "";
-            curState->locals[curState->nlocals].name.len = 0;
-            curState->locals[curState->nlocals].depth = curState->depth;
-            int comp_local = curState->nlocals++;
+            ctx->state->locals[ctx->state->nlocals].name.start = "";
+            ctx->state->locals[ctx->state->nlocals].name.len = 0;
+            ctx->state->locals[ctx->state->nlocals].depth = ctx->state->depth;
+            int comp_local = ctx->state->nlocals++;
 
             Vector(int) oldBreakSrcs;
-            Vec_copy(oldBreakSrcs, curState->breakSrcs);
-            int oldBreakDepth = curState->breakDepth;
-            Vec_init(curState->breakSrcs);
-            curState->breakDepth = curState->depth;
+            Vec_copy(oldBreakSrcs, ctx->state->breakSrcs);
+            int oldBreakDepth = ctx->state->breakDepth;
+            Vec_init(ctx->state->breakSrcs);
+            ctx->state->breakDepth = ctx->state->depth;
 
             EXPECT(TOKEN_LEFT_CURLY);
 
-            int casejmp = emit_jmp(OP_JMP);
+            int casejmp = emit_jmp(ctx, OP_JMP);
 
-            while (parser.cur.type != TOKEN_EOF &&
-                   parser.cur.type != TOKEN_RIGHT_CURLY) {
-                switch (parser.cur.type) {
+            while (ctx->parser.cur.type != TOKEN_EOF &&
+                   ctx->parser.cur.type != TOKEN_RIGHT_CURLY) {
+                switch (ctx->parser.cur.type) {
                     case TOKEN_CASE: {
-                        advance();
-                        int skipjmp = emit_jmp(OP_JMP);
-                        patch_jmp(casejmp);
+                        advance(ctx);
+                        int skipjmp = emit_jmp(ctx, OP_JMP);
+                        patch_jmp(ctx, casejmp);
                         EMIT2(OP_PUSH_LOCAL, comp_local);
-                        parse_expr();
+                        parse_expr(ctx);
                         EMIT(OP_TEQ);
                         EXPECT(TOKEN_COLON);
-                        casejmp = emit_jmp(OP_JMP_FALSE);
-                        patch_jmp(skipjmp);
+                        casejmp = emit_jmp(ctx, OP_JMP_FALSE);
+                        patch_jmp(ctx, skipjmp);
                         break;
                     }
                     case TOKEN_DEFAULT: {
-                        advance();
+                        advance(ctx);
                         EXPECT(TOKEN_COLON);
-                        patch_jmp(casejmp);
+                        patch_jmp(ctx, casejmp);
                         casejmp = -1;
                         break;
                     }
                     default:
-                        parse_stmt();
+                        parse_stmt(ctx);
                 }
-                if (parser.curError) synchronize();
+                if (ctx->parser.curError) synchronize(ctx);
             }
             EXPECT(TOKEN_RIGHT_CURLY);
 
-            if (casejmp != -1) patch_jmp(casejmp);
+            if (casejmp != -1) patch_jmp(ctx, casejmp);
 
-            for (int i = 0; i < curState->breakSrcs.size; i++) {
-                patch_jmp(curState->breakSrcs.d[i]);
+            for (int i = 0; i < ctx->state->breakSrcs.size; i++) {
+                patch_jmp(ctx, ctx->state->breakSrcs.d[i]);
             }
 
-            Vec_free(curState->breakSrcs);
-            Vec_copy(curState->breakSrcs, oldBreakSrcs);
-            curState->breakDepth = oldBreakDepth;
+            Vec_free(ctx->state->breakSrcs);
+            Vec_copy(ctx->state->breakSrcs, oldBreakSrcs);
+            ctx->state->breakDepth = oldBreakDepth;
 
-            leave_scope();
+            leave_scope(ctx);
 
             break;
         }
         case TOKEN_BREAK:
-            if (curState->breakDepth == -1) {
-                parse_error("Cannot use break outside loop or switch.");
+            if (ctx->state->breakDepth == -1) {
+                parse_error(ctx, "Cannot use break outside loop or switch.");
                 return;
             }
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_SEMICOLON);
-            pop_to_depth(curState->breakDepth);
-            Vec_push(curState->breakSrcs, emit_jmp(OP_JMP));
+            pop_to_depth(ctx, ctx->state->breakDepth);
+            Vec_push(ctx->state->breakSrcs, emit_jmp(ctx, OP_JMP));
             break;
         case TOKEN_CONTINUE:
-            if (curState->continueDepth == -1) {
-                parse_error("Cannot use continue outside loop.");
+            if (ctx->state->continueDepth == -1) {
+                parse_error(ctx, "Cannot use continue outside loop.");
                 return;
             }
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_SEMICOLON);
-            pop_to_depth(curState->continueDepth);
-            emit_jmp_back(OP_JMP, curState->continueDest);
+            pop_to_depth(ctx, ctx->state->continueDepth);
+            emit_jmp_back(ctx, OP_JMP, ctx->state->continueDest);
             break;
         case TOKEN_RETURN:
-            advance();
-            switch (parser.cur.type) {
+            advance(ctx);
+            switch (ctx->parser.cur.type) {
                 case TOKEN_SEMICOLON:
-                    advance();
+                    advance(ctx);
                     EMIT(OP_PUSH_NIL);
                     break;
                 default:
-                    parse_expr();
+                    parse_expr(ctx);
                     EXPECT(TOKEN_SEMICOLON);
             }
             EMIT(OP_RET);
+            ctx->state->deadCode = true;
             break;
         case TOKEN_SEMICOLON:
-            advance();
+            advance(ctx);
             break;
         default:
-            parse_expr();
+            parse_expr(ctx);
             EXPECT(TOKEN_SEMICOLON);
             EMIT(OP_POP);
             break;
     }
 }
 
-void parse_decl_or_stmt() {
-    switch (parser.cur.type) {
+void parse_decl_or_stmt(CompileCtx* ctx) {
+    switch (ctx->parser.cur.type) {
         case TOKEN_VAR: {
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_IDENTIFIER);
-            Token id_tok = parser.prev;
-            switch (parser.cur.type) {
+            Token id_tok = ctx->parser.prev;
+            switch (ctx->parser.cur.type) {
                 case TOKEN_EQUAL:
-                    advance();
-                    parse_expr();
+                    advance(ctx);
+                    parse_expr(ctx);
                     EXPECT(TOKEN_SEMICOLON);
                     break;
                 case TOKEN_SEMICOLON:
-                    advance();
+                    advance(ctx);
                     EMIT(OP_PUSH_NIL);
                     break;
                 default:
-                    parse_error("Expected initializer or semicolon.");
+                    parse_error(ctx, "Expected initializer or semicolon.");
             }
-            define_var(id_tok);
+            define_var(ctx, id_tok);
             break;
         }
         case TOKEN_FUN: {
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_IDENTIFIER);
-            Token id_tok = parser.prev;
-
-            parse_function(create_string(id_tok.start, id_tok.len), false);
-            define_var(id_tok);
+            Token id_tok = ctx->parser.prev;
+
+            int fpos = CUR_POS;
+            parse_function(ctx, create_string(id_tok.start, id_tok.len), false);
+            define_var(ctx, id_tok);
+
+            Chunk* c = &ctx->state->f->chunk;
+            if (ctx->state->depth == 0 && !ctx->parser.hadError &&
+                c->code.d[fpos] == OP_PUSH_CONST) {
+                register_inline(
+                    ctx,
+                    (ObjFunction*) c->constants.d[c->code.d[fpos + 1]].obj);
+            }
 
             break;
         }
         case TOKEN_CLASS: {
-            advance();
+            advance(ctx);
             EXPECT(TOKEN_IDENTIFIER);
-            Token id_tok = parser.prev;
+            Token id_tok = ctx->parser.prev;
             ObjClass* cls =
                 create_class(create_string(id_tok.start, id_tok.len));
             EXPECT(TOKEN_LEFT_CURLY);
             EXPECT(TOKEN_RIGHT_CURLY);
             EMIT_CONST(OBJ_VAL(cls));
-            define_var(id_tok);
+            define_var(ctx, id_tok);
 
             break;
         }
         default:
-            parse_stmt();
+            parse_stmt(ctx);
     }
 }
 
-ObjFunction* compile(char* source) {
+static ObjFunction* compile_ctx(CompileCtx* ctx, char* source) {
 
-    init_scanner(source);
-    curState = NULL;
+    init_scanner(&ctx->scanner, source);
+    ctx->lazy = vm.lazy;
+    ctx->source = source;
+    ctx->source_str = NULL;
+    ctx->state = NULL;
+    ctx->inliner.ncands = 0;
     Compiler compiler;
-    compiler_init(&compiler);
-    curState->f->name = CREATE_STRING_LITERAL("script");
+    compiler_init(ctx, &compiler, create_function());
+    ctx->state->f->name = CREATE_STRING_LITERAL("script");
 
-    parser.hadError = false;
-    parser.curError = false;
+    ctx->parser.hadError = false;
+    ctx->parser.curError = false;
 
-    advance();
+    advance(ctx);
 
-    while (parser.cur.type != TOKEN_EOF) {
-        parse_decl_or_stmt();
-        if (parser.curError) synchronize();
+    while (ctx->parser.cur.type != TOKEN_EOF) {
+        parse_decl_or_stmt(ctx);
+        if (ctx->parser.curError) synchronize(ctx);
     }
 
-    ObjFunction* toplevel = compiler_end(true);
+    ObjFunction* toplevel = compiler_end(ctx, true);
+
+    return ctx->parser.hadError ? NULL : toplevel;
+}
+
+ObjFunction* compile(char* source) {
+    CompileCtx ctx = {.quiet = false};
+    return compile_ctx(&ctx, source);
+}
 
-    return parser.hadError ? NULL : toplevel;
+ObjFunction* compile_to_heap(char* source, Heap* heap) {
+    CompileCtx ctx = {.quiet = true};
+    heap_enter(heap);
+    ObjFunction* f = compile_ctx(&ctx, source);
+    heap_leave();
+    return f;
+}
+
+bool compile_lazy(ObjFunction* f) {
+    LazyBody* body = f->lazy;
+    CompileCtx ctx = {.quiet = false};
+    ctx.lazy = vm.lazy;
+    ctx.source = body->source->data;
+    ctx.source_str = body->source;
+    init_scanner(&ctx.scanner, ctx.source + body->start);
+    ctx.scanner.line = body->line;
+    ctx.state = NULL;
+    ctx.inliner.ncands = 0;
+    ctx.parser.hadError = false;
+    ctx.parser.curError = false;
+
+    // The upvalues stay as they were skimmed, since closures of f may
+    // already have been made with them
+    Token* captured = malloc((f->nupvalues + 1) * sizeof *captured);
+    for (int i = 0; i < f->nupvalues; i++) {
+        captured[i].start = ctx.source + body->names[i].start;
+        captured[i].len = body->names[i].len;
+    }
+    Compiler compiler;
+    compiler_init(&ctx, &compiler, f);
+    compiler.captured = captured;
+    compiler.nupvalues = f->nupvalues;
+    if (f->nupvalues) {
+        memcpy(compiler.upvalues, f->upvalues,
+               f->nupvalues * sizeof *f->upvalues);
+    }
+
+    void* upvalues = f->upvalues;
+    int nupvalues = f->nupvalues;
+    int line = chunk_get_instr_line(&f->chunk, f->chunk.code.d);
+    chunk_free(&f->chunk);
+    chunk_init(&f->chunk);
+
+    advance(&ctx);
+    bool ok = parse_function_body(&ctx, f->name, false, false) &&
+              !ctx.parser.hadError;
+    free(captured);
+    if (!ok) {
+        // Leave it to fail the same way on the next call
+        if (f->upvalues != upvalues) FREE_ARRAY(f->upvalues, f->nupvalues);
+        f->upvalues = upvalues;
+        f->nupvalues = nupvalues;
+        chunk_free(&f->chunk);
+        chunk_init(&f->chunk);
+        chunk_write(&f->chunk, OP_LAZY, line);
+        if (vm.regvm) regcode_translate(f);
+        return false;
+    }
+    reallocate(upvalues, nupvalues * sizeof *f->upvalues, 0);
+    FREE_ARRAY(body->names, nupvalues + 1);
+    FREE_ARRAY(body, 1);
+    f->lazy = NULL;
+    return true;
 }
@@ -6,5 +6,10 @@
 #include "types.h"
 
 ObjFunction* compile(char* source);
+// Allocates into heap instead of the VM, so it can run on any thread.
+// Errors are not printed.
+ObjFunction* compile_to_heap(char* source, Heap* heap);
+// Compiles the body of a function that was only skimmed, on its first call
+bool compile_lazy(ObjFunction* f);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,195 @@
+#include "debugger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+#ifdef DEBUG_TRACE
+#define TRACE_FROM_START true
+#else
+#define TRACE_FROM_START false
+#endif
+
+volatile sig_atomic_t debugging = TRACE_FROM_START;
+
+static volatile sig_atomic_t trace_ops = TRACE_FROM_START;
+static volatile sig_atomic_t stop_next; // at the next instruction
+static bool stop_line;                  // at the next one starting a line
+static Vector(int) breaks;
+
+// Where the last instruction came from, to tell when a line starts
+static ObjFunction* last_func;
+static int last_line;
+
+static void update() {
+    debugging = trace_ops || stop_next || stop_line || breaks.size;
+    if (debugging) vm_interrupt = 1;
+}
+
+void debug_trace_ops(bool on) {
+    trace_ops = on;
+    update();
+}
+
+void debug_break(int line) {
+    Vec_push(breaks, line);
+    update();
+}
+
+void debug_attach() {
+    stop_next = true;
+    update();
+}
+
+static void on_signal(int sig) {
+    if (sig == SIGUSR1) stop_next = true;
+    else trace_ops = !trace_ops;
+    update();
+}
+
+bool debug_signals() {
+    struct sigaction sa = {.sa_handler = on_signal, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    return !sigaction(SIGUSR1, &sa, NULL) && !sigaction(SIGUSR2, &sa, NULL);
+}
+
+static Chunk* frame_chunk(CallFrame* f) {
+    return vm.regvm ? &f->func->rchunk : &f->func->chunk;
+}
+
+static char* func_name(ObjFunction* f) {
+    return f->name ? f->name->data : "<anonymous fn>";
+}
+
+static void print_frame(CallFrame* f) {
+    eprintf(vm.regvm ? "Registers:" : "Stack:");
+    for (Value* p = f->fp; p < vm.sp; p++) eprintf(" "), eprint_value(*p);
+    eprintf("\n");
+}
+
+static void print_instr(CallFrame* f) {
+    Chunk* c = frame_chunk(f);
+    int off = f->ip - c->code.d;
+    eprintf("%04x: ", off);
+    if (vm.regvm) disassemble_rinstr(c, off);
+    else disassemble_instr(c, off);
+    eprintf("\n");
+}
+
+// Calls inlined into a frame show as the frames they would have made
+static void backtrace() {
+    for (CallFrame* p = vm.csp; p >= vm.call_stack; p--) {
+        // Callers are past their call instruction
+        u8* ip = p == vm.csp ? p->ip : p->ip - 1;
+        Chunk* c = frame_chunk(p);
+        Inlined* in[MAX_INLINED];
+        int line = chunk_get_instr_line(c, ip);
+        for (int i = chunk_inlined_at(c, ip, in) - 1; i >= 0; i--) {
+            ObjFunction* f = (ObjFunction*) c->constants.d[in[i]->f].obj;
+            eprintf("  %s at line %d\n", func_name(f), line);
+            line = in[i]->line;
+        }
+        eprintf("  %s at line %d\n", func_name(p->func), line);
+    }
+}
+
+static bool has_break(int line) {
+    for (int i = 0; i < breaks.size; i++) {
+        if (breaks.d[i] == line) return true;
+    }
+    return false;
+}
+
+static void clear_break(int line) {
+    int n = 0;
+    for (int i = 0; i < breaks.size; i++) {
+        if (breaks.d[i] != line) breaks.d[n++] = breaks.d[i];
+    }
+    breaks.size = n;
+}
+
+#define HELP                                                                   \
+    "c             continue\n"                                                 \
+    "s             step to the next line\n"                                    \
+    "si            step one instruction\n"                                     \
+    "bt            print the call stack\n"                                     \
+    "stack         print the stack or registers of this call\n"                \
+    "dis           disassemble this function\n"                                \
+    "b line        break at line\n"                                            \
+    "d line        delete the breakpoint at line\n"                            \
+    "t             turn instruction tracing on or off\n"                       \
+    "detach        drop all breakpoints and tracing and continue\n"            \
+    "q             quit\n"
+
+// Reads commands from stdin until one resumes the program. At the end of
+// the input the debugger detaches.
+static void prompt(int line) {
+    CallFrame* f = vm.csp;
+    Chunk* c = frame_chunk(f);
+    Inlined* in[MAX_INLINED];
+    int n = chunk_inlined_at(c, f->ip, in);
+    ObjFunction* func =
+        n ? (ObjFunction*) c->constants.d[in[n - 1]->f].obj : f->func;
+    eprintf("Stopped in %s at line %d\n", func_name(func), line);
+    print_instr(f);
+    char buf[256];
+    while (true) {
+        eprintf("(clox) ");
+        if (!fgets(buf, sizeof buf, stdin)) break;
+        char cmd[16];
+        int n;
+        int args = sscanf(buf, "%15s %d", cmd, &n);
+        if (args < 1) continue;
+        if (!strcmp(cmd, "c")) {
+            return;
+        } else if (!strcmp(cmd, "s")) {
+            stop_line = true;
+            return;
+        } else if (!strcmp(cmd, "si")) {
+            stop_next = true;
+            return;
+        } else if (!strcmp(cmd, "bt")) {
+            backtrace();
+        } else if (!strcmp(cmd, "stack")) {
+            print_frame(f);
+        } else if (!strcmp(cmd, "dis")) {
+            disassemble_function(f->func);
+        } else if (!strcmp(cmd, "b") && args == 2) {
+            if (!has_break(n)) Vec_push(breaks, n);
+        } else if (!strcmp(cmd, "d") && args == 2) {
+            clear_break(n);
+        } else if (!strcmp(cmd, "t")) {
+            trace_ops = !trace_ops;
+        } else if (!strcmp(cmd, "detach")) {
+            break;
+        } else if (!strcmp(cmd, "q")) {
+            exit(0);
+        } else {
+            eprintf(HELP);
+        }
+    }
+    breaks.size = 0;
+    trace_ops = false;
+}
+
+bool debug_step() {
+    CallFrame* f = vm.csp;
+    if (trace_ops) {
+        print_frame(f);
+        print_instr(f);
+    }
+    int line = chunk_get_instr_line(frame_chunk(f), f->ip);
+    bool new_line = line != last_line || f->func != last_func;
+    last_line = line;
+    last_func = f->func;
+    if (stop_next || (new_line && (stop_line || has_break(line)))) {
+        stop_next = false;
+        stop_line = false;
+        prompt(line);
+    }
+    update();
+    return debugging;
+}
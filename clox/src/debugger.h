@@ -0,0 +1,27 @@
+#ifndef DEBUGGER_H
+#define DEBUGGER_H
+
+#include <signal.h>
+
+#include "types.h"
+
+// Whether the interpreter should run its instrumented loops: to trace
+// instructions, to watch for breakpoints or to stop in the debugger. The
+// plain loops only find out at the next call or jump after vm_interrupt.
+extern volatile sig_atomic_t debugging;
+
+// Prints every instruction with the stack or registers to stderr, as a
+// DEBUG_TRACE build does from the start
+void debug_trace_ops(bool on);
+// Stops in the debugger at the first instruction of line, in any function
+void debug_break(int line);
+// Stops in the debugger at the next instruction
+void debug_attach();
+// SIGUSR1 then attaches the debugger and SIGUSR2 toggles tracing
+bool debug_signals();
+
+// Called by the instrumented loops before each instruction, with the frames
+// flushed to vm. False to go back to the plain loops.
+bool debug_step();
+
+#endif
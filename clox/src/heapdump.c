@@ -0,0 +1,303 @@
+#include "heapdump.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object.h"
+#include "vm.h"
+
+#define VERSION 1
+#define TEXT_MAX 40 // of a string kept in the dump
+
+typedef enum {
+    ROOT_STACK,   // a stack slot or register, labeled function:slot
+    ROOT_FRAME,   // the function or closure a frame runs
+    ROOT_GLOBAL,  // labeled with its name
+    ROOT_MODULE,  // a loaded module's path and function
+    ROOT_API,     // held by an embedding host
+    ROOT_UPVALUE, // still open
+} RootKind;
+
+volatile sig_atomic_t heap_dump_pending;
+
+static char* signal_path;
+static int ndumps;
+
+// Objects by address, so that a reference can be turned into a number
+static Obj** objs;
+static size_t nobjs;
+
+static int by_address(const void* a, const void* b) {
+    Obj* x = *(Obj**) a;
+    Obj* y = *(Obj**) b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t obj_id(Obj* o) {
+    Obj** p = bsearch(&o, objs, nobjs, sizeof *objs, by_address);
+    return p - objs;
+}
+
+static void put_num(FILE* fp, size_t n) {
+    do {
+        u8 b = n & 0x7f;
+        n >>= 7;
+        fputc(b | (n ? 0x80 : 0), fp);
+    } while (n);
+}
+
+static void put_ref(FILE* fp, Obj* o) {
+    put_num(fp, obj_id(o));
+}
+
+static size_t table_refs(Table* t) {
+    size_t n = 0;
+    for (int i = 0; i < t->cap; i++) {
+        if (t->ents[i].key) n += 1 + (t->ents[i].value.type == VT_OBJ);
+    }
+    return n;
+}
+
+static void put_table(FILE* fp, Table* t) {
+    for (int i = 0; i < t->cap; i++) {
+        Entry* e = &t->ents[i];
+        if (!e->key) continue;
+        put_ref(fp, (Obj*) e->key);
+        if (e->value.type == VT_OBJ) put_ref(fp, e->value.obj);
+    }
+}
+
+static size_t chunk_size(Chunk* c) {
+    return c->code.cap + c->constants.cap * sizeof(Value) +
+           c->lines.cap * sizeof(LineRun) + c->inlined.cap * sizeof(Inlined);
+}
+
+// The object and what it alone points to outside the heap
+static size_t self_size(Obj* o) {
+    size_t size = obj_size(o);
+    switch (o->type) {
+        case OT_FUNCTION: {
+            ObjFunction* f = (ObjFunction*) o;
+            size += chunk_size(&f->chunk) + chunk_size(&f->rchunk);
+            size += f->nupvalues * sizeof *f->upvalues;
+            break;
+        }
+        case OT_CLOSURE:
+            size += ((ObjClosure*) o)->nupvalues * sizeof(ObjUpvalue*);
+            break;
+        case OT_CLASS:
+            size += ((ObjClass*) o)->methods.cap * sizeof(Entry);
+            break;
+        case OT_INSTANCE:
+            size += ((ObjInstance*) o)->attrs.cap * sizeof(Entry);
+            break;
+        default:
+            break;
+    }
+    return size;
+}
+
+static ObjString* obj_name(Obj* o) {
+    switch (o->type) {
+        case OT_FUNCTION:
+            return ((ObjFunction*) o)->name;
+        case OT_CLOSURE:
+            return ((ObjClosure*) o)->f->name;
+        case OT_CLASS:
+            return ((ObjClass*) o)->name;
+        case OT_INSTANCE:
+            return ((ObjInstance*) o)->cls->name;
+        default:
+            return NULL;
+    }
+}
+
+// The references are the ones mark_obj follows
+static void put_obj(FILE* fp, Obj* o) {
+    fputc(o->type, fp);
+    put_num(fp, self_size(o));
+    ObjString* name = obj_name(o);
+    put_num(fp, name ? obj_id((Obj*) name) + 1 : 0);
+    switch (o->type) {
+        case OT_STRING: {
+            ObjString* s = (ObjString*) o;
+            int len = s->len < TEXT_MAX ? s->len : TEXT_MAX;
+            fputc(len, fp);
+            fwrite(s->data, 1, len, fp);
+            put_num(fp, 0);
+            break;
+        }
+        case OT_FUNCTION: {
+            ObjFunction* f = (ObjFunction*) o;
+            size_t n = !!f->name + !!f->lazy;
+            for (int i = 0; i < f->chunk.constants.size; i++) {
+                n += f->chunk.constants.d[i].type == VT_OBJ;
+            }
+            put_num(fp, n);
+            if (f->name) put_ref(fp, (Obj*) f->name);
+            if (f->lazy) put_ref(fp, (Obj*) f->lazy->source);
+            for (int i = 0; i < f->chunk.constants.size; i++) {
+                Value v = f->chunk.constants.d[i];
+                if (v.type == VT_OBJ) put_ref(fp, v.obj);
+            }
+            break;
+        }
+        case OT_CLOSURE: {
+            ObjClosure* c = (ObjClosure*) o;
+            put_num(fp, 1 + c->nupvalues);
+            put_ref(fp, (Obj*) c->f);
+            for (int i = 0; i < c->nupvalues; i++) {
+                put_ref(fp, (Obj*) c->upvalues[i]);
+            }
+            break;
+        }
+        case OT_UPVALUE: {
+            ObjUpvalue* u = (ObjUpvalue*) o;
+            bool ref = u->loc == &u->closed && u->closed.type == VT_OBJ;
+            put_num(fp, ref);
+            if (ref) put_ref(fp, u->closed.obj);
+            break;
+        }
+        case OT_CLASS: {
+            ObjClass* c = (ObjClass*) o;
+            put_num(fp, 1 + table_refs(&c->methods));
+            put_ref(fp, (Obj*) c->name);
+            put_table(fp, &c->methods);
+            break;
+        }
+        case OT_INSTANCE: {
+            ObjInstance* i = (ObjInstance*) o;
+            put_num(fp, 1 + table_refs(&i->attrs));
+            put_ref(fp, (Obj*) i->cls);
+            put_table(fp, &i->attrs);
+            break;
+        }
+        case OT_ARRAY: {
+            ObjArray* arr = (ObjArray*) o;
+            size_t n = 0;
+            for (int i = 0; i < arr->len; i++) {
+                n += arr->data[i].type == VT_OBJ;
+            }
+            put_num(fp, n);
+            for (int i = 0; i < arr->len; i++) {
+                Value v = arr->data[i];
+                if (v.type == VT_OBJ) put_ref(fp, v.obj);
+            }
+            break;
+        }
+    }
+}
+
+typedef struct {
+    RootKind kind;
+    Obj* obj;
+    char label[64];
+} Root;
+
+static Vector(Root) roots;
+
+static void add_root(RootKind kind, Obj* o, char* label) {
+    Root r = {kind, o};
+    snprintf(r.label, sizeof r.label, "%s", label);
+    Vec_push(roots, r);
+}
+
+static char* func_name(ObjFunction* f) {
+    return f->name ? f->name->data : "<anonymous fn>";
+}
+
+static void add_globals(Table* tbl) {
+    for (int i = 0; i < tbl->cap; i++) {
+        Entry* e = &tbl->ents[i];
+        if (!e->key) continue;
+        add_root(ROOT_GLOBAL, (Obj*) e->key, e->key->data);
+        if (e->value.type == VT_OBJ) {
+            add_root(ROOT_GLOBAL, e->value.obj, e->key->data);
+        }
+    }
+}
+
+// The roots collect_garbage marks from
+static void find_roots() {
+    char label[64];
+    for (CallFrame* p = vm.call_stack; p <= vm.csp; p++) {
+        Value* end = p < vm.csp ? p[1].fp : vm.sp;
+        for (Value* s = p->fp; s < end; s++) {
+            if (s->type != VT_OBJ) continue;
+            snprintf(label, sizeof label, "%s:%d", func_name(p->func),
+                     (int) (s - p->fp));
+            add_root(ROOT_STACK, s->obj, label);
+        }
+        add_root(ROOT_FRAME, (Obj*) p->func, func_name(p->func));
+        if (p->clos) {
+            add_root(ROOT_FRAME, (Obj*) p->clos, func_name(p->func));
+        }
+    }
+    add_globals(&vm.globals);
+    add_globals(&vm.base_globals);
+    for (int i = 0; i < vm.modules.size; i++) {
+        Module* m = &vm.modules.d[i];
+        add_root(ROOT_MODULE, (Obj*) m->path, m->path->data);
+        add_root(ROOT_MODULE, (Obj*) m->f, m->path->data);
+    }
+    for (int i = 0; i < vm.api_stack.size; i++) {
+        if (vm.api_stack.d[i].type != VT_OBJ) continue;
+        snprintf(label, sizeof label, "%d", i);
+        add_root(ROOT_API, vm.api_stack.d[i].obj, label);
+    }
+    for (ObjUpvalue* p = vm.open_upvalues; p; p = p->next) {
+        add_root(ROOT_UPVALUE, (Obj*) p, "");
+    }
+}
+
+bool heap_dump(char* path) {
+    FILE* fp = fopen(path, "wb");
+    if (!fp) return false;
+
+    nobjs = vm.frozen.size;
+    for (Obj* o = vm.objs; o; o = o->next) nobjs++;
+    objs = malloc(nobjs * sizeof *objs);
+    size_t n = 0;
+    for (Obj* o = vm.objs; o; o = o->next) objs[n++] = o;
+    for (int i = 0; i < vm.frozen.size; i++) objs[n++] = vm.frozen.d[i];
+    qsort(objs, nobjs, sizeof *objs, by_address);
+    find_roots();
+
+    fwrite("LOXHEAP", 1, 7, fp);
+    fputc(VERSION, fp);
+    put_num(fp, nobjs);
+    for (size_t i = 0; i < nobjs; i++) put_obj(fp, objs[i]);
+    put_num(fp, roots.size);
+    for (int i = 0; i < roots.size; i++) {
+        Root* r = &roots.d[i];
+        fputc(r->kind, fp);
+        put_ref(fp, r->obj);
+        put_num(fp, strlen(r->label));
+        fputs(r->label, fp);
+    }
+
+    free(objs);
+    roots.size = 0;
+    return !fclose(fp);
+}
+
+static void on_quit(int sig) {
+    heap_dump_pending = 1;
+    vm_interrupt = 1;
+}
+
+bool heap_dump_signals(char* path) {
+    signal_path = path;
+    struct sigaction sa = {.sa_handler = on_quit, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    return !sigaction(SIGQUIT, &sa, NULL);
+}
+
+void heap_dump_signalled() {
+    heap_dump_pending = 0;
+    char path[4096];
+    snprintf(path, sizeof path, "%s.%d", signal_path, ++ndumps);
+    if (heap_dump(path)) eprintf("Heap dumped to '%s'.\n", path);
+    else eprintf("Could not write '%s'.\n", path);
+}
@@ -0,0 +1,29 @@
+#ifndef HEAPDUMP_H
+#define HEAPDUMP_H
+
+#include <signal.h>
+
+#include "types.h"
+
+// Set by the signal handler, for the interpreter to take the dump at its
+// next call or jump with the frames flushed
+extern volatile sig_atomic_t heap_dump_pending;
+
+// Writes every object in the VM's heap with its type, size and references,
+// and the roots holding them, to path. tools/heapdump.py reads the file.
+//
+//   "LOXHEAP" version:u8
+//   nobjs, then per object:
+//     type:u8 size name nrefs ref...     strings add len:u8 text
+//   nroots, then per root:
+//     kind:u8 obj label_len label
+//
+// Numbers are unsigned LEB128. Objects are numbered from 0 in the order
+// written. name is 1 + the string naming a function, closure, class or
+// instance, or 0. size counts the tables, code and arrays the object owns.
+bool heap_dump(char* path);
+// SIGQUIT then writes a dump to path.1, path.2 and so on
+bool heap_dump_signals(char* path);
+void heap_dump_signalled();
+
+#endif
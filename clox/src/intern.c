@@ -0,0 +1,43 @@
+#include "intern.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static u32 hash_bytes(char* p, int len) {
+    u32 h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (u8) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int* find_slot(Interner* in, char* p, int len) {
+    int idx = hash_bytes(p, len) & (in->cap - 1);
+    for (;; idx = (idx + 1) & (in->cap - 1)) {
+        if (!in->index[idx]) return &in->index[idx];
+        InternKey* k = &in->keys.d[in->index[idx] - 1];
+        if (k->len == len && !memcmp(in->bytes.d + k->start, p, len)) {
+            return &in->index[idx];
+        }
+    }
+}
+
+int intern(Interner* in, char* p, int len) {
+    if (2 * (in->keys.size + 1) > in->cap) {
+        free(in->index);
+        in->cap = in->cap ? 2 * in->cap : 64;
+        in->index = calloc(in->cap, sizeof *in->index);
+        for (int i = 0; i < in->keys.size; i++) {
+            InternKey* k = &in->keys.d[i];
+            *find_slot(in, in->bytes.d + k->start, k->len) = i + 1;
+        }
+    }
+    int* slot = find_slot(in, p, len);
+    if (!*slot) {
+        Vec_push(in->keys, ((InternKey){in->bytes.size, len}));
+        for (int i = 0; i < len; i++) Vec_push(in->bytes, p[i]);
+        *slot = in->keys.size;
+    }
+    return *slot - 1;
+}
@@ -0,0 +1,29 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include "types.h"
+
+typedef struct {
+    int start, len; // in bytes
+} InternKey;
+
+// Gives each distinct byte string an id. The profilers name functions and
+// stacks this way, so that nothing they keep points into the heap.
+typedef struct {
+    Vector(char) bytes;
+    Vector(InternKey) keys;
+    int* index; // id + 1 by hash, 0 if free
+    size_t cap;
+} Interner;
+
+int intern(Interner* in, char* p, int len);
+
+static inline char* interned(Interner* in, int id) {
+    return in->bytes.d + in->keys.d[id].start;
+}
+
+static inline int interned_len(Interner* in, int id) {
+    return in->keys.d[id].len;
+}
+
+#endif
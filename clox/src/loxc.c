@@ -0,0 +1,722 @@
+#include "loxc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "regcode.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+// A .loxc file holds the function tree of a compiled script. A heap image
+// holds everything reachable from the globals once a script has run. Both
+// are laid out the same way:
+//
+//   header     magic, version, size and mtime of the source it came from
+//   nobjs      number of objects, then the type and length of each
+//   objects    the objects themselves, a script's toplevel function first
+//   globals    heap images only, the global table
+//
+// Strings are written inline wherever they are used and everything else
+// is referred to by number, so shared objects and cycles load as they
+// were. Builtins are written as the name of a global holding them.
+// Everything is in host byte order, which the magic also checks. Loaded
+// code points straight into the mapped file, so the mapping is kept until
+// the last function with code in it is freed, as happens to the old code of
+// a reloaded module.
+
+#define LOXC_MAGIC 0x43584f4c // "LOXC" read as a little endian u32
+#define HEAP_MAGIC 0x48584f4c // "LOXH"
+
+enum { K_NIL, K_BOOL, K_NUMBER, K_INT, K_CHAR, K_STRING, K_OBJECT, K_BUILTIN };
+
+// Objects numbered in the order they are first seen, with a hash on their
+// address to find the number of one already seen
+typedef struct {
+    Vector(Obj*) objs;
+    int* slots; // object number + 1, or 0 when free
+    size_t cap;
+} ObjMap;
+
+bool loxc_stamp(char* path, i64 stamp[3]) {
+    struct stat st;
+    if (stat(path, &st)) return false;
+    stamp[0] = st.st_size;
+    stamp[1] = st.st_mtim.tv_sec;
+    stamp[2] = st.st_mtim.tv_nsec;
+    return true;
+}
+
+char* loxc_path(char* source_path) {
+    size_t len = strlen(source_path);
+    char* path = malloc(len + 6);
+    strcpy(path, source_path);
+    if (len >= 4 && !strcmp(path + len - 4, ".lox")) strcat(path, "c");
+    else strcat(path, ".loxc");
+    return path;
+}
+
+static size_t slot_of(ObjMap* m, Obj* o) {
+    size_t i = ((uintptr_t) o >> 4) & (m->cap - 1);
+    while (m->slots[i] && m->objs.d[m->slots[i] - 1] != o) {
+        i = (i + 1) & (m->cap - 1);
+    }
+    return i;
+}
+
+static int obj_index(ObjMap* m, Obj* o) {
+    if (2 * (m->objs.size + 1) > m->cap) {
+        free(m->slots);
+        m->cap = m->cap ? 2 * m->cap : 64;
+        m->slots = calloc(m->cap, sizeof *m->slots);
+        for (int i = 0; i < m->objs.size; i++) {
+            m->slots[slot_of(m, m->objs.d[i])] = i + 1;
+        }
+    }
+    size_t i = slot_of(m, o);
+    if (!m->slots[i]) {
+        Vec_push(m->objs, o);
+        m->slots[i] = m->objs.size;
+    }
+    return m->slots[i] - 1;
+}
+
+static void number_value(ObjMap* m, Value v) {
+    if (v.type == VT_OBJ && v.obj->type != OT_STRING) obj_index(m, v.obj);
+}
+
+static void number_table(ObjMap* m, Table* t) {
+    for (int i = 0; i < t->cap; i++) {
+        if (t->ents[i].key) number_value(m, t->ents[i].value);
+    }
+}
+
+// Numbers everything o refers to
+static void number_refs(ObjMap* m, Obj* o) {
+    switch (o->type) {
+        case OT_FUNCTION: {
+            Chunk* c = &((ObjFunction*) o)->chunk;
+            for (int i = 0; i < c->constants.size; i++) {
+                number_value(m, c->constants.d[i]);
+            }
+            break;
+        }
+        case OT_CLOSURE: {
+            ObjClosure* c = (ObjClosure*) o;
+            obj_index(m, (Obj*) c->f);
+            for (int i = 0; i < c->nupvalues; i++) {
+                obj_index(m, (Obj*) c->upvalues[i]);
+            }
+            break;
+        }
+        case OT_UPVALUE:
+            number_value(m, ((ObjUpvalue*) o)->closed);
+            break;
+        case OT_CLASS:
+            number_table(m, &((ObjClass*) o)->methods);
+            break;
+        case OT_INSTANCE:
+            obj_index(m, (Obj*) ((ObjInstance*) o)->cls);
+            number_table(m, &((ObjInstance*) o)->attrs);
+            break;
+        case OT_ARRAY: {
+            ObjArray* arr = (ObjArray*) o;
+            for (int i = 0; i < arr->len; i++) number_value(m, arr->data[i]);
+            break;
+        }
+        case OT_STRING:
+            break;
+    }
+}
+
+typedef struct {
+    FILE* fp;
+    ObjMap* map;
+    bool ok;
+} Writer;
+
+#define PUT(x) fwrite(&(x), sizeof(x), 1, w->fp)
+#define PUT_AS(T, x)                                                           \
+    do {                                                                       \
+        T v_ = (x);                                                            \
+        PUT(v_);                                                               \
+    } while (false)
+
+static void write_string(Writer* w, ObjString* s) {
+    PUT_AS(u32, s->len);
+    fwrite(s->data, 1, s->len, w->fp);
+}
+
+static void write_name(Writer* w, ObjString* name) {
+    if (name) {
+        PUT_AS(i32, name->len);
+        fwrite(name->data, 1, name->len, w->fp);
+    } else {
+        PUT_AS(i32, -1);
+    }
+}
+
+static ObjString* builtin_name(BuiltinFn* fn) {
+    for (int i = 0; i < vm.globals.cap; i++) {
+        Entry* e = &vm.globals.ents[i];
+        if (e->key && e->value.type == VT_BUILTIN && e->value.builtin == fn) {
+            return e->key;
+        }
+    }
+    return NULL;
+}
+
+static void write_value(Writer* w, Value v) {
+    switch (v.type) {
+        case VT_NIL:
+            PUT_AS(u8, K_NIL);
+            break;
+        case VT_BOOL:
+            PUT_AS(u8, K_BOOL);
+            PUT_AS(u8, v.b);
+            break;
+        case VT_NUMBER:
+            PUT_AS(u8, K_NUMBER);
+            PUT(v.num);
+            break;
+        case VT_INT:
+            PUT_AS(u8, K_INT);
+            PUT(v.i);
+            break;
+        case VT_CHAR:
+            PUT_AS(u8, K_CHAR);
+            PUT(v.c);
+            break;
+        case VT_OBJ:
+            if (v.obj->type == OT_STRING) {
+                PUT_AS(u8, K_STRING);
+                write_string(w, (ObjString*) v.obj);
+            } else {
+                PUT_AS(u8, K_OBJECT);
+                PUT_AS(u32, obj_index(w->map, v.obj));
+            }
+            break;
+        case VT_BUILTIN: {
+            ObjString* name = builtin_name(v.builtin);
+            if (!name) {
+                w->ok = false;
+                break;
+            }
+            PUT_AS(u8, K_BUILTIN);
+            write_string(w, name);
+            break;
+        }
+    }
+}
+
+static void write_table(Writer* w, Table* t) {
+    u32 n = 0;
+    for (int i = 0; i < t->cap; i++) n += t->ents[i].key != NULL;
+    PUT(n);
+    for (int i = 0; i < t->cap; i++) {
+        if (!t->ents[i].key) continue;
+        write_string(w, t->ents[i].key);
+        write_value(w, t->ents[i].value);
+    }
+}
+
+static void write_function(Writer* w, ObjFunction* f) {
+    // A body left for its first call has no code to write yet
+    if (f->lazy) w->ok = false;
+    write_name(w, f->name);
+    PUT_AS(i32, f->nargs);
+    PUT_AS(i32, f->nupvalues);
+    for (int i = 0; i < f->nupvalues; i++) {
+        PUT_AS(u8, f->upvalues[i].id);
+        PUT_AS(u8, f->upvalues[i].local);
+    }
+
+    Chunk* c = &f->chunk;
+    PUT_AS(u32, c->lines.size);
+    for (int i = 0; i < c->lines.size; i++) {
+        PUT_AS(i32, c->lines.d[i].start);
+        PUT_AS(i32, c->lines.d[i].line);
+    }
+    PUT_AS(u32, c->inlined.size);
+    for (int i = 0; i < c->inlined.size; i++) {
+        Inlined* in = &c->inlined.d[i];
+        PUT_AS(i32, in->start);
+        PUT_AS(i32, in->end);
+        PUT_AS(i32, in->f);
+        PUT_AS(i32, in->line);
+    }
+    PUT_AS(u32, c->constants.size);
+    for (int i = 0; i < c->constants.size; i++) {
+        write_value(w, c->constants.d[i]);
+    }
+    PUT_AS(u32, c->code.size);
+    fwrite(c->code.d, 1, c->code.size, w->fp);
+}
+
+static void write_object(Writer* w, Obj* o) {
+    switch (o->type) {
+        case OT_FUNCTION:
+            write_function(w, (ObjFunction*) o);
+            break;
+        case OT_CLOSURE: {
+            ObjClosure* c = (ObjClosure*) o;
+            PUT_AS(u32, obj_index(w->map, (Obj*) c->f));
+            PUT_AS(u32, c->nupvalues);
+            for (int i = 0; i < c->nupvalues; i++) {
+                PUT_AS(u32, obj_index(w->map, (Obj*) c->upvalues[i]));
+            }
+            break;
+        }
+        case OT_UPVALUE: {
+            // Nothing runs while the image is written, so all are closed
+            ObjUpvalue* u = (ObjUpvalue*) o;
+            w->ok &= u->loc == &u->closed;
+            write_value(w, u->closed);
+            break;
+        }
+        case OT_CLASS:
+            write_name(w, ((ObjClass*) o)->name);
+            write_table(w, &((ObjClass*) o)->methods);
+            break;
+        case OT_INSTANCE:
+            PUT_AS(u32, obj_index(w->map, (Obj*) ((ObjInstance*) o)->cls));
+            write_table(w, &((ObjInstance*) o)->attrs);
+            break;
+        case OT_ARRAY: {
+            ObjArray* arr = (ObjArray*) o;
+            for (int i = 0; i < arr->len; i++) write_value(w, arr->data[i]);
+            break;
+        }
+        case OT_STRING:
+            break;
+    }
+}
+
+// Writes the objects in m, and everything they refer to, with globals
+// after them when given
+static bool write_image(char* path, u32 magic, ObjMap* m, char* source_path,
+                        Table* globals) {
+    i64 stamp[3] = {0};
+    if (source_path && !loxc_stamp(source_path, stamp)) return false;
+
+    // Number every object up front, in the order the roots were given
+    for (int i = 0; i < m->objs.size; i++) number_refs(m, m->objs.d[i]);
+
+    // Write next to the target and rename, so readers never see half a file
+    char tmp[strlen(path) + 16];
+    snprintf(tmp, sizeof tmp, "%s.%d", path, getpid());
+    Writer state = {fopen(tmp, "wb"), m, true};
+    Writer* w = &state;
+    if (!w->fp) return false;
+    PUT(magic);
+    PUT_AS(u32, LOXC_VERSION);
+    fwrite(stamp, sizeof *stamp, 3, w->fp);
+    PUT_AS(u32, m->objs.size);
+    for (int i = 0; i < m->objs.size; i++) {
+        Obj* o = m->objs.d[i];
+        PUT_AS(u8, o->type);
+        PUT_AS(u32, o->type == OT_ARRAY ? ((ObjArray*) o)->len : 0);
+    }
+    for (int i = 0; i < m->objs.size; i++) write_object(w, m->objs.d[i]);
+    if (globals) write_table(w, globals);
+
+    bool ok = w->ok && !ferror(w->fp);
+    ok &= !fclose(w->fp);
+    if (ok) ok = !rename(tmp, path);
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+static void map_free(ObjMap* m) {
+    Vec_free(m->objs);
+    free(m->slots);
+}
+
+bool loxc_write(char* path, ObjFunction* toplevel, char* source_path) {
+    ObjMap m = {0};
+    obj_index(&m, (Obj*) toplevel);
+    bool ok = write_image(path, LOXC_MAGIC, &m, source_path, NULL);
+    map_free(&m);
+    return ok;
+}
+
+bool loxc_save_heap(char* path, char* source_path) {
+    ObjMap m = {0};
+    number_table(&m, &vm.globals);
+    bool ok = write_image(path, HEAP_MAGIC, &m, source_path, &vm.globals);
+    map_free(&m);
+    return ok;
+}
+
+struct _LoxcMap {
+    u8* start;
+    size_t len;
+    int refs; // functions with code in it
+};
+
+void loxc_release(LoxcMap* map) {
+    if (--map->refs) return;
+    munmap(map->start, map->len);
+    free(map);
+}
+
+typedef struct {
+    u8* start;
+    u8* p;
+    u8* end;
+    bool ok;
+    Obj** objs;
+    u32 nobjs;
+    LoxcMap* map;
+} Reader;
+
+static void* take(Reader* r, size_t n) {
+    if (!r->ok || r->end - r->p < n) {
+        r->ok = false;
+        return NULL;
+    }
+    void* p = r->p;
+    r->p += n;
+    return p;
+}
+
+#define GET(r, x)                                                              \
+    do {                                                                       \
+        void* p_ = take(r, sizeof(x));                                         \
+        if (p_) memcpy(&(x), p_, sizeof(x));                                   \
+        else memset(&(x), 0, sizeof(x));                                       \
+    } while (false)
+
+static ObjString* read_string(Reader* r) {
+    u32 len;
+    GET(r, len);
+    char* s = take(r, len);
+    return s ? create_string(s, len) : NULL;
+}
+
+static ObjString* read_name(Reader* r) {
+    i32 len;
+    GET(r, len);
+    if (len < 0) return NULL;
+    char* name = take(r, len);
+    return name ? create_string(name, len) : NULL;
+}
+
+// An object by number, which has to be of type t
+static Obj* read_ref(Reader* r, ObjType t) {
+    u32 id;
+    GET(r, id);
+    if (!r->ok || id >= r->nobjs || r->objs[id]->type != t) {
+        r->ok = false;
+        return NULL;
+    }
+    return r->objs[id];
+}
+
+static Value read_value(Reader* r) {
+    u8 tag;
+    GET(r, tag);
+    Value v = NIL_VAL;
+    switch (tag) {
+        case K_NIL:
+            break;
+        case K_BOOL:
+            GET(r, tag);
+            v = BOOL_VAL(tag);
+            break;
+        case K_NUMBER:
+            v.type = VT_NUMBER;
+            GET(r, v.num);
+            break;
+        case K_INT:
+            v.type = VT_INT;
+            GET(r, v.i);
+            break;
+        case K_CHAR:
+            v.type = VT_CHAR;
+            GET(r, v.c);
+            break;
+        case K_STRING: {
+            ObjString* s = read_string(r);
+            if (s) v = OBJ_VAL(s);
+            break;
+        }
+        case K_OBJECT: {
+            u32 id;
+            GET(r, id);
+            if (id < r->nobjs) v = OBJ_VAL(r->objs[id]);
+            else r->ok = false;
+            break;
+        }
+        case K_BUILTIN: {
+            ObjString* name = read_string(r);
+            if (!name || !table_get(&vm.globals, name, &v) ||
+                v.type != VT_BUILTIN) {
+                v = NIL_VAL;
+                r->ok = false;
+            }
+            break;
+        }
+        default:
+            r->ok = false;
+    }
+    return v;
+}
+
+static void read_table(Reader* r, Table* t) {
+    u32 n;
+    GET(r, n);
+    for (int i = 0; r->ok && i < n; i++) {
+        ObjString* key = read_string(r);
+        Value v = read_value(r);
+        if (key) table_set(t, key, v);
+    }
+}
+
+static void read_function(Reader* r, ObjFunction* f) {
+    f->name = read_name(r);
+    GET(r, f->nargs);
+    GET(r, f->nupvalues);
+    if (f->nupvalues < 0 || f->nupvalues > 256) r->ok = false;
+    if (!r->ok) return;
+    f->upvalues = reallocate(NULL, 0, f->nupvalues * sizeof *f->upvalues);
+    for (int i = 0; i < f->nupvalues; i++) {
+        GET(r, f->upvalues[i].id);
+        GET(r, f->upvalues[i].local);
+    }
+
+    Chunk* c = &f->chunk;
+    u32 n;
+    GET(r, n);
+    for (int i = 0; r->ok && i < n; i++) {
+        LineRun run;
+        GET(r, run.start);
+        GET(r, run.line);
+        Vec_push_heap(c->lines, run);
+    }
+    GET(r, n);
+    for (int i = 0; r->ok && i < n; i++) {
+        Inlined in;
+        GET(r, in.start);
+        GET(r, in.end);
+        GET(r, in.f);
+        GET(r, in.line);
+        Vec_push_heap(c->inlined, in);
+    }
+    GET(r, n);
+    for (int i = 0; r->ok && i < n; i++) {
+        Value v = read_value(r);
+        Vec_push_heap(c->constants, v);
+    }
+    GET(r, n);
+    c->code.d = take(r, n);
+    c->code.size = c->code.d ? n : 0;
+    // Borrowed from the mapping, see chunk_free
+    c->code.cap = 0;
+    if (c->code.d) {
+        f->map = r->map;
+        r->map->refs++;
+    }
+
+    // Inlined copies have to name a function and lie in the code
+    for (int i = 0; r->ok && i < c->inlined.size; i++) {
+        Inlined* in = &c->inlined.d[i];
+        r->ok = in->f >= 0 && in->f < c->constants.size &&
+                isObjType(c->constants.d[in->f], OT_FUNCTION) &&
+                in->start >= 0 && in->start <= in->end &&
+                in->end <= c->code.size;
+    }
+}
+
+static void read_object(Reader* r, Obj* o) {
+    switch (o->type) {
+        case OT_FUNCTION:
+            read_function(r, (ObjFunction*) o);
+            break;
+        case OT_CLOSURE: {
+            ObjClosure* c = (ObjClosure*) o;
+            c->f = (ObjFunction*) read_ref(r, OT_FUNCTION);
+            u32 n;
+            GET(r, n);
+            if (n > 256) r->ok = false;
+            if (!r->ok) break;
+            c->upvalues = ALLOCATE(ObjUpvalue*, n);
+            c->nupvalues = n;
+            for (int i = 0; i < n; i++) {
+                c->upvalues[i] = (ObjUpvalue*) read_ref(r, OT_UPVALUE);
+            }
+            break;
+        }
+        case OT_UPVALUE:
+            ((ObjUpvalue*) o)->closed = read_value(r);
+            break;
+        case OT_CLASS:
+            ((ObjClass*) o)->name = read_name(r);
+            r->ok &= ((ObjClass*) o)->name != NULL;
+            read_table(r, &((ObjClass*) o)->methods);
+            break;
+        case OT_INSTANCE:
+            ((ObjInstance*) o)->cls = (ObjClass*) read_ref(r, OT_CLASS);
+            read_table(r, &((ObjInstance*) o)->attrs);
+            break;
+        case OT_ARRAY: {
+            ObjArray* arr = (ObjArray*) o;
+            for (int i = 0; r->ok && i < arr->len; i++) {
+                arr->data[i] = read_value(r);
+            }
+            break;
+        }
+        case OT_STRING:
+            break;
+    }
+}
+
+// Makes the shell of each object, to be filled in once they all exist
+static Obj* create_shell(Reader* r, u8 type, u32 len) {
+    switch (type) {
+        case OT_FUNCTION:
+            return (Obj*) create_function();
+        case OT_CLOSURE:
+            return (Obj*) create_closure(NULL);
+        case OT_UPVALUE: {
+            ObjUpvalue* u = create_upvalue(NULL);
+            u->closed = NIL_VAL;
+            u->loc = &u->closed;
+            return (Obj*) u;
+        }
+        case OT_CLASS:
+            return (Obj*) create_class(NULL);
+        case OT_INSTANCE:
+            return (Obj*) create_instance(NULL);
+        case OT_ARRAY:
+            // Every element takes at least a byte
+            if (len <= r->end - r->p) return (Obj*) create_array(len);
+    }
+    r->ok = false;
+    return NULL;
+}
+
+// Maps path and rebuilds the objects in it, leaving r just after them.
+// r->start is NULL when the file could not be used at all.
+static void read_image(Reader* r, char* path, u32 want_magic,
+                       char* source_path) {
+    *r = (Reader){0};
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    u8* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    *r = (Reader){map, map, map + st.st_size, true};
+    u32 magic, version, nobjs;
+    i64 stamp[3], cur[3];
+    GET(r, magic);
+    GET(r, version);
+    GET(r, stamp);
+    GET(r, nobjs);
+    u8* shells = take(r, (size_t) nobjs * 5);
+    if (magic != want_magic || version != LOXC_VERSION) r->ok = false;
+    if (r->ok && source_path &&
+        (!loxc_stamp(source_path, cur) || memcmp(stamp, cur, sizeof stamp)))
+        r->ok = false;
+    if (!r->ok) {
+        munmap(map, st.st_size);
+        *r = (Reader){0};
+        return;
+    }
+
+    r->map = malloc(sizeof *r->map);
+    *r->map = (LoxcMap){map, st.st_size, 0};
+    r->objs = malloc(nobjs * sizeof *r->objs);
+    for (int i = 0; r->ok && i < nobjs; i++) {
+        u32 len;
+        memcpy(&len, shells + 5 * i + 1, sizeof len);
+        r->objs[i] = create_shell(r, shells[5 * i], len);
+        if (r->ok) r->nobjs = i + 1;
+    }
+    for (int i = 0; r->ok && i < r->nobjs; i++) read_object(r, r->objs[i]);
+    for (int i = 0; r->ok && i < r->nobjs; i++) {
+        Obj* o = r->objs[i];
+        if (o->type == OT_CLOSURE) {
+            ObjClosure* c = (ObjClosure*) o;
+            r->ok = c->nupvalues == c->f->nupvalues;
+        } else if (o->type == OT_FUNCTION && vm.regvm) {
+            r->ok = regcode_translate((ObjFunction*) o);
+        }
+    }
+}
+
+// Once done with r, either keeps what was loaded or throws it away. The
+// mapping goes too unless some function has code in it.
+static void finish_image(Reader* r) {
+    if (!r->ok) {
+        // The half built objects are left to the GC, without their code
+        for (int i = 0; i < r->nobjs; i++) {
+            if (r->objs[i]->type != OT_FUNCTION) continue;
+            ObjFunction* f = (ObjFunction*) r->objs[i];
+            f->chunk.code.d = NULL;
+            f->chunk.code.size = 0;
+            f->map = NULL;
+        }
+        r->map->refs = 0;
+    }
+    if (!r->map->refs) {
+        munmap(r->map->start, r->map->len);
+        free(r->map);
+    }
+#ifdef DEBUG_DISASM
+    for (int i = r->nobjs - 1; r->ok && i >= 0; i--) {
+        if (r->objs[i]->type == OT_FUNCTION) {
+            disassemble_function((ObjFunction*) r->objs[i]);
+        }
+    }
+#endif
+    free(r->objs);
+}
+
+ObjFunction* loxc_load(char* path, char* source_path) {
+    Reader r;
+    read_image(&r, path, LOXC_MAGIC, source_path);
+    if (!r.start) return NULL;
+    if (r.ok && (r.nobjs == 0 || r.objs[0]->type != OT_FUNCTION)) {
+        r.ok = false;
+    }
+    ObjFunction* toplevel = r.ok ? (ObjFunction*) r.objs[0] : NULL;
+    finish_image(&r);
+    return toplevel;
+}
+
+ObjFunction* loxc_load_cached(char* source_path) {
+    char* path = loxc_path(source_path);
+    ObjFunction* f = loxc_load(path, source_path);
+    free(path);
+    return f;
+}
+
+bool loxc_load_heap(char* path) {
+    Reader r;
+    read_image(&r, path, HEAP_MAGIC, NULL);
+    if (!r.start) return false;
+
+    // Builtins are looked up by name in the globals as they were before
+    Table globals;
+    table_init(&globals);
+    if (r.ok) read_table(&r, &globals);
+    if (r.ok) table_add_all(&vm.globals, &globals);
+    table_free(&globals);
+    bool ok = r.ok;
+    finish_image(&r);
+    return ok;
+}
@@ -0,0 +1,24 @@
+#ifndef LOXC_H
+#define LOXC_H
+
+#include "object.h"
+#include "types.h"
+
+// Bump whenever the bytecode or the file layout changes
+#define LOXC_VERSION 4
+
+// Size and mtime of path, which a .loxc records for its source
+bool loxc_stamp(char* path, i64 stamp[3]);
+char* loxc_path(char* source_path);
+bool loxc_write(char* path, ObjFunction* toplevel, char* source_path);
+ObjFunction* loxc_load(char* path, char* source_path);
+ObjFunction* loxc_load_cached(char* source_path);
+// Lets go of the mapping a freed function had its code in
+void loxc_release(LoxcMap* map);
+
+// Heap images of everything reachable from the globals, to skip running a
+// prelude script again
+bool loxc_save_heap(char* path, char* source_path);
+bool loxc_load_heap(char* path);
+
+#endif
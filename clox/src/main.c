@@ -1,15 +1,39 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
 
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "chunk.h"
+#include "compiler.h"
+#include "debugger.h"
+#include "heapdump.h"
+#include "loxc.h"
+#include "module.h"
+#include "perfstat.h"
+#include "profile.h"
+#include "serve.h"
+#include "trace.h"
 #include "vm.h"
 
 #define USE_READLINE
 
+#define USAGE                                                                  \
+    "Usage: clox [--reg] [--lazy]\n"                                           \
+    "            [--compile | --serve socket | --pool n | --isolates]\n"       \
+    "            [--time-limit seconds] [--load-heap image]\n"                 \
+    "            [--save-heap image] [--profile out]\n"                        \
+    "            [--alloc-profile out [--alloc-sample bytes]]\n"               \
+    "            [--trace out [--trace-min ns]] [--perfstat]\n"                \
+    "            [--debug] [--break line]... [--trace-ops]\n"                  \
+    "            [--heap-dump path] [--gc-growth factor] [--min-heap size]\n"  \
+    "            [--max-heap size] [file...]\n"
+
 void repl() {
     using_history();
     char* buf;
@@ -34,9 +58,9 @@ void repl() {
     }
 }
 
-int run_file(char* filename) {
+char* read_file(char* filename) {
     FILE* fp = fopen(filename, "r");
-    if (!fp) return NO_FILE;
+    if (!fp) return NULL;
     fseek(fp, 0, SEEK_END);
     int len = ftell(fp);
     char* program = malloc(len + 1);
@@ -44,25 +68,321 @@ int run_file(char* filename) {
     fseek(fp, 0, SEEK_SET);
     (void) !fread(program, 1, len, fp);
     fclose(fp);
+    return program;
+}
 
+int run_file(char* filename) {
+    size_t len = strlen(filename);
+    if (len >= 5 && !strcmp(filename + len - 5, ".loxc")) {
+        if (access(filename, R_OK)) return NO_FILE;
+        ObjFunction* toplevel = loxc_load(filename, NULL);
+        if (!toplevel) {
+            eprintf("Invalid compiled file '%s'.\n", filename);
+            return COMPILE_ERROR;
+        }
+        return interpret_function(toplevel);
+    }
+
+    ObjFunction* cached = loxc_load_cached(filename);
+    if (cached) return interpret_function(cached);
+
+    char* program = read_file(filename);
+    if (!program) return NO_FILE;
+
+    module_preload_script(program);
     int code = interpret(program);
 
     free(program);
     return code;
 }
 
+int compile_file(char* filename) {
+    char* program = read_file(filename);
+    if (!program) return NO_FILE;
+
+    ObjFunction* toplevel = compile(program);
+    free(program);
+    if (!toplevel) return COMPILE_ERROR;
+
+    char* path = loxc_path(filename);
+    bool ok = loxc_write(path, toplevel, filename);
+    if (!ok) eprintf("Could not write '%s'.\n", path);
+    free(path);
+    return ok ? OK : COMPILE_ERROR;
+}
+
+static VM* main_vm;
+
+static void free_main_vm() {
+    VM_free(main_vm);
+}
+
+// A size in bytes, with an optional k, m or g suffix, or 0 if invalid
+static size_t parse_size(char* s) {
+    char* end;
+    double n = strtod(s, &end);
+    switch (*end) {
+        case 'g':
+        case 'G':
+            n *= 1024;
+            // fallthrough
+        case 'm':
+        case 'M':
+            n *= 1024;
+            // fallthrough
+        case 'k':
+        case 'K':
+            n *= 1024;
+            end++;
+    }
+    return *end || n < 1 ? 0 : n;
+}
+
+typedef struct {
+    char* filename;
+    char* heap;
+    bool regvm;
+    bool lazy;
+    double gc_growth;
+    size_t min_heap, max_heap;
+    int exitcode;
+    pthread_t thread;
+    bool started;
+} Isolate;
+
+// Runs a script on its own thread, in a VM of its own
+static void* run_isolate(void* arg) {
+    Isolate* iso = arg;
+    VM* v = VM_init();
+    vm.regvm = iso->regvm;
+    vm.lazy = iso->lazy;
+    heap_configure(iso->gc_growth, iso->min_heap, iso->max_heap);
+    if (iso->heap && !loxc_load_heap(iso->heap)) {
+        eprintf("Invalid heap image '%s'.\n", iso->heap);
+        iso->exitcode = COMPILE_ERROR;
+        VM_free(v);
+        return NULL;
+    }
+    iso->exitcode = run_file(iso->filename);
+    if (iso->exitcode == NO_FILE) perror(iso->filename);
+    VM_free(v);
+    return NULL;
+}
+
+static int run_isolates(char** filenames, int n, char* heap) {
+    Isolate* isos = malloc(n * sizeof *isos);
+    for (int i = 0; i < n; i++) {
+        isos[i] = (Isolate){filenames[i], heap, vm.regvm, vm.lazy,
+                            vm.gc_growth, vm.gc_min_heap, vm.max_heap, OK};
+        isos[i].started =
+            !pthread_create(&isos[i].thread, NULL, run_isolate, &isos[i]);
+        if (!isos[i].started) run_isolate(&isos[i]);
+    }
+    int exitcode = OK;
+    for (int i = 0; i < n; i++) {
+        if (isos[i].started) pthread_join(isos[i].thread, NULL);
+        if (!exitcode) exitcode = isos[i].exitcode;
+    }
+    free(isos);
+    return exitcode;
+}
+
 int main(int argc, char** argv) {
 
-    VM_init();
-    atexit(VM_free);
+    main_vm = VM_init();
+    atexit(free_main_vm);
+
+    char** filenames = malloc(argc * sizeof *filenames);
+    int nfiles = 0;
+    bool compile_only = false;
+    bool want_isolates = false;
+    char* sock_path = NULL;
+    char* load_heap = NULL;
+    int pool_size = 0;
+    double time_limit = 0;
+    char* save_heap = NULL;
+    char* profile_path = NULL;
+    char* alloc_profile_path = NULL;
+    long alloc_sample = 0;
+    char* trace_path = NULL;
+    long trace_min = 0;
+    bool want_perfstat = false;
+    bool want_debug = false;
+    char* heap_dump_path = NULL;
+    double gc_growth = GC_GROWTH;
+    size_t min_heap = GC_MIN_HEAP;
+    size_t max_heap = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--reg")) {
+            vm.regvm = true;
+        } else if (!strcmp(argv[i], "--lazy")) {
+            vm.lazy = true;
+        } else if (!strcmp(argv[i], "--compile")) {
+            compile_only = true;
+        } else if (!strcmp(argv[i], "--isolates")) {
+            want_isolates = true;
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            sock_path = argv[++i];
+        } else if (!strcmp(argv[i], "--pool") && i + 1 < argc) {
+            pool_size = atoi(argv[++i]);
+            if (pool_size <= 0) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--time-limit") && i + 1 < argc) {
+            time_limit = atof(argv[++i]);
+            if (time_limit <= 0) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "--trace-min") && i + 1 < argc) {
+            trace_min = atol(argv[++i]);
+            if (trace_min < 0) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--debug")) {
+            debug_attach();
+            want_debug = true;
+        } else if (!strcmp(argv[i], "--break") && i + 1 < argc) {
+            debug_break(atoi(argv[++i]));
+            want_debug = true;
+        } else if (!strcmp(argv[i], "--trace-ops")) {
+            debug_trace_ops(true);
+            want_debug = true;
+        } else if (!strcmp(argv[i], "--heap-dump") && i + 1 < argc) {
+            heap_dump_path = argv[++i];
+        } else if (!strcmp(argv[i], "--gc-growth") && i + 1 < argc) {
+            gc_growth = atof(argv[++i]);
+            if (gc_growth < 1) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--min-heap") && i + 1 < argc) {
+            min_heap = parse_size(argv[++i]);
+            if (!min_heap) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--max-heap") && i + 1 < argc) {
+            max_heap = parse_size(argv[++i]);
+            if (!max_heap) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--perfstat")) {
+            want_perfstat = true;
+        } else if (!strcmp(argv[i], "--load-heap") && i + 1 < argc) {
+            load_heap = argv[++i];
+        } else if (!strcmp(argv[i], "--save-heap") && i + 1 < argc) {
+            save_heap = argv[++i];
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (!strcmp(argv[i], "--alloc-profile") && i + 1 < argc) {
+            alloc_profile_path = argv[++i];
+        } else if (!strcmp(argv[i], "--alloc-sample") && i + 1 < argc) {
+            alloc_sample = atol(argv[++i]);
+            if (alloc_sample <= 0) {
+                eprintf(USAGE);
+                return 1;
+            }
+        } else if (argv[i][0] == '-') {
+            eprintf(USAGE);
+            return 1;
+        } else {
+            filenames[nfiles++] = argv[i];
+        }
+    }
+
+    heap_configure(gc_growth, min_heap, max_heap);
+
+    if (save_heap && nfiles != 1) {
+        eprintf(USAGE);
+        return 1;
+    }
+    // Whatever gets written out needs all its code
+    if (compile_only || save_heap) vm.lazy = false;
+    // Several files to run go each to an isolate of its own, on its own
+    // thread, and only when asked for. Isolates load the image into their
+    // own VMs.
+    bool isolates = want_isolates;
+    if (isolates && (sock_path || pool_size || compile_only || !nfiles)) {
+        eprintf(USAGE);
+        return 1;
+    }
+    if (nfiles > 1 && !isolates && !sock_path && !pool_size &&
+        !compile_only) {
+        eprintf(USAGE);
+        return 1;
+    }
+    // Only jobs have a time limit
+    if (time_limit && !sock_path && !pool_size) {
+        eprintf(USAGE);
+        return 1;
+    }
+    job_time_limit(time_limit);
+    // Only the main VM is sampled
+    if ((profile_path || alloc_profile_path || trace_path || want_perfstat ||
+         want_debug || heap_dump_path) &&
+        isolates) {
+        eprintf(USAGE);
+        return 1;
+    }
+    // The debugger talks to one program on the terminal
+    if (!isolates) debug_signals();
+    if (profile_path && !profile_start(profile_path)) {
+        perror("clox");
+        return 1;
+    }
+    if (alloc_profile_path) {
+        alloc_profile_start(alloc_profile_path, alloc_sample);
+    }
+    if (trace_path) trace_start(trace_path, trace_min);
+    if (heap_dump_path && !heap_dump_signals(heap_dump_path)) {
+        perror("clox");
+        return 1;
+    }
+    if (load_heap && !isolates && !loxc_load_heap(load_heap)) {
+        eprintf("Invalid heap image '%s'.\n", load_heap);
+        return COMPILE_ERROR;
+    }
+
+    // Without counters the program still runs, just uncounted
+    if (want_perfstat) perfstat_start();
 
     int exitcode = 0;
-    if (argc < 2) {
+    if (sock_path) {
+        // The files are modules to keep loaded
+        exitcode = serve(sock_path, filenames, nfiles);
+        if (exitcode == NO_FILE) perror(sock_path);
+    } else if (pool_size) {
+        // The files are modules to load before forking
+        exitcode = pool(pool_size, filenames, nfiles);
+    } else if (!nfiles) {
+        if (compile_only) {
+            eprintf(USAGE);
+            return 1;
+        }
         repl();
+    } else if (compile_only) {
+        for (int i = 0; i < nfiles && !exitcode; i++) {
+            exitcode = compile_file(filenames[i]);
+            if (exitcode == NO_FILE) perror("clox");
+        }
+    } else if (isolates) {
+        exitcode = run_isolates(filenames, nfiles, load_heap);
     } else {
-        exitcode = run_file(argv[1]);
+        exitcode = run_file(filenames[0]);
         if (exitcode == NO_FILE) perror("clox");
+        if (!exitcode && save_heap &&
+            !loxc_save_heap(save_heap, filenames[0])) {
+            eprintf("Could not write '%s'.\n", save_heap);
+            exitcode = COMPILE_ERROR;
+        }
     }
 
+    free(filenames);
     return exitcode;
-}
\ No newline at end of file
+}
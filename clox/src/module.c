@@ -0,0 +1,169 @@
+#include "module.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "compiler.h"
+#include "loxc.h"
+#include "scanner.h"
+#include "vm.h"
+
+static Module* find_module(ObjString* path) {
+    for (int i = 0; i < vm.modules.size; i++) {
+        if (vm.modules.d[i].path == path) return &vm.modules.d[i];
+    }
+    return NULL;
+}
+
+static char* read_source(char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    int len = ftell(fp);
+    char* program = malloc(len + 1);
+    program[len] = '\0';
+    fseek(fp, 0, SEEK_SET);
+    (void) !fread(program, 1, len, fp);
+    fclose(fp);
+    return program;
+}
+
+// Compiles into heap when one is given, which is safe on any thread
+static ObjFunction* compile_module(char* path, Heap* heap) {
+    if (heap) heap_enter(heap);
+    ObjFunction* f = loxc_load_cached(path);
+    if (heap) heap_leave();
+    if (f) return f;
+
+    char* program = read_source(path);
+    if (!program) return NULL;
+    f = heap ? compile_to_heap(program, heap) : compile(program);
+    free(program);
+    return f;
+}
+
+static void set_module(ObjString* path, i64 stamp[3], ObjFunction* f) {
+    Module* m = find_module(path);
+    if (!m) {
+        Module new = {.path = path};
+        Vec_push_heap(vm.modules, new);
+        m = &vm.modules.d[vm.modules.size - 1];
+    }
+    memcpy(m->stamp, stamp, sizeof m->stamp);
+    m->f = f;
+}
+
+// Modules are compiled once per canonical path and recompiled when the
+// source changes on disk, or always when reload is set.
+ObjFunction* module_load(char* path, bool reload) {
+    char* real = realpath(path, NULL);
+    if (!real) return NULL;
+
+    bool gc_on = vm.gc_on;
+    gc_disable();
+    ObjFunction* f = NULL;
+    i64 stamp[3];
+    if (loxc_stamp(real, stamp)) {
+        ObjString* key = create_string(real, strlen(real));
+        Module* m = find_module(key);
+        if (m && !reload && !memcmp(m->stamp, stamp, sizeof stamp)) {
+            f = m->f;
+        } else if ((f = compile_module(real, NULL))) {
+            set_module(key, stamp, f);
+        }
+    }
+    if (gc_on) gc_enable();
+
+    free(real);
+    return f;
+}
+
+typedef struct {
+    char* path;
+    i64 stamp[3];
+    VM* owner; // only read, for its settings
+    Heap heap;
+    ObjFunction* f;
+    pthread_t thread;
+} Preload;
+
+static void* preload_module(void* arg) {
+    Preload* p = arg;
+    VM_enter(p->owner);
+    p->f = compile_module(p->path, &p->heap);
+    return NULL;
+}
+
+// Compiles each module on its own thread and registers the results. Ones
+// that fail are left for module_load to report.
+void module_preload(char** paths, int n) {
+    Preload* jobs = malloc(n * sizeof *jobs);
+    int njobs = 0;
+    for (int i = 0; i < n; i++) {
+        Preload* p = &jobs[njobs];
+        p->path = realpath(paths[i], NULL);
+        if (!p->path || !loxc_stamp(p->path, p->stamp)) {
+            free(p->path);
+            continue;
+        }
+        p->owner = cur_vm;
+        heap_init(&p->heap);
+        if (pthread_create(&p->thread, NULL, preload_module, p)) {
+            free(p->path);
+            continue;
+        }
+        njobs++;
+    }
+
+    bool gc_on = vm.gc_on;
+    gc_disable();
+    for (int i = 0; i < njobs; i++) {
+        Preload* p = &jobs[i];
+        pthread_join(p->thread, NULL);
+        heap_adopt(&p->heap);
+        if (p->f) {
+            set_module(create_string(p->path, strlen(p->path)), p->stamp,
+                       p->f);
+        }
+        free(p->path);
+    }
+    if (gc_on) gc_enable();
+    free(jobs);
+}
+
+// Preloads the modules a script passes to loadModule as string literals
+void module_preload_script(char* source) {
+    Scanner scanner;
+    init_scanner(&scanner, source);
+    Vector(char*) paths;
+    Vec_init(paths);
+
+    Token t[4] = {0};
+    do {
+        t[0] = t[1], t[1] = t[2], t[2] = t[3];
+        t[3] = next_token(&scanner);
+        if (t[0].type != TOKEN_IDENTIFIER || t[0].len != 10 ||
+            memcmp(t[0].start, "loadModule", 10) ||
+            t[1].type != TOKEN_LEFT_PAREN || t[2].type != TOKEN_STRING ||
+            t[3].type != TOKEN_RIGHT_PAREN ||
+            memchr(t[2].start, '\\', t[2].len))
+            continue;
+        char* path = strndup(t[2].start + 1, t[2].len - 2);
+        bool dup = false;
+        for (int i = 0; !dup && i < paths.size; i++) {
+            dup = !strcmp(paths.d[i], path);
+        }
+        if (dup) free(path);
+        else Vec_push(paths, path);
+    } while (t[3].type != TOKEN_EOF);
+
+    // A single module gains nothing from a thread
+    if (paths.size > 1) module_preload(paths.d, paths.size);
+    for (int i = 0; i < paths.size; i++) {
+        free(paths.d[i]);
+    }
+    Vec_free(paths);
+}
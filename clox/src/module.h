@@ -0,0 +1,17 @@
+#ifndef MODULE_H
+#define MODULE_H
+
+#include "object.h"
+#include "types.h"
+
+typedef struct {
+    ObjString* path; // canonical path of the source
+    i64 stamp[3];    // its size and mtime when f was loaded
+    ObjFunction* f;
+} Module;
+
+ObjFunction* module_load(char* path, bool reload);
+void module_preload(char** paths, int n);
+void module_preload_script(char* source);
+
+#endif
@@ -5,7 +5,11 @@
 #include <string.h>
 
 #include "chunk.h"
+#include "loxc.h"
+#include "perfstat.h"
+#include "profile.h"
 #include "table.h"
+#include "trace.h"
 #include "vm.h"
 
 bool obj_equal(Obj* a, Obj* b) {
@@ -77,63 +81,132 @@ void eprint_objtype(ObjType t) {
     }
 }
 
+// The heap this thread allocates into, the VM's when NULL
+static _Thread_local Heap* cur_heap;
+
+#define STRINGS (cur_heap ? &cur_heap->strings : &vm.strings)
+
+// Whether the VM's heap can take n more bytes without going over max_heap
+#define HEAP_HAS_ROOM(n) (!vm.max_heap || vm.alloc_bytes + (n) <= vm.max_heap)
+
+void* reallocate(void* p, size_t old_size, size_t new_size) {
+    if (cur_heap) {
+        cur_heap->bytes += new_size - old_size;
+    } else {
+        // Past the limit the memory is still handed out, for whatever asked
+        // for it to finish, and the program stops at its next call or jump
+        if (new_size > old_size && !HEAP_HAS_ROOM(new_size - old_size)) {
+            vm.heap_exceeded = true;
+            vm.interrupt = true;
+        }
+        vm.alloc_bytes += new_size - old_size;
+    }
+    if (!new_size) {
+        free(p);
+        return NULL;
+    }
+    void* q = realloc(p, new_size);
+    if (!q) {
+        eprintf("Out of memory allocating %zu bytes.\n", new_size);
+        exit(RUNTIME_ERROR);
+    }
+    return q;
+}
+
+void heap_configure(double growth, size_t min_heap, size_t max_heap) {
+    vm.gc_growth = growth;
+    vm.gc_min_heap = min_heap;
+    vm.max_heap = max_heap;
+    vm.gc_threshold = min_heap;
+    if (max_heap && vm.gc_threshold > max_heap) vm.gc_threshold = max_heap;
+}
+
 Obj* alloc_obj(ObjType t, size_t size) {
 #ifdef DEBUG_MEM
     eprintf("ALLOC %ld B, ", size);
     eprint_objtype(t);
     eprintf("\n");
 #endif
-    Obj* o = malloc(size);
-    vm.alloc_bytes += size;
-    vm.alloc_objs++;
-    o->type = t;
-
+    // Collecting before the object is made means an object that would take
+    // the heap over its limit gets one collection to make room first, as
+    // the threshold is never above the limit
+    if (!cur_heap) {
 #ifdef DEBUG_GC_STRESS
-    collect_garbage();
-#else
-    if (vm.alloc_bytes >= vm.gc_threshold) {
         collect_garbage();
-        vm.gc_threshold = vm.alloc_bytes * 2;
-    }
+#else
+        if (vm.alloc_bytes + size >= vm.gc_threshold) collect_garbage();
 #endif
+    }
+    Obj* o = reallocate(NULL, 0, size);
+    o->type = t;
+    o->site = 0;
+    if (cur_heap) {
+        o->next = cur_heap->objs;
+        cur_heap->objs = o;
+        return o;
+    }
+    vm.alloc_objs++;
 
     o->next = vm.objs;
     vm.objs = o;
+    if (alloc_profiling) profile_alloc(o, size);
     return o;
 }
 
 #define ALLOC_OBJ(type, objtype, adlen)                                        \
     (type*) alloc_obj(objtype, sizeof(type) + adlen)
 
+size_t obj_size(Obj* o) {
+    switch (o->type) {
+        case OT_STRING:
+            return sizeof(ObjString) + ((ObjString*) o)->len + 1;
+        case OT_FUNCTION:
+            return sizeof(ObjFunction);
+        case OT_CLOSURE:
+            return sizeof(ObjClosure);
+        case OT_UPVALUE:
+            return sizeof(ObjUpvalue);
+        case OT_CLASS:
+            return sizeof(ObjClass);
+        case OT_INSTANCE:
+            return sizeof(ObjInstance);
+        case OT_ARRAY:
+            return sizeof(ObjArray) + ((ObjArray*) o)->len * sizeof(Value);
+    }
+    return 0;
+}
+
 void free_obj(Obj* o) {
-    size_t size = 0;
+    size_t size = obj_size(o);
     switch (o->type) {
         case OT_STRING:
-            size = sizeof(ObjString) + ((ObjString*) o)->len + 1;
             table_delete(&vm.strings, (ObjString*) o);
             break;
-        case OT_FUNCTION:
-            size = sizeof(ObjFunction);
-            free(((ObjFunction*) o)->upvalues);
-            chunk_free(&((ObjFunction*) o)->chunk);
+        case OT_FUNCTION: {
+            ObjFunction* f = (ObjFunction*) o;
+            FREE_ARRAY(f->upvalues, f->nupvalues);
+            if (f->lazy) {
+                FREE_ARRAY(f->lazy->names, f->nupvalues + 1);
+                FREE_ARRAY(f->lazy, 1);
+            }
+            chunk_free(&f->chunk);
+            chunk_free(&f->rchunk);
+            if (f->map) loxc_release(f->map);
             break;
+        }
         case OT_CLOSURE:
-            size = sizeof(ObjClosure);
-            free(((ObjClosure*) o)->upvalues);
+            FREE_ARRAY(((ObjClosure*) o)->upvalues,
+                       ((ObjClosure*) o)->nupvalues);
             break;
         case OT_UPVALUE:
-            size = sizeof(ObjUpvalue);
             break;
         case OT_CLASS:
-            size = sizeof(ObjClass);
             table_free(&((ObjClass*) o)->methods);
             break;
         case OT_INSTANCE:
-            size = sizeof(ObjInstance);
             table_free(&((ObjInstance*) o)->attrs);
             break;
         case OT_ARRAY:
-            size = sizeof(ObjArray) + ((ObjArray*) o)->len * sizeof(Value);
             break;
     }
 #ifdef DEBUG_MEM
@@ -141,8 +214,7 @@ void free_obj(Obj* o) {
     eprint_objtype(o->type);
     eprintf("\n");
 #endif
-    free(o);
-    vm.alloc_bytes -= size;
+    reallocate(o, size, 0);
     vm.alloc_objs--;
 }
 
@@ -150,20 +222,33 @@ void free_obj(Obj* o) {
 #define UNMARK(o) ((o)->next = (Obj*) ((intptr_t) (o)->next & ~1))
 #define MARKED(o) ((intptr_t) (o)->next & 1)
 
+// Frozen objects keep their number in vm.frozen where the list link was,
+// and their mark bits in vm.frozen_marks
+#define FROZEN(o) ((intptr_t) (o)->next & 2)
+#define FROZEN_ID(o) ((intptr_t) (o)->next >> 2)
+#define FROZEN_MARKS_SIZE() ((vm.frozen.size + 7) / 8)
+
 #define MARK_VALUE(v)                                                          \
     if ((v).type == VT_OBJ) MARK_OBJ((v).obj)
 
 #define MARK_OBJ(o) (mark_obj((Obj*) o))
 
 void mark_obj(Obj* o) {
-    if (MARKED(o)) return;
-    MARK(o);
+    if (FROZEN(o)) {
+        size_t id = FROZEN_ID(o);
+        if (vm.frozen_marks[id / 8] & 1 << id % 8) return;
+        vm.frozen_marks[id / 8] |= 1 << id % 8;
+    } else {
+        if (MARKED(o)) return;
+        MARK(o);
+    }
     switch (o->type) {
         case OT_STRING:
             break;
         case OT_FUNCTION: {
             ObjFunction* f = (ObjFunction*) o;
             if (f->name) MARK_OBJ(f->name);
+            if (f->lazy) MARK_OBJ(f->lazy->source);
             for (int i = 0; i < f->chunk.constants.size; i++) {
                 MARK_VALUE(f->chunk.constants.d[i]);
             }
@@ -214,6 +299,9 @@ void mark_table(Table* tbl) {
 
 void collect_garbage() {
     if (!vm.gc_on) return;
+    u64 start = tracing ? trace_clock() : 0;
+    size_t bytes_before = vm.alloc_bytes;
+    if (perfstat) perfstat_gc_begin();
 #ifdef DEBUG_MEM
     eprintf("------ begin gc [%ld B, %d OBJ] --------\n", vm.alloc_bytes,
             vm.alloc_objs);
@@ -227,6 +315,14 @@ void collect_garbage() {
         if (p->clos) MARK_OBJ(p->clos);
     }
     mark_table(&vm.globals);
+    mark_table(&vm.base_globals);
+    for (int i = 0; i < vm.modules.size; i++) {
+        MARK_OBJ(vm.modules.d[i].path);
+        MARK_OBJ(vm.modules.d[i].f);
+    }
+    for (int i = 0; i < vm.api_stack.size; i++) {
+        MARK_VALUE(vm.api_stack.d[i]);
+    }
     for (ObjUpvalue* p = vm.open_upvalues; p; p = p->next) {
         MARK_OBJ(p);
     }
@@ -235,6 +331,7 @@ void collect_garbage() {
     while (*p) {
         if (MARKED(*p)) {
             UNMARK(*p);
+            if ((*p)->site) profile_survivor(*p, obj_size(*p));
             p = &(*p)->next;
         } else {
             Obj* tmp = *p;
@@ -242,6 +339,20 @@ void collect_garbage() {
             free_obj(tmp);
         }
     }
+    if (vm.frozen.size) memset(vm.frozen_marks, 0, FROZEN_MARKS_SIZE());
+
+    vm.gc_threshold = vm.alloc_bytes * vm.gc_growth;
+    if (vm.gc_threshold < vm.gc_min_heap) vm.gc_threshold = vm.gc_min_heap;
+    if (vm.max_heap && vm.gc_threshold > vm.max_heap) {
+        vm.gc_threshold = vm.max_heap;
+    }
+    if (vm.max_heap && vm.alloc_bytes > vm.max_heap) {
+        vm.heap_exceeded = true;
+        vm.interrupt = true;
+    }
+    if (alloc_profiling) profile_gc();
+    if (perfstat) perfstat_gc_end();
+    if (start) trace_gc(start, bytes_before, vm.alloc_bytes);
 
 #ifdef DEBUG_MEM
     eprintf("------ end gc [%ld B, %d OBJ] --------\n", vm.alloc_bytes,
@@ -249,12 +360,111 @@ void collect_garbage() {
 #endif
 }
 
+void heap_init(Heap* h) {
+    h->objs = NULL;
+    table_init(&h->strings);
+    h->bytes = 0;
+}
+
+void heap_enter(Heap* h) {
+    cur_heap = h;
+}
+
+void heap_leave() {
+    cur_heap = NULL;
+}
+
+// The VM's copy of a string interned in h, once heap_adopt has found it
+static ObjString* adopted_string(Heap* h, ObjString* s) {
+    Value v;
+    table_get(&h->strings, s, &v);
+    return (ObjString*) v.obj;
+}
+
+static void adopt_constants(Heap* h, Chunk* c) {
+    for (int i = 0; i < c->constants.size; i++) {
+        Value* v = &c->constants.d[i];
+        if (isObjType(*v, OT_STRING)) {
+            *v = OBJ_VAL(adopted_string(h, (ObjString*) v->obj));
+        }
+    }
+}
+
+void heap_adopt(Heap* h) {
+    for (int i = 0; i < h->strings.cap; i++) {
+        Entry* e = &h->strings.ents[i];
+        if (!e->key) continue;
+        ObjString* s = table_find_string(&vm.strings, e->key);
+        if (!s) {
+            s = e->key;
+            table_set(&vm.strings, s, NIL_VAL);
+        }
+        e->value = OBJ_VAL(s);
+    }
+
+    // Compiles only leave strings in functions and class names
+    for (Obj* o = h->objs; o; o = o->next) {
+        if (o->type == OT_FUNCTION) {
+            ObjFunction* f = (ObjFunction*) o;
+            if (f->name) f->name = adopted_string(h, f->name);
+            if (f->lazy) {
+                f->lazy->source = adopted_string(h, f->lazy->source);
+            }
+            adopt_constants(h, &f->chunk);
+            adopt_constants(h, &f->rchunk);
+        } else if (o->type == OT_CLASS) {
+            ObjClass* c = (ObjClass*) o;
+            c->name = adopted_string(h, c->name);
+        }
+    }
+
+    while (h->objs) {
+        Obj* o = h->objs;
+        h->objs = o->next;
+        if (o->type == OT_STRING) {
+            ObjString* s = (ObjString*) o;
+            Value v;
+            if (!table_get(&h->strings, s, &v) || v.obj != o) {
+                // The VM already had it, or it was never interned
+                h->bytes -= sizeof(ObjString) + s->len + 1;
+                free(o);
+                continue;
+            }
+        }
+        o->next = vm.objs;
+        vm.objs = o;
+        vm.alloc_objs++;
+    }
+    vm.alloc_bytes += h->bytes;
+
+    table_free(&h->strings);
+    heap_init(h);
+}
+
 void free_all_obj() {
     while (vm.objs) {
         Obj* tmp = vm.objs;
         vm.objs = vm.objs->next;
         free_obj(tmp);
     }
+    for (int i = 0; i < vm.frozen.size; i++) free_obj(vm.frozen.d[i]);
+    FREE_ARRAY(vm.frozen_marks, FROZEN_MARKS_SIZE());
+    Vec_free_heap(vm.frozen);
+}
+
+// Takes every object out of the GC's list for good. Collections after
+// this only write to mark bits kept on the side, so pages holding these
+// objects stay shared with the parent after a fork.
+void heap_freeze() {
+    FREE_ARRAY(vm.frozen_marks, FROZEN_MARKS_SIZE());
+    while (vm.objs) {
+        Obj* o = vm.objs;
+        vm.objs = o->next;
+        Vec_push_heap(vm.frozen, o);
+        o->next = (Obj*) ((intptr_t) (vm.frozen.size - 1) << 2 | 2);
+    }
+    vm.frozen_marks = ALLOCATE(u8, FROZEN_MARKS_SIZE());
+    memset(vm.frozen_marks, 0, FROZEN_MARKS_SIZE());
 }
 
 #define ALLOC_STRING(len) ALLOC_OBJ(ObjString, OT_STRING, len + 1)
@@ -273,15 +483,15 @@ u32 hash(char* str) {
 ObjString* create_string(char* str, int len) {
     ObjString* o = ALLOC_STRING(len);
     o->len = len;
-    memcpy(o->data, str, len);
+    if (len) memcpy(o->data, str, len);
     o->data[len] = '\0';
     HASH_STR(o);
 
-    ObjString* intern = table_find_string(&vm.strings, o);
+    ObjString* intern = table_find_string(STRINGS, o);
     if (intern) {
         return intern;
     } else {
-        table_set(&vm.strings, o, NIL_VAL);
+        table_set(STRINGS, o, NIL_VAL);
         return o;
     }
 }
@@ -292,11 +502,11 @@ ObjString* concat_string(ObjString* a, ObjString* b) {
     strcpy(c->data, a->data);
     strcat(c->data, b->data);
     HASH_STR(c);
-    ObjString* intern = table_find_string(&vm.strings, c);
+    ObjString* intern = table_find_string(STRINGS, c);
     if (intern) {
         return intern;
     } else {
-        table_set(&vm.strings, c, NIL_VAL);
+        table_set(STRINGS, c, NIL_VAL);
         return c;
     }
 }
@@ -307,7 +517,11 @@ ObjFunction* create_function() {
     func->nargs = 0;
     func->nupvalues = 0;
     func->upvalues = NULL;
+    func->lazy = NULL;
+    func->map = NULL;
     chunk_init(&func->chunk);
+    chunk_init(&func->rchunk);
+    func->nregs = 0;
     return func;
 }
 
@@ -352,7 +566,8 @@ ObjArray* create_array(size_t len) {
 ObjArray* create_array_full(size_t len, Value* vals) {
     ObjArray* arr = ALLOC_OBJ(ObjArray, OT_ARRAY, len * sizeof(Value));
     arr->len = len;
-    memcpy(arr->data, vals, len * sizeof(Value));
+    // vals may be NULL when there are none, as in an image
+    if (len) memcpy(arr->data, vals, len * sizeof(Value));
     return arr;
 }
 
@@ -360,6 +575,10 @@ void disassemble_function(ObjFunction* func) {
     eprintf("===== begin %s =====\n",
             func->name ? func->name->data : "<anonymous fn>");
     disassemble_chunk(&func->chunk);
+    if (vm.regvm) {
+        eprintf("----- registers (%d) -----\n", func->nregs);
+        disassemble_rchunk(&func->rchunk);
+    }
     eprintf("===== end %s =====\n",
             func->name ? func->name->data : "<anonymous fn>");
 }
\ No newline at end of file
@@ -20,6 +20,7 @@ typedef enum {
 
 typedef struct _Obj {
     ObjType type;
+    u32 site; // allocation site + 1 while profiled, see profile_alloc
     struct _Obj* next;
 } Obj;
 
@@ -30,16 +31,32 @@ typedef struct _ObjString {
     char data[];
 } ObjString;
 
+typedef struct _LoxcMap LoxcMap;
+
+// A function body the compiler only skimmed, see compile_lazy
+typedef struct {
+    ObjString* source; // the whole script
+    int start, line;   // of the parameter list
+    struct {
+        int start, len;
+    }* names; // of the upvalues, as offsets into source
+} LazyBody;
+
 typedef struct {
     Obj hdr;
     ObjString* name;
     int nargs;
     Chunk chunk;
+    // Register translation of chunk, used with --reg
+    Chunk rchunk;
+    int nregs;
     struct {
         u8 id;
         bool local;
     }* upvalues;
     int nupvalues;
+    LazyBody* lazy; // until the body is compiled
+    LoxcMap* map;   // the mapped .loxc its code is in, see loxc_release
 } ObjFunction;
 
 typedef struct _ObjUpvalue {
@@ -74,6 +91,14 @@ typedef struct {
     Value data[];
 } ObjArray;
 
+// Objects made away from the VM, by a compile on another thread, along
+// with their own string table. heap_adopt hands them over to the VM.
+typedef struct {
+    Obj* objs;
+    Table strings;
+    size_t bytes;
+} Heap;
+
 static inline bool
 isObjType(Value v, ObjType t) {
     return v.type == VT_OBJ && v.obj->type == t;
@@ -83,8 +108,37 @@ void fprint_obj(FILE* file, Obj* obj, bool debug);
 #define print_obj(obj) fprint_obj(stdout, obj, false)
 #define eprint_obj(obj) fprint_obj(stderr, obj, true)
 
+// Everything the heap holds is allocated through here: objects and the
+// tables, code and arrays they own, and the VM's own tables. That keeps
+// vm.alloc_bytes, which paces the collector, to what the heap really takes.
+// Frees p when new_size is 0. Never collects, as callers are mid-update.
+void* reallocate(void* p, size_t old_size, size_t new_size);
+#define ALLOCATE(type, n) (type*) reallocate(NULL, 0, (n) * sizeof(type))
+#define FREE_ARRAY(p, n) reallocate(p, (n) * sizeof *(p), 0)
+
+// Vec_push and Vec_free for vectors the heap holds
+#define Vec_push_heap(v, e)                                                    \
+    do {                                                                       \
+        if ((v).size == (v).cap) {                                             \
+            size_t cap = (v).cap ? 2 * (v).cap : 8;                            \
+            (v).d = reallocate((v).d, (v).cap * sizeof *(v).d,                 \
+                               cap * sizeof *(v).d);                           \
+            (v).cap = cap;                                                     \
+        }                                                                      \
+        (v).d[(v).size++] = (e);                                               \
+    } while (false)
+#define Vec_free_heap(v) FREE_ARRAY((v).d, (v).cap)
+
+// Sets how the collector paces itself: after each collection the heap may
+// grow to growth times what survived, but no less than min_heap, before
+// the next one. With max_heap, an allocation that would go over it gets
+// one collection to make room for objects, and a program that still goes
+// over stops with a runtime error at its next call or jump.
+void heap_configure(double growth, size_t min_heap, size_t max_heap);
+
 Obj* alloc_obj(ObjType t, size_t size);
 void free_obj(Obj* o);
+size_t obj_size(Obj* o); // of the object itself
 
 void mark_obj(Obj* o);
 void mark_table(Table* t);
@@ -92,6 +146,12 @@ void mark_table(Table* t);
 void collect_garbage();
 void free_all_obj();
 
+void heap_init(Heap* h);
+void heap_enter(Heap* h);
+void heap_leave();
+void heap_adopt(Heap* h);
+void heap_freeze();
+
 ObjString* create_string(char* str, int len);
 #define CREATE_STRING_LITERAL(str) create_string(str, sizeof str - 1)
 ObjString* concat_string(ObjString* a, ObjString* b);
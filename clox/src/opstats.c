@@ -0,0 +1,115 @@
+#include "opstats.h"
+
+#ifdef DEBUG_OPSTATS
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunk.h"
+
+#define TOP_PAIRS 40
+
+OpStats opstats = {.timing = -1}, ropstats = {.timing = -1};
+
+#define NAME(op) [op] = #op
+
+static char* op_names[256] = {
+    NAME(OP_NOP),             NAME(OP_DEF_GLOBAL),
+    NAME(OP_PUSH_GLOBAL),     NAME(OP_POP_GLOBAL),
+    NAME(OP_PUSH_LOCAL),      NAME(OP_POP_LOCAL),
+    NAME(OP_PUSH_UPVALUE),    NAME(OP_POP_UPVALUE),
+    NAME(OP_PUSH_CLOSURE),    NAME(OP_PUSH_ARRAY),
+    NAME(OP_PUSH_ARRAY_INIT), NAME(OP_PUSH_CONST),
+    NAME(OP_PUSH_NIL),        NAME(OP_PUSH_TRUE),
+    NAME(OP_PUSH_FALSE),      NAME(OP_PUSH),
+    NAME(OP_POP),             NAME(OP_POPN),
+    NAME(OP_GETATTR),         NAME(OP_SETATTR),
+    NAME(OP_GETITEM),         NAME(OP_SETITEM),
+    NAME(OP_NEG),             NAME(OP_ADD),
+    NAME(OP_SUB),             NAME(OP_MUL),
+    NAME(OP_DIV),             NAME(OP_MOD),
+    NAME(OP_NOT),             NAME(OP_TEQ),
+    NAME(OP_TGT),             NAME(OP_TLT),
+    NAME(OP_JMP),             NAME(OP_JMP_TRUE),
+    NAME(OP_JMP_FALSE),       NAME(OP_CALL),
+    NAME(OP_RET),             NAME(OP_INLINE),
+    NAME(OP_INLINE_RET),      NAME(OP_PUSH_STACK),
+    NAME(OP_POP_STACK),       NAME(OP_LAZY),
+};
+
+static char* rop_names[256] = {
+    NAME(R_MOV),         NAME(R_LOADK),       NAME(R_DEF_GLOBAL),
+    NAME(R_GET_GLOBAL),  NAME(R_SET_GLOBAL),  NAME(R_GET_UPVALUE),
+    NAME(R_SET_UPVALUE), NAME(R_CLOSURE),     NAME(R_ARRAY),
+    NAME(R_ARRAY_INIT),  NAME(R_GETATTR),     NAME(R_SETATTR),
+    NAME(R_GETITEM),     NAME(R_SETITEM),     NAME(R_NEG),
+    NAME(R_NOT),         NAME(R_ADD),         NAME(R_ADDK),
+    NAME(R_SUB),         NAME(R_SUBK),        NAME(R_MUL),
+    NAME(R_MULK),        NAME(R_DIV),         NAME(R_DIVK),
+    NAME(R_MOD),         NAME(R_MODK),        NAME(R_TEQ),
+    NAME(R_TEQK),        NAME(R_TGT),         NAME(R_TGTK),
+    NAME(R_TLT),         NAME(R_TLTK),        NAME(R_JMP),
+    NAME(R_JMP_TRUE),    NAME(R_JMP_FALSE),   NAME(R_JEQ),
+    NAME(R_JEQK),        NAME(R_JGT),         NAME(R_JGTK),
+    NAME(R_JLT),         NAME(R_JLTK),        NAME(R_CALL),
+    NAME(R_INLINE),      NAME(R_CLOSE),       NAME(R_RET),
+    NAME(R_LAZY),
+};
+
+static u64* sort_keys;
+
+static int by_key_desc(const void* a, const void* b) {
+    u64 x = sort_keys[*(int*) a], y = sort_keys[*(int*) b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static double est_ticks(OpStats* s, int op) {
+    return s->timed[op] ? (double) s->ticks[op] / s->timed[op] * s->count[op]
+                        : 0;
+}
+
+static void report(OpStats* s, char** names, char* title) {
+    u64 total = 0;
+    double total_ticks = 0;
+    for (int i = 0; i < 256; i++) {
+        total += s->count[i];
+        total_ticks += est_ticks(s, i);
+    }
+    if (!total) return;
+
+    int order[256];
+    for (int i = 0; i < 256; i++) order[i] = i;
+    sort_keys = s->count;
+    qsort(order, 256, sizeof *order, by_key_desc);
+    eprintf("=========== %s: %lu instructions ===========\n", title, total);
+    eprintf("%-20s %14s %7s %10s %7s\n", "opcode", "count", "%", "ticks/op",
+            "%time");
+    for (int i = 0; i < 256 && s->count[order[i]]; i++) {
+        int op = order[i];
+        eprintf("%-20s %14lu %6.2f%% %10.1f %6.2f%%\n",
+                names[op] ? names[op] : "?", s->count[op],
+                100.0 * s->count[op] / total,
+                s->timed[op] ? (double) s->ticks[op] / s->timed[op] : 0,
+                total_ticks ? 100 * est_ticks(s, op) / total_ticks : 0);
+    }
+
+    int* pairs = malloc(256 * 256 * sizeof *pairs);
+    for (int i = 0; i < 256 * 256; i++) pairs[i] = i;
+    sort_keys = &s->pairs[0][0];
+    qsort(pairs, 256 * 256, sizeof *pairs, by_key_desc);
+    eprintf("%-41s %14s %7s\n", "pair", "count", "%");
+    for (int i = 0; i < TOP_PAIRS && sort_keys[pairs[i]]; i++) {
+        int a = pairs[i] >> 8, b = pairs[i] & 0xff;
+        eprintf("%-20s %-20s %14lu %6.2f%%\n", names[a] ? names[a] : "?",
+                names[b] ? names[b] : "?", s->pairs[a][b],
+                100.0 * s->pairs[a][b] / total);
+    }
+    free(pairs);
+}
+
+__attribute__((destructor)) static void opstats_report() {
+    report(&opstats, op_names, "stack code");
+    report(&ropstats, rop_names, "register code");
+}
+
+#endif
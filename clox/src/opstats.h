@@ -0,0 +1,59 @@
+#ifndef OPSTATS_H
+#define OPSTATS_H
+
+#include "types.h"
+
+// Built with DEBUG_OPSTATS, the interpreters count the instructions they
+// dispatch and each pair dispatched back to back, and time one dispatch in
+// every OPSTATS_PERIOD up to the next one. The counts sorted, with the
+// time each opcode is estimated to take counting the bookkeeping, go to
+// stderr at exit.
+#ifdef DEBUG_OPSTATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define opstats_clock() __rdtsc()
+#else
+#include <time.h>
+static inline u64 opstats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+#define OPSTATS_PERIOD 61 // odd so that loops do not alias with it
+
+typedef struct {
+    u64 count[256];
+    u64 pairs[256][256];
+    u64 ticks[256];
+    u64 timed[256];
+    int prev;
+    int timing; // the opcode being timed, or -1
+    u64 start;
+    int countdown;
+} OpStats;
+
+// One for the stack code, one for the register code
+extern OpStats opstats, ropstats;
+
+static inline void opstats_dispatch(OpStats* s, int op) {
+    s->count[op]++;
+    s->pairs[s->prev][op]++;
+    s->prev = op;
+    if (s->timing >= 0) {
+        s->ticks[s->timing] += opstats_clock() - s->start;
+        s->timed[s->timing]++;
+        s->timing = -1;
+    }
+    if (--s->countdown <= 0) {
+        s->countdown = OPSTATS_PERIOD;
+        s->timing = op;
+        s->start = opstats_clock();
+    }
+}
+
+#endif
+
+#endif
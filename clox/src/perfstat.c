@@ -0,0 +1,177 @@
+#include "perfstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+bool perfstat;
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef enum {
+    PS_CYCLES,
+    PS_INSTRUCTIONS,
+    PS_BRANCHES,
+    PS_BRANCH_MISSES,
+    PS_LLC_MISSES,
+    PS_N
+} Counter;
+
+static const u64 configs[PS_N] = {
+    PERF_COUNT_HW_CPU_CYCLES,        PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+static const char* names[PS_N] = {
+    "cycles", "instructions", "branches", "branch misses", "LLC misses",
+};
+
+// The counters are one group, read together through the leader. slot is
+// where a counter comes in a read, or -1 if it could not be opened.
+static int leader = -1;
+static int slot[PS_N];
+static int nopen;
+static u64 gc_start[PS_N], gc_total[PS_N];
+static long gcs;
+
+// Counts since perfstat_start, and the part of the time they were live
+static bool read_counters(u64* vals, double* scale) {
+    u64 buf[3 + PS_N]; // nr, time enabled, time running, values
+    if (read(leader, buf, sizeof buf) < (ssize_t) ((3 + nopen) * 8)) {
+        return false;
+    }
+    for (int i = 0; i < PS_N; i++) {
+        vals[i] = slot[i] < 0 ? 0 : buf[3 + slot[i]];
+    }
+    if (scale) *scale = buf[2] ? (double) buf[1] / buf[2] : 0;
+    return true;
+}
+
+void perfstat_gc_begin() {
+    if (!read_counters(gc_start, NULL)) return;
+    gcs++;
+}
+
+void perfstat_gc_end() {
+    u64 vals[PS_N];
+    if (!read_counters(vals, NULL)) return;
+    for (int i = 0; i < PS_N; i++) gc_total[i] += vals[i] - gc_start[i];
+}
+
+static bool have(Counter c) {
+    return slot[c] >= 0;
+}
+
+// The three columns are the whole run, the mutator and the collector
+static void print_counter(Counter c, double cols[][PS_N], int ncols) {
+    eprintf("  %-18s", names[c]);
+    for (int j = 0; j < ncols; j++) {
+        if (have(c)) {
+            eprintf(" %16.0f", cols[j][c]);
+        } else {
+            eprintf(" %16s", "n/a");
+        }
+    }
+    eprintf("\n");
+}
+
+static void print_ratio(char* name, Counter num, Counter den, double mul,
+                        double cols[][PS_N], int ncols) {
+    if (!have(num) || !have(den)) return;
+    eprintf("  %-18s", name);
+    for (int j = 0; j < ncols; j++) {
+        if (cols[j][den]) {
+            eprintf(" %16.3f", mul * cols[j][num] / cols[j][den]);
+        } else {
+            eprintf(" %16s", "-");
+        }
+    }
+    eprintf("\n");
+}
+
+static void write_perfstat() {
+    perfstat = false;
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    u64 total[PS_N];
+    double scale;
+    if (!read_counters(total, &scale) || !scale) {
+        eprintf("perfstat: the counters never ran\n");
+        return;
+    }
+    // Sharing the PMU with other users, the counters only ran part of the
+    // time and the counts are estimates
+    double cols[3][PS_N];
+    for (int i = 0; i < PS_N; i++) {
+        cols[0][i] = total[i] * scale;
+        cols[2][i] = gc_total[i] * scale;
+        if (cols[2][i] > cols[0][i]) cols[2][i] = cols[0][i];
+        cols[1][i] = cols[0][i] - cols[2][i];
+    }
+    int ncols = gcs ? 3 : 1;
+
+    eprintf("perfstat%s, %ld collections:\n",
+            scale > 1.001 ? " (scaled)" : "", gcs);
+    eprintf("  %-18s %16s", "", "total");
+    if (gcs) eprintf(" %16s %16s", "mutator", "gc");
+    eprintf("\n");
+    for (int i = 0; i < PS_N; i++) print_counter(i, cols, ncols);
+    print_ratio("IPC", PS_INSTRUCTIONS, PS_CYCLES, 1, cols, ncols);
+    print_ratio("branch miss %", PS_BRANCH_MISSES, PS_BRANCHES, 100, cols,
+                ncols);
+    print_ratio("LLC misses/1k ins", PS_LLC_MISSES, PS_INSTRUCTIONS, 1000,
+                cols, ncols);
+}
+
+bool perfstat_start() {
+    for (int i = 0; i < PS_N; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof attr,
+            .config = configs[i],
+            .disabled = leader < 0,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING,
+        };
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        if (fd < 0) {
+            slot[i] = -1;
+            continue;
+        }
+        if (leader < 0) leader = fd;
+        slot[i] = nopen++;
+    }
+    if (leader < 0) {
+        eprintf("clox: no hardware counters: %s\n", strerror(errno));
+        if (errno == EACCES || errno == EPERM) {
+            eprintf("clox: see /proc/sys/kernel/perf_event_paranoid\n");
+        }
+        return false;
+    }
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    perfstat = true;
+    atexit(write_perfstat);
+    return true;
+}
+
+#else
+
+void perfstat_gc_begin() {}
+void perfstat_gc_end() {}
+
+bool perfstat_start() {
+    eprintf("clox: no hardware counters on this system\n");
+    return false;
+}
+
+#endif
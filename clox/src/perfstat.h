@@ -0,0 +1,18 @@
+#ifndef PERFSTAT_H
+#define PERFSTAT_H
+
+#include "types.h"
+
+extern bool perfstat;
+
+// Counts the cycles, instructions, branches, branch misses and last level
+// cache misses of this thread in user space from here on, and prints them
+// to stderr at exit, split into time in the collector and the rest. Fails,
+// saying why, where the kernel lets us have none of them; counters it does
+// not have are left out.
+bool perfstat_start();
+// Around each collection
+void perfstat_gc_begin();
+void perfstat_gc_end();
+
+#endif
@@ -0,0 +1,255 @@
+#include "profile.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "chunk.h"
+#include "intern.h"
+#include "vm.h"
+
+#define INTERVAL_US 1000
+
+volatile sig_atomic_t profile_ticks;
+
+static char* out_path;
+static Interner frames, stacks; // stacks by their frame ids
+static Vector(long) stack_ticks;
+
+bool alloc_profiling;
+
+typedef struct {
+    double bytes, objs;
+    double kept_bytes, kept_objs; // survived a collection
+} SiteStats;
+
+// Sites are interned by frame id and object type. The site of each
+// allocating instruction is cached until the next collection, which may
+// free its function and let another take the same address.
+#define SITE_CACHE 1024
+static struct {
+    ObjFunction* f;
+    u8* ip;
+    ObjType type;
+    int site;
+} site_cache[SITE_CACHE];
+
+static char* alloc_path;
+static size_t sample_bytes;
+static i64 until_sample;
+static u32 rng = 1;
+static Interner sites;
+static Vector(SiteStats) site_stats;
+static int ngcs;
+
+static char* type_names[] = {
+    [OT_STRING] = "String",     [OT_FUNCTION] = "Function",
+    [OT_CLOSURE] = "Closure",   [OT_UPVALUE] = "Upvalue",
+    [OT_CLASS] = "Class",       [OT_INSTANCE] = "Instance",
+    [OT_ARRAY] = "Array",
+};
+#define NTYPES (int) (sizeof type_names / sizeof *type_names)
+
+static int frame_label(ObjFunction* f, int line) {
+    char label[128];
+    int len = snprintf(label, sizeof label, "%s:%d",
+                       f->name ? f->name->data : "<anonymous fn>", line);
+    if (len >= sizeof label) len = sizeof label - 1;
+    return intern(&frames, label, len);
+}
+
+// Labels a frame with its function and the line it is at, as if each call
+// inlined there had made a frame of its own. Returns the number of labels.
+static int frame_ids(CallFrame* p, int* ids) {
+    ObjFunction* f = p->func;
+    Chunk* c = vm.regvm ? &f->rchunk : &f->chunk;
+    u8* pc = p->ip - 1;
+    Inlined* in[MAX_INLINED];
+    int n = chunk_inlined_at(c, pc, in);
+    for (int i = 0; i < n; i++) {
+        ids[i] = frame_label(f, in[i]->line);
+        f = (ObjFunction*) c->constants.d[in[i]->f].obj;
+    }
+    ids[n] = frame_label(f, chunk_get_instr_line(c, pc));
+    return n + 1;
+}
+
+void profile_sample() {
+    int ticks = __atomic_exchange_n(&profile_ticks, 0, __ATOMIC_RELAXED);
+    int ids[MAX_CALLS * (MAX_INLINED + 1)];
+    int n = 0;
+    for (CallFrame* p = vm.call_stack; p <= vm.csp; p++) {
+        n += frame_ids(p, ids + n);
+    }
+    int id = intern(&stacks, (char*) ids, n * sizeof *ids);
+    while (stack_ticks.size <= id) Vec_push(stack_ticks, 0);
+    stack_ticks.d[id] += ticks;
+}
+
+static void on_tick(int sig) {
+    __atomic_fetch_add(&profile_ticks, 1, __ATOMIC_RELAXED);
+    vm_interrupt = 1;
+}
+
+static void write_profile() {
+    setitimer(ITIMER_PROF, &(struct itimerval){0}, NULL);
+    FILE* fp = fopen(out_path, "w");
+    if (!fp) {
+        eprintf("Could not write '%s'.\n", out_path);
+        return;
+    }
+    for (int i = 0; i < stacks.keys.size; i++) {
+        int* ids = (int*) interned(&stacks, i);
+        for (int j = 0; j < interned_len(&stacks, i) / sizeof *ids; j++) {
+            fprintf(fp, "%s%.*s", j ? ";" : "",
+                    interned_len(&frames, ids[j]), interned(&frames, ids[j]));
+        }
+        fprintf(fp, " %ld\n", stack_ticks.d[i]);
+    }
+    fclose(fp);
+}
+
+bool profile_start(char* path) {
+    out_path = path;
+    struct sigaction sa = {.sa_handler = on_tick, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    struct itimerval it = {{0, INTERVAL_US}, {0, INTERVAL_US}};
+    if (sigaction(SIGPROF, &sa, NULL) || setitimer(ITIMER_PROF, &it, NULL)) {
+        return false;
+    }
+    atexit(write_profile);
+    return true;
+}
+
+// The bytes to the next sample, exponentially distributed so that where
+// the last one fell makes no difference to the next, and each allocation
+// is sampled with a chance depending on its size alone
+static i64 next_sample() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return 1 - sample_bytes * log((rng + 1.0) / 4294967296.0);
+}
+
+// How many objects of this size one sample stands for, one over the
+// chance of sampling it
+static double sample_weight(size_t size) {
+    return sample_bytes ? 1 / -expm1(-(double) size / sample_bytes) : 1;
+}
+
+static int site_id(ObjType type) {
+    // Only running code has its frames flushed, the rest is the compiler
+    if (!vm.gc_on) {
+        int key[2] = {intern(&frames, "<compiler>", 10), type};
+        return intern(&sites, (char*) key, sizeof key);
+    }
+    ObjFunction* f = vm.csp->func;
+    u8* ip = vm.csp->ip;
+    int slot = ((uintptr_t) ip * 31 + type) % SITE_CACHE;
+    if (site_cache[slot].f == f && site_cache[slot].ip == ip &&
+        site_cache[slot].type == type) {
+        return site_cache[slot].site;
+    }
+    int ids[MAX_INLINED + 1];
+    int key[2] = {ids[frame_ids(vm.csp, ids) - 1], type};
+    int site = intern(&sites, (char*) key, sizeof key);
+    site_cache[slot].f = f;
+    site_cache[slot].ip = ip;
+    site_cache[slot].type = type;
+    site_cache[slot].site = site;
+    return site;
+}
+
+void profile_alloc(Obj* o, size_t size) {
+    if (sample_bytes) {
+        until_sample -= (i64) size;
+        if (until_sample > 0) return;
+        // Drawn afresh from here, as carrying over what went past it would
+        // sample the allocations after a large one too
+        until_sample = next_sample();
+    }
+    int site = site_id(o->type);
+    while (site_stats.size <= site) {
+        Vec_push(site_stats, (SiteStats){0});
+    }
+    double w = sample_weight(size);
+    site_stats.d[site].bytes += w * size;
+    site_stats.d[site].objs += w;
+    o->site = site + 1;
+}
+
+void profile_survivor(Obj* o, size_t size) {
+    double w = sample_weight(size);
+    site_stats.d[o->site - 1].kept_bytes += w * size;
+    site_stats.d[o->site - 1].kept_objs += w;
+    o->site = 0;
+}
+
+void profile_gc() {
+    ngcs++;
+    memset(site_cache, 0, sizeof site_cache);
+}
+
+static int by_bytes_desc(const void* a, const void* b) {
+    double x = site_stats.d[*(int*) a].bytes;
+    double y = site_stats.d[*(int*) b].bytes;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void write_alloc_profile() {
+    alloc_profiling = false;
+    FILE* fp = fopen(alloc_path, "w");
+    if (!fp) {
+        eprintf("Could not write '%s'.\n", alloc_path);
+        return;
+    }
+    SiteStats by_type[NTYPES] = {0}, total = {0};
+    for (int i = 0; i < site_stats.size; i++) {
+        SiteStats* s = &site_stats.d[i];
+        int type = ((int*) interned(&sites, i))[1];
+        by_type[type].bytes += s->bytes;
+        by_type[type].objs += s->objs;
+        by_type[type].kept_bytes += s->kept_bytes;
+        by_type[type].kept_objs += s->kept_objs;
+        total.bytes += s->bytes;
+        total.objs += s->objs;
+    }
+    fprintf(fp, "%.0f bytes in %.0f objects allocated, %d collections%s\n\n",
+            total.bytes, total.objs, ngcs,
+            sample_bytes ? ", estimated from samples" : "");
+
+    fprintf(fp, "%14s %12s %14s %12s  %s\n", "bytes", "objects",
+            "kept bytes", "kept objects", "type");
+    for (int i = 0; i < NTYPES; i++) {
+        SiteStats* s = &by_type[i];
+        if (!s->objs) continue;
+        fprintf(fp, "%14.0f %12.0f %14.0f %12.0f  %s\n", s->bytes, s->objs,
+                s->kept_bytes, s->kept_objs, type_names[i]);
+    }
+
+    int* order = malloc(site_stats.size * sizeof *order);
+    for (int i = 0; i < site_stats.size; i++) order[i] = i;
+    qsort(order, site_stats.size, sizeof *order, by_bytes_desc);
+    fprintf(fp, "\n%14s %12s %14s %12s  %-10s %s\n", "bytes", "objects",
+            "kept bytes", "kept objects", "type", "site");
+    for (int i = 0; i < site_stats.size; i++) {
+        SiteStats* s = &site_stats.d[order[i]];
+        int* key = (int*) interned(&sites, order[i]);
+        fprintf(fp, "%14.0f %12.0f %14.0f %12.0f  %-10s %.*s\n", s->bytes,
+                s->objs, s->kept_bytes, s->kept_objs, type_names[key[1]],
+                interned_len(&frames, key[0]), interned(&frames, key[0]));
+    }
+    free(order);
+    fclose(fp);
+}
+
+void alloc_profile_start(char* path, size_t sample) {
+    alloc_path = path;
+    sample_bytes = sample;
+    until_sample = next_sample();
+    alloc_profiling = true;
+    atexit(write_alloc_profile);
+}
@@ -0,0 +1,35 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <signal.h>
+
+#include "object.h"
+#include "types.h"
+
+// Timer ticks not yet turned into samples. The signal handler raises
+// vm_interrupt and the interpreter takes the sample at its next call or
+// jump, since the handler cannot see the frames it keeps in registers.
+extern volatile sig_atomic_t profile_ticks;
+
+// Samples the Lox call stack of the running VM every millisecond of CPU
+// time, and writes the stacks seen to path at exit in the collapsed format
+// taken by flamegraph tools
+bool profile_start(char* path);
+// Charges the pending ticks to the frames from vm.call_stack up to vm.csp
+void profile_sample();
+
+extern bool alloc_profiling;
+
+// Charges the bytes and objects allocated, and the part of them that
+// survives a collection, to the Lox function, line and object type they
+// come from, and writes the totals to path at exit. With sample_bytes,
+// only about one object in every sample_bytes allocated is looked at, and
+// the totals are scaled up from those.
+void alloc_profile_start(char* path, size_t sample_bytes);
+void profile_alloc(Obj* o, size_t size);
+// Called for a profiled object the first time it is still live after a
+// sweep, which then stops profiling it
+void profile_survivor(Obj* o, size_t size);
+void profile_gc(); // once the sweep is done
+
+#endif
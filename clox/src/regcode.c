@@ -0,0 +1,596 @@
+#include "regcode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "value.h"
+
+// Translates a function's stack bytecode into register bytecode, with the
+// frame slots as registers: a value at stack depth d lives in register d.
+// Pushes of locals and constants are deferred instead of copied, so that
+// an instruction consuming them can name their register or constant
+// directly. Deferred entries are written to their own slot when something
+// needs the actual stack: jumps and their targets, calls and closures.
+
+typedef struct {
+    bool k; // constant index rather than register
+    u8 n;
+} Operand;
+
+#define REG(r) ((Operand){false, (r)})
+#define KONST(c) ((Operand){true, (c)})
+#define SAME(a, b) ((a).k == (b).k && (a).n == (b).n)
+#define IN_PLACE(i) SAME(rc->vs[i], REG(i))
+
+enum { LABEL = 1, FALLBACK = 2 };
+
+typedef struct {
+    int at;
+    int dest;
+} Patch;
+
+// The call an R_INLINE falls back to, kept out of the way at the end
+typedef struct {
+    int at;   // the offset of the R_INLINE to point at it
+    int base;
+    int nargs;
+    int call; // the OP_CALL it was translated from
+} Fallback;
+
+typedef struct {
+    Chunk* src;
+    Chunk* dst;
+    u8* flags;
+    int* rpos;
+    Vector(Patch) patches;
+    Vector(Fallback) fallbacks;
+
+    Operand vs[MAX_REGS];
+    int depth;
+    bool ok;
+    int line;
+
+    int lastDst; // dst operand of the last instruction, if retargetable
+    Operand popped;
+    bool hasPopped;
+
+    bool captured[MAX_REGS];
+    int kNil, kTrue, kFalse;
+} RegCompiler;
+
+#define EMIT(b) chunk_write(rc->dst, (b), rc->line)
+#define EMIT2(b1, b2) (EMIT(b1), EMIT(b2))
+
+static void emit_op(RegCompiler* rc, u8 op) {
+    EMIT(op);
+    rc->lastDst = -1;
+}
+
+static void emit_dst(RegCompiler* rc, int r) {
+    rc->lastDst = rc->dst->code.size;
+    EMIT(r);
+}
+
+static void emit_jmp_dest(RegCompiler* rc, int dest) {
+    Vec_push(rc->patches, ((Patch){rc->dst->code.size, dest}));
+    EMIT2(0, 0);
+}
+
+static void push(RegCompiler* rc, Operand o) {
+    if (rc->depth == MAX_REGS) {
+        rc->ok = false;
+        return;
+    }
+    rc->vs[rc->depth++] = o;
+}
+
+static Operand pop(RegCompiler* rc) {
+    return rc->vs[--rc->depth];
+}
+
+static int konst(RegCompiler* rc, Value v, int* cache) {
+    if (*cache == -1) {
+        if (rc->dst->constants.size == 256) {
+            rc->ok = false;
+            return 0;
+        }
+        *cache = add_constant(rc->dst, v);
+    }
+    return *cache;
+}
+
+static void move(RegCompiler* rc, int r, Operand o) {
+    if (o.k) {
+        emit_op(rc, R_LOADK);
+        EMIT2(r, o.n);
+    } else if (o.n != r) {
+        emit_op(rc, R_MOV);
+        EMIT2(r, o.n);
+    }
+}
+
+// Gives an operand a register, loading a constant into slot r.
+static int in_reg(RegCompiler* rc, Operand o, int r) {
+    if (!o.k) return o.n;
+    move(rc, r, o);
+    return r;
+}
+
+// Entries only ever alias lower registers, so writing them out from the
+// top down never clobbers a register that is still to be read.
+static void flush_from(RegCompiler* rc, int base) {
+    for (int i = rc->depth - 1; i >= 0; i--) {
+        if (IN_PLACE(i)) continue;
+        if (i >= base || (!rc->vs[i].k && rc->captured[rc->vs[i].n])) {
+            move(rc, i, rc->vs[i]);
+            rc->vs[i] = REG(i);
+        }
+    }
+}
+
+static void flush(RegCompiler* rc) {
+    flush_from(rc, 0);
+}
+
+// Writes out the entries aliasing register r before it is overwritten.
+static void spill_aliases(RegCompiler* rc, int r) {
+    for (int i = 0; i < rc->depth; i++) {
+        if (i != r && SAME(rc->vs[i], REG(r))) {
+            move(rc, i, rc->vs[i]);
+            rc->vs[i] = REG(i);
+        }
+    }
+}
+
+static void store(RegCompiler* rc, int t) {
+    Operand o = pop(rc);
+    spill_aliases(rc, t);
+    if (SAME(o, REG(rc->depth)) && rc->lastDst != -1 &&
+        rc->dst->code.d[rc->lastDst] == rc->depth) {
+        // Have the instruction computing the value write it directly
+        rc->dst->code.d[rc->lastDst] = t;
+        rc->lastDst = -1;
+    } else {
+        move(rc, t, o);
+    }
+    rc->vs[t] = REG(t);
+    rc->popped = REG(t);
+    rc->hasPopped = true;
+}
+
+static void push_result(RegCompiler* rc, Operand o, bool discarded) {
+    if (!o.k && o.n > rc->depth && !discarded) {
+        move(rc, rc->depth, o);
+        o = REG(rc->depth);
+    }
+    push(rc, o);
+}
+
+static void close_popped(RegCompiler* rc, int from, int n) {
+    for (int i = from; i < from + n; i++) {
+        if (rc->captured[i]) {
+            emit_op(rc, R_CLOSE);
+            EMIT(from);
+            return;
+        }
+    }
+}
+
+static u8 rbinary[] = {
+    [OP_ADD] = R_ADD, [OP_SUB] = R_SUB, [OP_MUL] = R_MUL, [OP_DIV] = R_DIV,
+    [OP_MOD] = R_MOD, [OP_TEQ] = R_TEQ, [OP_TGT] = R_TGT, [OP_TLT] = R_TLT,
+};
+
+// Compare-and-branch instructions, 0 if there is none
+static u8 rbranch[256] = {
+    [OP_TEQ] = R_JEQ,
+    [OP_TGT] = R_JGT,
+    [OP_TLT] = R_JLT,
+};
+
+// Where the code translated from the instructions at off on starts
+static int translated_pos(RegCompiler* rc, int off) {
+    while (off < rc->src->code.size && rc->rpos[off] == -1) off++;
+    return off < rc->src->code.size ? rc->rpos[off] : rc->dst->code.size;
+}
+
+// Fills in rc->flags and rc->captured, and returns the number of registers
+// the translated code needs.
+static int scan(RegCompiler* rc, ObjFunction* f, int* depths) {
+    int nregs = f->nargs + 1;
+    for (int off = 0; off < rc->src->code.size;
+         off += instr_len(&rc->src->code.d[off])) {
+        u8* ip = &rc->src->code.d[off];
+        if (depths[off] == -1) continue;
+        if (depths[off] + 1 > nregs) nregs = depths[off] + 1;
+        switch (*ip) {
+            case OP_JMP:
+            case OP_JMP_TRUE:
+            case OP_JMP_FALSE:
+                rc->flags[off + instr_jmp_dest(ip)] |= LABEL;
+                break;
+            case OP_INLINE:
+                rc->flags[off + instr_jmp_dest(ip)] |= FALLBACK;
+                rc->flags[off + instr_jmp_dest(ip) + 2] |= LABEL;
+                break;
+            case OP_PUSH_CLOSURE: {
+                ObjFunction* g = (ObjFunction*) rc->src->constants.d[ip[1]].obj;
+                for (int i = 0; i < g->nupvalues; i++) {
+                    if (g->upvalues[i].local) {
+                        rc->captured[g->upvalues[i].id] = true;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return nregs;
+}
+
+bool regcode_translate(ObjFunction* f) {
+    RegCompiler state;
+    RegCompiler* rc = &state;
+    Chunk* src = &f->chunk;
+    rc->src = src;
+    rc->dst = &f->rchunk;
+    chunk_free(rc->dst);
+    chunk_init(rc->dst);
+    rc->flags = calloc(src->code.size + 1, sizeof *rc->flags);
+    rc->rpos = malloc((src->code.size + 1) * sizeof *rc->rpos);
+    for (int i = 0; i <= src->code.size; i++) rc->rpos[i] = -1;
+    Vec_init(rc->patches);
+    Vec_init(rc->fallbacks);
+    memset(rc->captured, 0, sizeof rc->captured);
+
+    int* depths = chunk_stack_depths(src, f->nargs + 1);
+    rc->ok = depths != NULL;
+    if (rc->ok) f->nregs = scan(rc, f, depths);
+    if (f->nregs > MAX_REGS) rc->ok = false;
+
+    for (int i = 0; i < src->constants.size; i++) {
+        add_constant(rc->dst, src->constants.d[i]);
+    }
+    rc->kNil = rc->kTrue = rc->kFalse = -1;
+
+    rc->depth = f->nargs + 1;
+    for (int i = 0; i < rc->depth; i++) rc->vs[i] = REG(i);
+    rc->lastDst = -1;
+    rc->hasPopped = false;
+    bool live = true;
+    int skip = -1;
+
+    for (int off = 0; rc->ok && off < src->code.size;
+         off += instr_len(&src->code.d[off])) {
+        u8* ip = &src->code.d[off];
+        int next = off + instr_len(ip);
+        u8* nip = next < src->code.size ? &src->code.d[next] : NULL;
+        bool nextIsLabel = nip && rc->flags[next] & LABEL;
+
+        if (depths[off] == -1 || off == skip) continue;
+        // The call a guard falls back to is emitted after the rest
+        if (*ip == OP_CALL && rc->flags[off] & FALLBACK) continue;
+
+        rc->line = chunk_get_instr_line(src, ip);
+        if (rc->flags[off] & LABEL) {
+            if (live) flush(rc);
+            rc->depth = depths[off];
+            for (int i = 0; i < rc->depth; i++) rc->vs[i] = REG(i);
+            rc->lastDst = -1;
+            live = true;
+        }
+        if (!live || rc->depth != depths[off]) {
+            rc->ok = false;
+            break;
+        }
+        rc->rpos[off] = rc->dst->code.size;
+        bool hadPopped = rc->hasPopped;
+        rc->hasPopped = false;
+
+        switch (*ip) {
+            case OP_NOP:
+                break;
+            case OP_DEF_GLOBAL: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, R_DEF_GLOBAL);
+                EMIT2(r, ip[1]);
+                break;
+            }
+            case OP_PUSH_GLOBAL:
+                emit_op(rc, R_GET_GLOBAL);
+                emit_dst(rc, rc->depth);
+                EMIT(ip[1]);
+                push(rc, REG(rc->depth));
+                break;
+            case OP_POP_GLOBAL: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, R_SET_GLOBAL);
+                EMIT2(r, ip[1]);
+                rc->popped = REG(r);
+                rc->hasPopped = true;
+                break;
+            }
+            case OP_PUSH_LOCAL:
+                push(rc, rc->vs[ip[1]]);
+                break;
+            case OP_POP_LOCAL:
+                store(rc, ip[1]);
+                break;
+            case OP_PUSH_STACK:
+                push(rc, rc->vs[rc->depth - ip[1]]);
+                break;
+            case OP_POP_STACK:
+                store(rc, rc->depth - 1 - ip[1]);
+                break;
+            case OP_PUSH_UPVALUE:
+                emit_op(rc, R_GET_UPVALUE);
+                emit_dst(rc, rc->depth);
+                EMIT(ip[1]);
+                push(rc, REG(rc->depth));
+                break;
+            case OP_POP_UPVALUE: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, R_SET_UPVALUE);
+                EMIT2(r, ip[1]);
+                rc->popped = REG(r);
+                rc->hasPopped = true;
+                break;
+            }
+            case OP_PUSH_CLOSURE:
+                flush(rc);
+                emit_op(rc, R_CLOSURE);
+                EMIT2(rc->depth, ip[1]);
+                push(rc, REG(rc->depth));
+                break;
+            case OP_PUSH_ARRAY: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, R_ARRAY);
+                emit_dst(rc, rc->depth);
+                EMIT(r);
+                push(rc, REG(rc->depth));
+                break;
+            }
+            case OP_PUSH_ARRAY_INIT:
+                flush(rc);
+                rc->depth -= ip[1];
+                emit_op(rc, R_ARRAY_INIT);
+                EMIT2(rc->depth, ip[1]);
+                push(rc, REG(rc->depth));
+                break;
+            case OP_PUSH_CONST:
+                push(rc, KONST(ip[1]));
+                break;
+            case OP_PUSH_NIL:
+                push(rc, KONST(konst(rc, NIL_VAL, &rc->kNil)));
+                break;
+            case OP_PUSH_TRUE:
+                push(rc, KONST(konst(rc, BOOL_VAL(true), &rc->kTrue)));
+                break;
+            case OP_PUSH_FALSE:
+                push(rc, KONST(konst(rc, BOOL_VAL(false), &rc->kFalse)));
+                break;
+            case OP_PUSH:
+                if (rc->flags[off] & LABEL) push(rc, REG(rc->depth));
+                else if (hadPopped) push(rc, rc->popped);
+                else rc->ok = false;
+                break;
+            case OP_POP: {
+                Operand o = pop(rc);
+                // and/or leave their result in the popped slot
+                if (nip && *nip == OP_PUSH && !SAME(o, REG(rc->depth))) {
+                    move(rc, rc->depth, o);
+                    o = REG(rc->depth);
+                }
+                close_popped(rc, rc->depth, 1);
+                rc->popped = o;
+                rc->hasPopped = true;
+                break;
+            }
+            case OP_POPN:
+                rc->depth -= ip[1];
+                close_popped(rc, rc->depth, ip[1]);
+                break;
+            case OP_GETATTR: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, R_GETATTR);
+                emit_dst(rc, rc->depth);
+                EMIT2(r, ip[1]);
+                push(rc, REG(rc->depth));
+                break;
+            }
+            case OP_SETATTR: {
+                Operand v = pop(rc);
+                int ro = in_reg(rc, pop(rc), rc->depth);
+                int rv = in_reg(rc, v, rc->depth + 1);
+                emit_op(rc, R_SETATTR);
+                EMIT(ro);
+                EMIT2(ip[1], rv);
+                push_result(rc, v.k ? v : REG(rv),
+                            nip && *nip == OP_POP && !nextIsLabel);
+                break;
+            }
+            case OP_GETITEM: {
+                Operand i = pop(rc);
+                int ra = in_reg(rc, pop(rc), rc->depth);
+                int ri = in_reg(rc, i, rc->depth + 1);
+                emit_op(rc, R_GETITEM);
+                emit_dst(rc, rc->depth);
+                EMIT2(ra, ri);
+                push(rc, REG(rc->depth));
+                break;
+            }
+            case OP_SETITEM: {
+                Operand v = pop(rc);
+                Operand i = pop(rc);
+                int ra = in_reg(rc, pop(rc), rc->depth);
+                int ri = in_reg(rc, i, rc->depth + 1);
+                int rv = in_reg(rc, v, rc->depth + 2);
+                emit_op(rc, R_SETITEM);
+                EMIT(ra);
+                EMIT2(ri, rv);
+                push_result(rc, v.k ? v : REG(rv),
+                            nip && *nip == OP_POP && !nextIsLabel);
+                break;
+            }
+            case OP_NEG:
+            case OP_NOT: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, *ip == OP_NEG ? R_NEG : R_NOT);
+                emit_dst(rc, rc->depth);
+                EMIT(r);
+                push(rc, REG(rc->depth));
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_TEQ:
+            case OP_TGT:
+            case OP_TLT: {
+                Operand c = pop(rc);
+                Operand b = pop(rc);
+                if (b.k && !c.k && (*ip == OP_MUL || *ip == OP_TEQ)) {
+                    Operand t = b;
+                    b = c;
+                    c = t;
+                }
+                int rb = in_reg(rc, b, rc->depth);
+                // Fuse a comparison with the branch consuming it, unless
+                // the branch target needs the result on the stack
+                if (rbranch[*ip] && nip && !nextIsLabel &&
+                    (*nip == OP_JMP_TRUE || *nip == OP_JMP_FALSE) &&
+                    src->code.d[next + instr_jmp_dest(nip)] != OP_PUSH) {
+                    flush(rc);
+                    emit_op(rc, rbranch[*ip] + c.k);
+                    EMIT2(*nip == OP_JMP_TRUE, rb);
+                    EMIT(c.n);
+                    emit_jmp_dest(rc, next + instr_jmp_dest(nip));
+                    skip = next;
+                    break;
+                }
+                emit_op(rc, rbinary[*ip] + c.k);
+                emit_dst(rc, rc->depth);
+                EMIT2(rb, c.n);
+                push(rc, REG(rc->depth));
+                break;
+            }
+            case OP_JMP:
+                flush(rc);
+                emit_op(rc, R_JMP);
+                emit_jmp_dest(rc, off + instr_jmp_dest(ip));
+                live = false;
+                break;
+            case OP_JMP_TRUE:
+            case OP_JMP_FALSE: {
+                int dest = off + instr_jmp_dest(ip);
+                Operand o = pop(rc);
+                if (src->code.d[dest] == OP_PUSH && !SAME(o, REG(rc->depth))) {
+                    move(rc, rc->depth, o);
+                    o = REG(rc->depth);
+                }
+                flush(rc);
+                int r = in_reg(rc, o, rc->depth);
+                emit_op(rc, *ip == OP_JMP_TRUE ? R_JMP_TRUE : R_JMP_FALSE);
+                EMIT(r);
+                emit_jmp_dest(rc, dest);
+                break;
+            }
+            case OP_CALL: {
+                int base = rc->depth - ip[1] - 1;
+                flush_from(rc, base);
+                emit_op(rc, R_CALL);
+                EMIT2(base, ip[1]);
+                rc->depth = base;
+                push(rc, REG(base));
+                break;
+            }
+            case OP_INLINE: {
+                int n = ip[4];
+                int base = rc->depth - n - 1;
+                flush(rc);
+                emit_op(rc, R_INLINE);
+                EMIT2(base, ip[3]);
+                Vec_push(rc->fallbacks,
+                         ((Fallback){rc->dst->code.size, base, n,
+                                     off + instr_jmp_dest(ip)}));
+                EMIT2(0, 0);
+                break;
+            }
+            case OP_INLINE_RET: {
+                int x = rc->depth - 1 - ip[1];
+                Operand o = pop(rc);
+                if (SAME(o, REG(rc->depth)) && rc->lastDst != -1 &&
+                    rc->dst->code.d[rc->lastDst] == rc->depth) {
+                    rc->dst->code.d[rc->lastDst] = x;
+                    rc->lastDst = -1;
+                } else {
+                    move(rc, x, o);
+                }
+                rc->depth = x;
+                push(rc, REG(x));
+                break;
+            }
+            case OP_RET: {
+                int r = in_reg(rc, pop(rc), rc->depth);
+                emit_op(rc, R_RET);
+                EMIT(r);
+                live = false;
+                break;
+            }
+            case OP_LAZY:
+                emit_op(rc, R_LAZY);
+                live = false;
+                break;
+            default:
+                rc->ok = false;
+        }
+    }
+
+    // The copies of inlined functions cover what they translated to
+    for (int i = 0; rc->ok && i < src->inlined.size; i++) {
+        Inlined in = src->inlined.d[i];
+        in.start = translated_pos(rc, in.start);
+        in.end = translated_pos(rc, in.end);
+        if (in.start < in.end) Vec_push_heap(rc->dst->inlined, in);
+    }
+
+    // Returning from a fallback call lands outside the inlined body, so
+    // that the caller's frame still shows the line of the call
+    for (int i = 0; rc->ok && i < rc->fallbacks.size; i++) {
+        Fallback fb = rc->fallbacks.d[i];
+        int off = rc->dst->code.size - (fb.at + 2);
+        rc->dst->code.d[fb.at] = off & 0xff;
+        rc->dst->code.d[fb.at + 1] = (off >> 8) & 0xff;
+        rc->line = chunk_get_instr_line(src, &src->code.d[fb.call]);
+        int start = rc->dst->code.size;
+        emit_op(rc, R_CALL);
+        EMIT2(fb.base, fb.nargs);
+        emit_op(rc, R_JMP);
+        emit_jmp_dest(rc, fb.call + 2);
+        // It is still part of any copy the guard was in
+        for (int j = 0; j < src->inlined.size; j++) {
+            Inlined in = src->inlined.d[j];
+            if (in.start > fb.call || fb.call >= in.end) continue;
+            in.start = start;
+            in.end = rc->dst->code.size;
+            Vec_push_heap(rc->dst->inlined, in);
+        }
+    }
+
+    for (int i = 0; rc->ok && i < rc->patches.size; i++) {
+        Patch p = rc->patches.d[i];
+        if (rc->rpos[p.dest] == -1) rc->ok = false;
+        int off = rc->rpos[p.dest] - (p.at + 2);
+        rc->dst->code.d[p.at] = off & 0xff;
+        rc->dst->code.d[p.at + 1] = (off >> 8) & 0xff;
+    }
+
+    free(depths);
+    free(rc->flags);
+    free(rc->rpos);
+    Vec_free(rc->patches);
+    Vec_free(rc->fallbacks);
+    return rc->ok;
+}
@@ -0,0 +1,11 @@
+#ifndef REGCODE_H
+#define REGCODE_H
+
+#include "object.h"
+#include "types.h"
+
+#define MAX_REGS 256
+
+bool regcode_translate(ObjFunction* f);
+
+#endif
@@ -1,45 +1,168 @@
 #include "scanner.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "types.h"
 
-struct {
-    char* start;
-    char* cur;
-    int line;
-} scanner;
+// The runs of whitespace, identifier and number characters, and the
+// bodies of comments and strings are skipped a block of bytes at a time
+// with SSE2, or AVX2 when compiling for it. Define SCALAR_SCANNER to go
+// byte by byte instead.
+#if defined(__SSE2__) && !defined(SCALAR_SCANNER)
+#define SIMD_SCANNER
+#endif
 
-void init_scanner(char* source) {
-    scanner.start = scanner.cur = source;
-    scanner.line = 1;
+enum {
+    STOP_NONSPACE, // anything but ' ', '\t' and '\n'
+    STOP_NONIDENT, // anything but letters, digits and '_'
+    STOP_NONDIGIT,
+    STOP_EOL,    // '\n' or the end
+    STOP_STAR,   // '*' or the end
+    STOP_STRING, // '"', '\\', '\n' or the end
+};
+
+static inline bool stops(char c, int stop) {
+    switch (stop) {
+        case STOP_NONSPACE:
+            return c != ' ' && c != '\t' && c != '\n';
+        case STOP_NONIDENT:
+            return !isalnum(c) && c != '_';
+        case STOP_NONDIGIT:
+            return !isdigit(c);
+        case STOP_EOL:
+            return c == '\n' || !c;
+        case STOP_STAR:
+            return c == '*' || !c;
+        default:
+            return c == '"' || c == '\\' || c == '\n' || !c;
+    }
+}
+
+#ifdef SIMD_SCANNER
+
+#ifdef __AVX2__
+#include <immintrin.h>
+typedef __m256i Block;
+#define BLOCK_SIZE 32
+#define LOAD(p) _mm256_load_si256((Block*) (p))
+#define SPLAT(c) _mm256_set1_epi8(c)
+#define EQ(a, b) _mm256_cmpeq_epi8(a, b)
+#define GT(a, b) _mm256_cmpgt_epi8(a, b)
+#define OR(a, b) _mm256_or_si256(a, b)
+#define AND(a, b) _mm256_and_si256(a, b)
+#define MASK(v) ((u32) _mm256_movemask_epi8(v))
+#else
+#include <emmintrin.h>
+typedef __m128i Block;
+#define BLOCK_SIZE 16
+#define LOAD(p) _mm_load_si128((Block*) (p))
+#define SPLAT(c) _mm_set1_epi8(c)
+#define EQ(a, b) _mm_cmpeq_epi8(a, b)
+#define GT(a, b) _mm_cmpgt_epi8(a, b)
+#define OR(a, b) _mm_or_si128(a, b)
+#define AND(a, b) _mm_and_si128(a, b)
+#define MASK(v) ((u32) _mm_movemask_epi8(v))
+#endif
+
+#define ALL_BYTES ((u32) ((1ull << BLOCK_SIZE) - 1))
+// Bytes from lo to hi, comparing as signed so that none above 0x7f match
+#define IN_RANGE(v, lo, hi) AND(GT(v, SPLAT((lo) - 1)), GT(SPLAT((hi) + 1), v))
+#define IS(v, c) EQ(v, SPLAT(c))
+
+// Most runs in code are short, so the first few bytes are looked at one
+// by one before going over whole blocks
+#define SCALAR_PREFIX 8
+
+static inline u32 stop_mask(Block v, int stop) {
+    switch (stop) {
+        case STOP_NONSPACE:
+            return ~MASK(OR(OR(IS(v, ' '), IS(v, '\t')), IS(v, '\n')));
+        case STOP_NONIDENT:
+            return ~MASK(OR(OR(IN_RANGE(OR(v, SPLAT(0x20)), 'a', 'z'),
+                               IN_RANGE(v, '0', '9')),
+                            IS(v, '_')));
+        case STOP_NONDIGIT:
+            return ~MASK(IN_RANGE(v, '0', '9'));
+        case STOP_EOL:
+            return MASK(OR(IS(v, '\n'), IS(v, '\0')));
+        case STOP_STAR:
+            return MASK(OR(IS(v, '*'), IS(v, '\0')));
+        default:
+            return MASK(OR(OR(IS(v, '"'), IS(v, '\\')),
+                           OR(IS(v, '\n'), IS(v, '\0'))));
+    }
 }
 
-Token make_token(TokenType type) {
+// Finds the first byte from p on that stops the scan, adding the newlines
+// before it to *line if line is given. Every stop set includes the
+// terminating '\0'. Loads are of aligned blocks, which never cross into a
+// page the source doesn't reach but do read around it, so this is kept
+// out of sight of the address sanitizer.
+__attribute__((no_sanitize_address)) static inline char*
+scan_to(char* p, int stop, int* line) {
+    for (int i = 0; i < SCALAR_PREFIX; i++, p++) {
+        if (stops(*p, stop)) return p;
+        if (line && *p == '\n') (*line)++;
+    }
+    char* b = p - (uintptr_t) p % BLOCK_SIZE;
+    u32 valid = ALL_BYTES << (p - b) & ALL_BYTES;
+    while (true) {
+        Block v = LOAD(b);
+        u32 m = stop_mask(v, stop) & valid;
+        if (line) {
+            u32 nl = MASK(IS(v, '\n')) & valid;
+            if (m) nl &= (m & -m) - 1;
+            *line += __builtin_popcount(nl);
+        }
+        if (m) return b + __builtin_ctz(m);
+        b += BLOCK_SIZE;
+        valid = ALL_BYTES;
+    }
+}
+
+#else
+
+static inline char* scan_to(char* p, int stop, int* line) {
+    for (; !stops(*p, stop); p++) {
+        if (line && *p == '\n') (*line)++;
+    }
+    return p;
+}
+
+#endif
+
+void init_scanner(Scanner* scanner, char* source) {
+    scanner->start = scanner->cur = source;
+    scanner->line = 1;
+}
+
+Token make_token(Scanner* scanner, TokenType type) {
     Token t;
-    t.start = scanner.start;
-    t.len = scanner.cur - scanner.start;
+    t.start = scanner->start;
+    t.len = scanner->cur - scanner->start;
     t.type = type;
-    t.line = scanner.line;
+    t.line = scanner->line;
     return t;
 }
 
-Token error_token(char* message) {
+Token error_token(Scanner* scanner, char* message) {
     Token t;
     t.start = message;
     t.type = TOKEN_ERROR;
-    t.line = scanner.line;
+    t.line = scanner->line;
     return t;
 }
 
 #define __KWD(kw, type)                                                        \
-    return p + sizeof kw - 1 == scanner.cur && !strncmp(p, kw, sizeof kw - 1)  \
+    return p + sizeof kw - 1 == scanner->cur &&                                \
+                   !strncmp(p, kw, sizeof kw - 1)                              \
                ? type                                                          \
                : TOKEN_IDENTIFIER
 
-TokenType identifierType() {
-    char* p = scanner.start;
+TokenType identifierType(Scanner* scanner) {
+    char* p = scanner->start;
     switch (*p++) {
         case 'a':
             switch (*p++) {
@@ -113,157 +236,150 @@ TokenType identifierType() {
     return TOKEN_IDENTIFIER;
 }
 
-Token next_token() {
-    scanner.start = scanner.cur;
+Token next_token(Scanner* scanner) {
+    scanner->cur = scan_to(scanner->cur, STOP_NONSPACE, &scanner->line);
+    scanner->start = scanner->cur;
 
-    char c = *scanner.cur++;
+    char c = *scanner->cur++;
 
     if (isdigit(c)) {
-        bool saw_dot = false;
-        while (isdigit(*scanner.cur) || (!saw_dot && *scanner.cur == '.')) {
-            if (*scanner.cur == '.') saw_dot = true;
-            scanner.cur++;
+        scanner->cur = scan_to(scanner->cur, STOP_NONDIGIT, NULL);
+        if (*scanner->cur == '.') {
+            scanner->cur = scan_to(scanner->cur + 1, STOP_NONDIGIT, NULL);
         }
-        return make_token(TOKEN_NUMBER);
+        return make_token(scanner, TOKEN_NUMBER);
     }
 
     if (isalpha(c) || c == '_') {
-        while (isalnum(*scanner.cur) || *scanner.cur == '_') {
-            scanner.cur++;
-        }
-
-        return make_token(identifierType());
+        scanner->cur = scan_to(scanner->cur, STOP_NONIDENT, NULL);
+        return make_token(scanner, identifierType(scanner));
     }
 
     switch (c) {
         case '\0':
-            scanner.cur--;
-            return make_token(TOKEN_EOF);
-        case '\n':
-            scanner.line++;
-            return next_token();
-        case ' ':
-        case '\t':
-            return next_token();
+            scanner->cur--;
+            return make_token(scanner, TOKEN_EOF);
         case '(':
-            return make_token(TOKEN_LEFT_PAREN);
+            return make_token(scanner, TOKEN_LEFT_PAREN);
         case ')':
-            return make_token(TOKEN_RIGHT_PAREN);
+            return make_token(scanner, TOKEN_RIGHT_PAREN);
         case '[':
-            return make_token(TOKEN_LEFT_SQUARE);
+            return make_token(scanner, TOKEN_LEFT_SQUARE);
         case ']':
-            return make_token(TOKEN_RIGHT_SQUARE);
+            return make_token(scanner, TOKEN_RIGHT_SQUARE);
         case '{':
-            return make_token(TOKEN_LEFT_CURLY);
+            return make_token(scanner, TOKEN_LEFT_CURLY);
         case '}':
-            return make_token(TOKEN_RIGHT_CURLY);
+            return make_token(scanner, TOKEN_RIGHT_CURLY);
         case ';':
-            return make_token(TOKEN_SEMICOLON);
+            return make_token(scanner, TOKEN_SEMICOLON);
         case ',':
-            return make_token(TOKEN_COMMA);
+            return make_token(scanner, TOKEN_COMMA);
         case '.':
-            return make_token(TOKEN_DOT);
+            return make_token(scanner, TOKEN_DOT);
         case '%':
-            return make_token(TOKEN_PERCENT);
+            return make_token(scanner, TOKEN_PERCENT);
         case '?':
-            return make_token(TOKEN_QUESTION);
+            return make_token(scanner, TOKEN_QUESTION);
         case ':':
-            return make_token(TOKEN_COLON);
+            return make_token(scanner, TOKEN_COLON);
         case '+':
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_PLUS_EQUAL);
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_PLUS_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_PLUS);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_PLUS);
         case '*':
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_STAR_EQUAL);
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_STAR_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_STAR);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_STAR);
         case '-':
-            if (*scanner.cur++ == '>') {
-                return make_token(TOKEN_ARROW);
+            if (*scanner->cur++ == '>') {
+                return make_token(scanner, TOKEN_ARROW);
             }
-            scanner.cur--;
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_MINUS_EQUAL);
+            scanner->cur--;
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_MINUS_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_MINUS);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_MINUS);
         case '!':
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_NOT_EQUAL);
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_NOT_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_NOT);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_NOT);
         case '=':
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_EQUAL_EQUAL);
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_EQUAL_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_EQUAL);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_EQUAL);
         case '<':
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_LESS_EQUAL);
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_LESS_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_LESS);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_LESS);
         case '>':
-            if (*scanner.cur++ == '=') {
-                return make_token(TOKEN_GREATER_EQUAL);
+            if (*scanner->cur++ == '=') {
+                return make_token(scanner, TOKEN_GREATER_EQUAL);
             }
-            scanner.cur--;
-            return make_token(TOKEN_GREATER);
+            scanner->cur--;
+            return make_token(scanner, TOKEN_GREATER);
         case '/':
-            switch (*scanner.cur++) {
+            switch (*scanner->cur++) {
                 case '=':
-                    return make_token(TOKEN_SLASH_EQUAL);
+                    return make_token(scanner, TOKEN_SLASH_EQUAL);
                 case '/':
-                    while (*scanner.cur && *scanner.cur != '\n') {
-                        scanner.cur++;
-                    }
-                    return next_token();
+                    scanner->cur = scan_to(scanner->cur, STOP_EOL, NULL);
+                    return next_token(scanner);
                 case '*':
-                    while (*scanner.cur) {
-                        if (*scanner.cur == '*' && scanner.cur[1] == '/') {
-                            scanner.cur += 2;
-                            return next_token();
-                        } else if (*scanner.cur == '\n') scanner.line++;
-                        scanner.cur++;
+                    while (true) {
+                        scanner->cur =
+                            scan_to(scanner->cur, STOP_STAR, &scanner->line);
+                        if (!*scanner->cur) {
+                            return error_token(scanner,
+                                               "Unterminated block comment.");
+                        }
+                        if (*++scanner->cur == '/') {
+                            scanner->cur++;
+                            return next_token(scanner);
+                        }
                     }
-                    return error_token("Unterminated block comment.");
                 default:
-                    scanner.cur--;
-                    return make_token(TOKEN_SLASH);
+                    scanner->cur--;
+                    return make_token(scanner, TOKEN_SLASH);
             }
         case '#':
-            scanner.cur++;
-            while (*scanner.cur && *scanner.cur != '\n') {
-                scanner.cur++;
-            }
-            return next_token();
+            scanner->cur = scan_to(scanner->cur + 1, STOP_EOL, NULL);
+            return next_token(scanner);
         case '"':
-            while (*scanner.cur != '"') {
-                if (*scanner.cur == '\n' || *scanner.cur == '\0')
-                    return error_token("Unterminated string.");
-                if (*scanner.cur == '\\') {
-                    scanner.cur++;
-                    if (*scanner.cur == '\0')
-                        return error_token("Unterminated string.");
-                }
-                scanner.cur++;
+            while (true) {
+                scanner->cur = scan_to(scanner->cur, STOP_STRING, NULL);
+                if (*scanner->cur == '"') break;
+                if (*scanner->cur == '\n' || *scanner->cur == '\0')
+                    return error_token(scanner, "Unterminated string.");
+                // Skip the backslash and whatever it escapes
+                scanner->cur++;
+                if (*scanner->cur == '\0')
+                    return error_token(scanner, "Unterminated string.");
+                scanner->cur++;
             }
-            scanner.cur++;
-            return make_token(TOKEN_STRING);
+            scanner->cur++;
+            return make_token(scanner, TOKEN_STRING);
         case '\'':
-            if (*scanner.cur == '\\') scanner.cur++;
-            if (*scanner.cur == '\0') return error_token("Unterminated char");
-            scanner.cur++;
-            if (*scanner.cur != '\'') return error_token("Unterminated char");
-            scanner.cur++;
-            return make_token(TOKEN_CHAR);
+            if (*scanner->cur == '\\') scanner->cur++;
+            if (*scanner->cur == '\0')
+                return error_token(scanner, "Unterminated char");
+            scanner->cur++;
+            if (*scanner->cur != '\'')
+                return error_token(scanner, "Unterminated char");
+            scanner->cur++;
+            return make_token(scanner, TOKEN_CHAR);
         default:
-            return error_token("Lexer error.");
+            return error_token(scanner, "Lexer error.");
     }
 }
\ No newline at end of file
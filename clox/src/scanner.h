@@ -75,8 +75,14 @@ typedef struct {
     int line;
 } Token;
 
-void init_scanner(char* source);
+typedef struct {
+    char* start;
+    char* cur;
+    int line;
+} Scanner;
+
+void init_scanner(Scanner* scanner, char* source);
 
-Token next_token();
+Token next_token(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,252 @@
+#include "serve.h"
+
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "module.h"
+#include "table.h"
+#include "vm.h"
+
+// Both modes run many jobs in a VM that has its modules loaded already.
+// Compiled modules stay cached between jobs, but every job starts from the
+// globals the VM started with. Only the bindings are put back: a job that
+// changes an array or instance a base global holds changes it for the jobs
+// after it. Modules given at the start are compiled but not run, so their
+// globals are defined by the jobs that call them.
+//
+// With --serve each connection carries one job. The client sends the
+// script source and shuts down its side, then gets back everything the
+// script printed to stdout and stderr followed by a single byte holding
+// the exit status clox would have returned for it.
+//
+// With --pool the job is the path of a script, one per line on stdin, and
+// forked workers take them in turn from a queue.
+//
+// A job can load any module and dump the heap anywhere the server can
+// write, so either mode is only for scripts that are trusted. A time limit
+// at least keeps one that never ends from holding up the rest.
+
+static int job_exitcode;
+static struct timeval time_limit;
+
+// exit() ends the job, not the server
+static int serve_exit(int argc, Value* argv) {
+    if (argc > 0 && IS_NUMBER(argv[1])) job_exitcode = AS_NUMBER(argv[1]);
+    else job_exitcode = 0;
+    return HALTED;
+}
+
+void job_time_limit(double seconds) {
+    time_limit.tv_sec = seconds;
+    time_limit.tv_usec = (seconds - time_limit.tv_sec) * 1e6;
+}
+
+static void on_time_up(int sig) {
+    vm_time_up = 1;
+    vm_interrupt = 1;
+}
+
+static void start_timer() {
+    setitimer(ITIMER_REAL, &(struct itimerval){{0, 0}, time_limit}, NULL);
+}
+
+static void stop_timer() {
+    setitimer(ITIMER_REAL, &(struct itimerval){0}, NULL);
+    vm_time_up = 0;
+}
+
+static void start_jobs(char** modules, int nmodules) {
+    module_preload(modules, nmodules);
+    for (int i = 0; i < nmodules; i++) {
+        if (!module_load(modules[i], false)) {
+            eprintf("Could not load module '%s'.\n", modules[i]);
+        }
+    }
+
+    table_set(&vm.globals, CREATE_STRING_LITERAL("exit"),
+              BUILTIN_VAL(serve_exit));
+    table_add_all(&vm.base_globals, &vm.globals);
+
+    struct sigaction sa = {.sa_handler = on_time_up, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+}
+
+// Whatever the job defined is left to the GC. The base globals are roots
+// of their own, so what they held stays alive while a job rebinds them.
+static void end_job() {
+    table_free(&vm.globals);
+    table_init(&vm.globals);
+    table_add_all(&vm.globals, &vm.base_globals);
+}
+
+static char* read_request(int fd) {
+    Vector(char) buf;
+    Vec_init(buf);
+    char chunk[4096];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof chunk)) > 0) {
+        for (int i = 0; i < n; i++) Vec_push(buf, chunk[i]);
+    }
+    Vec_push(buf, '\0');
+    if (n < 0) {
+        Vec_free(buf);
+        return NULL;
+    }
+    return buf.d;
+}
+
+static void run_job(int fd) {
+    char* source = read_request(fd);
+    if (!source) return;
+
+    fflush(stdout);
+    fflush(stderr);
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+
+    module_preload_script(source);
+    start_timer();
+    int code = interpret(source);
+    stop_timer();
+    if (code == HALTED) code = job_exitcode;
+    free(source);
+
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+
+    u8 status = code;
+    (void) !write(fd, &status, 1);
+    end_job();
+}
+
+int serve(char* sock_path, char** modules, int nmodules) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(sock_path) >= sizeof addr.sun_path) {
+        eprintf("Socket path too long '%s'.\n", sock_path);
+        return NO_FILE;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return NO_FILE;
+    // Only a socket left behind by an earlier server is replaced
+    struct stat st;
+    if (!lstat(sock_path, &st) && S_ISSOCK(st.st_mode)) unlink(sock_path);
+    if (bind(sock, (struct sockaddr*) &addr, sizeof addr) ||
+        listen(sock, 64)) {
+        close(sock);
+        return NO_FILE;
+    }
+    // A client going away mid reply must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    start_jobs(modules, nmodules);
+    while (true) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) continue;
+        run_job(fd);
+        close(fd);
+    }
+}
+
+// Scripts are compiled through the module registry, so a worker compiles
+// each one once, and not at all if it was preloaded before the fork
+static int run_path(char* path) {
+    ObjFunction* f = module_load(path, false);
+    if (!f) {
+        eprintf("Could not run '%s'.\n", path);
+        return COMPILE_ERROR;
+    }
+    start_timer();
+    int code = interpret_function(f);
+    stop_timer();
+    if (code == HALTED) code = job_exitcode;
+    fflush(stdout);
+    end_job();
+    return code;
+}
+
+static int run_worker(int queue) {
+    int exitcode = OK;
+    char path[PATH_MAX + 1];
+    ssize_t n;
+    while ((n = recv(queue, path, PATH_MAX, 0)) > 0) {
+        path[n] = '\0';
+        int code = run_path(path);
+        if (!exitcode) exitcode = code;
+    }
+    return exitcode;
+}
+
+int pool(int nworkers, char** modules, int nmodules) {
+    // Each path is a message of its own, which only one worker receives
+    int queue[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, queue)) {
+        perror("clox");
+        return NO_FILE;
+    }
+
+    start_jobs(modules, nmodules);
+    heap_freeze();
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t* workers = malloc(nworkers * sizeof *workers);
+    int started = 0;
+    for (int i = 0; i < nworkers; i++) {
+        workers[i] = fork();
+        started += workers[i] > 0;
+        if (workers[i] == 0) {
+            close(queue[0]);
+            int code = run_worker(queue[1]);
+            fflush(stdout);
+            fflush(stderr);
+            // Freeing the VM would only copy the shared pages
+            _exit(code);
+        }
+    }
+    close(queue[1]);
+    if (!started) {
+        perror("clox");
+        close(queue[0]);
+        free(workers);
+        return NO_FILE;
+    }
+
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, stdin)) > 0) {
+        if (line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0 || len > PATH_MAX) continue;
+        if (send(queue[0], line, len, 0) < 0) break;
+    }
+    free(line);
+    close(queue[0]);
+
+    int exitcode = OK;
+    for (int i = 0; i < nworkers; i++) {
+        int status;
+        if (workers[i] < 0 || waitpid(workers[i], &status, 0) < 0) continue;
+        if (!exitcode && WIFEXITED(status)) exitcode = WEXITSTATUS(status);
+    }
+    free(workers);
+    return exitcode;
+}
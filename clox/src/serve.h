@@ -0,0 +1,17 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+// Runs scripts sent over a Unix socket in the current VM, after preloading
+// the given modules. Only returns on failure to set up the socket.
+int serve(char* sock_path, char** modules, int nmodules);
+
+// Forks workers sharing the current VM and its modules, and runs the
+// scripts named on stdin in them. Returns the first nonzero exit status.
+int pool(int nworkers, char** modules, int nmodules);
+
+// Stops each job of either mode with a runtime error once it has run for
+// that many seconds, unless 0. Without one a job that never ends holds up
+// the server or its worker for good.
+void job_time_limit(double seconds);
+
+#endif
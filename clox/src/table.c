@@ -12,7 +12,7 @@ void table_init(Table* t) {
 }
 
 void table_free(Table* t) {
-    free(t->ents);
+    FREE_ARRAY(t->ents, t->cap);
 }
 
 Entry* find_entry(Table* t, ObjString* key) {
@@ -35,7 +35,8 @@ Entry* find_entry(Table* t, ObjString* key) {
 static void resize(Table* t, size_t newcap) {
     size_t oldcap = t->cap;
     Entry* oldents = t->ents;
-    t->ents = calloc(newcap, sizeof(Entry));
+    t->ents = ALLOCATE(Entry, newcap);
+    memset(t->ents, 0, newcap * sizeof(Entry));
     t->cap = newcap;
     t->size = 0;
     t->occ = 0;
@@ -44,7 +45,7 @@ static void resize(Table* t, size_t newcap) {
             table_set(t, oldents[i].key, oldents[i].value);
         }
     }
-    free(oldents);
+    FREE_ARRAY(oldents, oldcap);
 }
 
 bool table_set(Table* t, ObjString* key, Value val) {
@@ -80,6 +81,11 @@ bool table_get(Table* t, ObjString* key, Value* val) {
     }
 }
 
+Value* table_lookup(Table* t, ObjString* key) {
+    Entry* e = find_entry(t, key);
+    return e && e->key ? &e->value : NULL;
+}
+
 bool table_delete(Table* t, ObjString* key) {
     Entry* e = find_entry(t, key);
     if (!e || !e->key) return false;
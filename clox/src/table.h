@@ -28,6 +28,8 @@ void table_free(Table* t);
 
 bool table_set(Table* t, ObjString* key, Value val);
 bool table_get(Table* t, ObjString* key, Value* val);
+// Where the value of key is kept, or NULL, until the table changes
+Value* table_lookup(Table* t, ObjString* key);
 bool table_delete(Table* t, ObjString* key);
 
 ObjString* table_find_string(Table* t, ObjString* key);
@@ -0,0 +1,113 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "intern.h"
+#include "vm.h"
+
+#define TRACE_EVENTS (1 << 18)
+
+bool tracing;
+
+typedef enum { EV_FUNCTION, EV_BUILTIN, EV_GC } EventKind;
+
+typedef struct {
+    u64 ts, dur;
+    EventKind kind;
+    int name;             // in names, for calls
+    size_t before, after; // heap bytes, for collections
+} Event;
+
+static char* out_path;
+static u64 min_dur, t0;
+static Event* ring;
+static size_t nevents; // ever recorded, the latest TRACE_EVENTS are kept
+static u64 starts[MAX_CALLS + 1];
+static Interner names;
+
+static Event* new_event(EventKind kind, u64 start, u64 end) {
+    Event* e = &ring[nevents++ % TRACE_EVENTS];
+    e->ts = start;
+    e->dur = end - start;
+    e->kind = kind;
+    return e;
+}
+
+void trace_call(int depth) {
+    starts[depth] = trace_clock();
+}
+
+void trace_ret(ObjFunction* f, int depth) {
+    u64 end = trace_clock();
+    if (end - starts[depth] < min_dur) return;
+    Event* e = new_event(EV_FUNCTION, starts[depth], end);
+    e->name = f->name ? intern(&names, f->name->data, f->name->len)
+                      : intern(&names, "<anonymous fn>", 14);
+}
+
+// Builtins are only named by the global they were added as
+static int builtin_name(BuiltinFn* fn) {
+    for (int i = 0; i < vm.globals.cap; i++) {
+        Entry* ent = &vm.globals.ents[i];
+        if (ent->key && ent->value.type == VT_BUILTIN &&
+            ent->value.builtin == fn) {
+            return intern(&names, ent->key->data, ent->key->len);
+        }
+    }
+    return intern(&names, "<builtin>", 9);
+}
+
+void trace_builtin(BuiltinFn* fn, u64 start) {
+    u64 end = trace_clock();
+    if (end - start < min_dur) return;
+    new_event(EV_BUILTIN, start, end)->name = builtin_name(fn);
+}
+
+void trace_gc(u64 start, size_t bytes_before, size_t bytes_after) {
+    u64 end = trace_clock();
+    if (end - start < min_dur) return;
+    Event* e = new_event(EV_GC, start, end);
+    e->before = bytes_before;
+    e->after = bytes_after;
+}
+
+static void write_trace() {
+    tracing = false;
+    FILE* fp = fopen(out_path, "w");
+    if (!fp) {
+        eprintf("Could not write '%s'.\n", out_path);
+        return;
+    }
+    size_t first = nevents > TRACE_EVENTS ? nevents - TRACE_EVENTS : 0;
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for (size_t i = first; i < nevents; i++) {
+        Event* e = &ring[i % TRACE_EVENTS];
+        fprintf(fp, "%s{\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,"
+                    "\"dur\":%.3f,",
+                i > first ? ",\n" : "", (e->ts - t0) / 1e3, e->dur / 1e3);
+        if (e->kind == EV_GC) {
+            fprintf(fp, "\"name\":\"gc\",\"cat\":\"gc\",\"args\":"
+                        "{\"bytes_before\":%zu,\"bytes_after\":%zu}}",
+                    e->before, e->after);
+        } else {
+            fprintf(fp, "\"name\":\"%.*s\",\"cat\":\"%s\"}",
+                    interned_len(&names, e->name), interned(&names, e->name),
+                    e->kind == EV_BUILTIN ? "builtin" : "function");
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":"
+                "{\"dropped_events\":%zu}}\n",
+            first);
+    fclose(fp);
+    free(ring);
+}
+
+void trace_start(char* path, u64 min_ns) {
+    out_path = path;
+    min_dur = min_ns;
+    ring = malloc(TRACE_EVENTS * sizeof *ring);
+    t0 = trace_clock();
+    tracing = true;
+    atexit(write_trace);
+}
@@ -0,0 +1,29 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <time.h>
+
+#include "object.h"
+#include "types.h"
+#include "value.h"
+
+extern bool tracing;
+
+static inline u64 trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Records every Lox function call, builtin call and collection lasting at
+// least min_ns into a ring buffer holding the latest TRACE_EVENTS, and
+// writes them to path at exit as Chrome trace events
+void trace_start(char* path, u64 min_ns);
+// A function starts running at this depth in the call stack
+void trace_call(int depth);
+// f returns from this depth
+void trace_ret(ObjFunction* f, int depth);
+void trace_builtin(BuiltinFn* fn, u64 start);
+void trace_gc(u64 start, size_t bytes_before, size_t bytes_after);
+
+#endif
@@ -7,10 +7,14 @@
 #include "object.h"
 
 bool value_equal(Value a, Value b) {
-    if (a.type != b.type) return false;
+    if (a.type != b.type) {
+        return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+    }
     switch (a.type) {
         case VT_NUMBER:
             return a.num == b.num;
+        case VT_INT:
+            return a.i == b.i;
         case VT_BOOL:
             return a.b == b.b;
         case VT_NIL:
@@ -33,6 +37,9 @@ void fprint_value(FILE* file, Value v, bool debug) {
             if (v.num == (int) v.num) printf("%d", (int) v.num);
             else printf("%f", v.num);
             break;
+        case VT_INT:
+            printf("%d", (int) v.i);
+            break;
         case VT_NIL:
             printf("nil");
             break;
@@ -62,6 +69,11 @@ ObjString* string_value(Value v) {
             return create_string(buf, strlen(buf));
             break;
         }
+        case VT_INT: {
+            char buf[20];
+            snprintf(buf, 20, "%d", (int) v.i);
+            return create_string(buf, strlen(buf));
+        }
         case VT_NIL:
             return CREATE_STRING_LITERAL("nil");
             break;
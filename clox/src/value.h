@@ -9,6 +9,7 @@ typedef enum {
     VT_BOOL,
     VT_NIL,
     VT_NUMBER,
+    VT_INT,
     VT_CHAR,
     VT_OBJ,
     VT_BUILTIN,
@@ -18,12 +19,17 @@ typedef struct _Value Value;
 typedef struct _Obj Obj;
 typedef struct _ObjString ObjString;
 
+// Status of running code, which builtins also return. A builtin returns
+// HALTED to stop the script without an error.
+enum { OK, NO_FILE, COMPILE_ERROR, RUNTIME_ERROR, HALTED };
+
 typedef int (BuiltinFn)(int argc, Value* argv);
 
 typedef struct _Value {
     ValueType type;
     union {
         double num;
+        i64 i;
         bool b;
         char c;
         Obj* obj;
@@ -32,12 +38,39 @@ typedef struct _Value {
 } Value;
 
 #define NUMBER_VAL(d) ((Value){.type = VT_NUMBER, {.num = d}})
+#define INT_VAL(n) ((Value){.type = VT_INT, {.i = n}})
 #define NIL_VAL ((Value){.type = VT_NIL})
 #define BOOL_VAL(_b) ((Value){.type = VT_BOOL, {.b = _b}})
 #define CHAR_VAL(_c) ((Value){.type = VT_CHAR, {.c = _c}})
 #define OBJ_VAL(o) ((Value){.type = VT_OBJ, {.obj = (Obj*) o}})
 #define BUILTIN_VAL(_b) ((Value){.type = VT_BUILTIN, {.builtin = _b}})
 
+// Integers are an internal representation of numbers that fit in 32 bits.
+// They are stored at full width so that the whole payload is written, as
+// with a double, and later 16 byte copies of the value are not stalled.
+#define IS_NUMBER(v) ((v).type == VT_NUMBER || (v).type == VT_INT)
+#define AS_NUMBER(v) ((v).type == VT_INT ? (double) (v).i : (v).num)
+
+// Integer fast paths for arithmetic. They fail whenever the result would
+// differ from the double one (overflow, or a double result of -0).
+static inline bool int_add(i32 a, i32 b, i32* r) {
+    return !__builtin_add_overflow(a, b, r);
+}
+
+static inline bool int_sub(i32 a, i32 b, i32* r) {
+    return !__builtin_sub_overflow(a, b, r);
+}
+
+static inline bool int_mul(i32 a, i32 b, i32* r) {
+    return !__builtin_mul_overflow(a, b, r) && (*r || (a >= 0 && b >= 0));
+}
+
+static inline bool int_mod(i32 a, i32 b, i32* r) {
+    if (b == 0 || b == -1) return false;
+    *r = a % b;
+    return *r || a >= 0;
+}
+
 bool value_equal(Value a, Value b);
 void fprint_value(FILE* file, Value v, bool debug);
 #define print_value(v) fprint_value(stdout, v, false)
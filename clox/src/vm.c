@@ -10,17 +10,37 @@
 #include "builtins.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "debugger.h"
+#include "heapdump.h"
+#include "opstats.h"
+#include "profile.h"
+#include "trace.h"
 
-VM vm;
+_Thread_local VM* cur_vm;
 
-void VM_init() {
+volatile sig_atomic_t vm_interrupt;
+volatile sig_atomic_t vm_time_up;
+
+VM* VM_init() {
+    VM_enter(calloc(1, sizeof(VM)));
     vm.alloc_bytes = 0;
     vm.alloc_objs = 0;
     vm.gc_on = false;
-    vm.gc_threshold = 1024;
+    vm.gc_threshold = GC_MIN_HEAP;
+    vm.gc_growth = GC_GROWTH;
+    vm.gc_min_heap = GC_MIN_HEAP;
+    vm.max_heap = 0;
+    vm.heap_exceeded = false;
+    vm.interrupt = false;
+
+    Vec_init(vm.frozen);
+    vm.frozen_marks = NULL;
 
     table_init(&vm.strings);
     table_init(&vm.globals);
+    table_init(&vm.base_globals);
+    Vec_init(vm.modules);
+    Vec_init(vm.api_stack);
     vm.open_upvalues = NULL;
 
     ADD_BUILTIN(clock);
@@ -33,35 +53,135 @@ void VM_init() {
     ADD_BUILTIN(exit);
 
     ADD_BUILTIN(loadModule);
+    ADD_BUILTIN(reloadModule);
+
+    ADD_BUILTIN(dumpHeap);
+    return cur_vm;
 }
 
-void VM_free() {
+void VM_free(VM* v) {
+    VM_enter(v);
     free_all_obj();
     table_free(&vm.strings);
     table_free(&vm.globals);
+    table_free(&vm.base_globals);
+    Vec_free_heap(vm.modules);
+    Vec_free_heap(vm.api_stack);
+    free(v);
+    cur_vm = NULL;
+}
+
+void VM_enter(VM* v) {
+    cur_vm = v;
+}
+
+static Chunk* frame_chunk(ObjFunction* f) {
+    return vm.regvm ? &f->rchunk : &f->chunk;
+}
+
+static char* func_name(ObjFunction* f) {
+    return f->name ? f->name->data : "<anonymous fn>";
+}
+
+// Names the calls inlined where frame p is at, innermost first
+static void inlined_backtrace(CallFrame* p, u8* pc) {
+    Chunk* c = frame_chunk(p->func);
+    Inlined* in[MAX_INLINED];
+    for (int i = chunk_inlined_at(c, pc, in) - 1; i >= 0; i--) {
+        eprintf("    from call of %s at line %d\n",
+                func_name((ObjFunction*) c->constants.d[in[i]->f].obj),
+                in[i]->line);
+    }
 }
 
 void runtime_error(char* message, ...) {
     CallFrame f = *vm.csp;
     eprintf("Runtime error at line %d: ",
-            chunk_get_instr_line(&f.func->chunk, f.ip - 1));
+            chunk_get_instr_line(frame_chunk(f.func), f.ip - 1));
     va_list l;
     va_start(l, message);
     vfprintf(stderr, message, l);
     va_end(l);
     eprintf("\n");
-    for (CallFrame* p = vm.csp; p > vm.call_stack; p--) {
-        eprintf("    from call of %s at line %d\n",
-                p[0].func->name ? p[0].func->name->data : "<anonymous fn>",
-                chunk_get_instr_line(&p[-1].func->chunk, p[-1].ip - 1));
+    for (CallFrame* p = vm.csp; p >= vm.call_stack; p--) {
+        inlined_backtrace(p, p->ip - 1);
+        if (p == vm.call_stack) break;
+        eprintf("    from call of %s at line %d\n", func_name(p[0].func),
+                chunk_get_instr_line(frame_chunk(p[-1].func), p[-1].ip - 1));
     }
 }
 
+#ifdef TOS_CACHE
+// The stack code loop may hold the top of the stack in tos, with sp past the
+// values below it. cached says which, and is part of what the loop switches
+// on, so that an instruction has a handler for each state of the cache. Only
+// the common ones have a handler of their own for a cached top, the others
+// spill it first and run as usual, and so does everything that looks at the
+// stack from outside the loop.
+#define CACHED 0x100
+#define SPILL() (cached ? (*sp++ = tos, cached = 0) : 0)
+#define FLUSH_REGS() (SPILL(), vm.sp = sp, vm.csp = csp, *vm.csp = cur)
+#define RESTORE_REGS()                                                         \
+    (sp = vm.sp, csp = vm.csp, cur = *vm.csp, cached = 0)
+#else
 #define FLUSH_REGS() (vm.sp = sp, vm.csp = csp, *vm.csp = cur)
 #define RESTORE_REGS() (sp = vm.sp, csp = vm.csp, cur = *vm.csp)
+#endif
 
 #define runtime_error(...) (FLUSH_REGS(), runtime_error(__VA_ARGS__))
 
+// Returned by a loop that stopped for the other one to carry on from the
+// frames it flushed
+#define SWITCH_LOOP -1
+
+// Sees to the interrupts at a call or jump: stops the program once the heap
+// has gone over its limit or its time is up, takes the profiler sample
+// once its timer has gone off, and leaves the plain loop for the
+// instrumented one, with ip back on the instruction so that it runs there.
+#define INTERRUPT_POINT()                                                      \
+    if (__builtin_expect(vm_interrupt | vm.interrupt, 0)) {                    \
+        FLUSH_REGS();                                                          \
+        if (vm.heap_exceeded) {                                                \
+            vm.heap_exceeded = false;                                          \
+            runtime_error("Heap limit of %zu bytes exceeded.", vm.max_heap);   \
+            return RUNTIME_ERROR;                                              \
+        }                                                                      \
+        if (vm_time_up) {                                                      \
+            vm_time_up = 0;                                                    \
+            runtime_error("Time limit exceeded.");                             \
+            return RUNTIME_ERROR;                                              \
+        }                                                                      \
+        if (interrupted() && !debug) {                                         \
+            cur.ip--;                                                          \
+            FLUSH_REGS();                                                      \
+            return SWITCH_LOOP;                                                \
+        }                                                                      \
+    }
+
+// An inlined call is seen to as a real one would be, from the first
+// instruction of its body as though that had just been fetched
+#define INLINE_INTERRUPT_POINT()                                               \
+    if (__builtin_expect(vm_interrupt | vm.interrupt, 0)) {                    \
+        cur.ip++;                                                              \
+        INTERRUPT_POINT();                                                     \
+        cur.ip--;                                                              \
+    }
+
+// The instrumented loop hands each instruction to the debugger first, and
+// goes back to the plain loop once nothing needs it
+#define DEBUG_POINT()                                                          \
+    if (debug) {                                                               \
+        FLUSH_REGS();                                                          \
+        if (!debug_step()) return SWITCH_LOOP;                                 \
+    }
+
+// Call tracing, the depth being that of cur
+#define TRACE_CALL()                                                           \
+    if (__builtin_expect(tracing, 0)) trace_call(csp - vm.call_stack)
+#define TRACE_RET()                                                            \
+    if (__builtin_expect(tracing, 0)) trace_ret(cur.func, csp - vm.call_stack)
+#define TRACE_NOW() (__builtin_expect(tracing, 0) ? trace_clock() : 0)
+
 #define FETCH() *cur.ip++
 #define CONST(n) (cur.func->chunk.constants.d[n])
 
@@ -70,17 +190,97 @@ void runtime_error(char* message, ...) {
 
 #define GET_ID(id) (ObjString*) CONST(id).obj
 
+#ifdef TOS_CACHE
+// The fast paths for a cached top, with b in tos and a below it. Anything
+// else is left to the handler for the stack as it is.
+#define CACHED_ARITH(op, int_op)                                               \
+    Value a = sp[-1];                                                          \
+    i32 r;                                                                     \
+    if (a.type == VT_INT && tos.type == VT_INT && int_op(a.i, tos.i, &r)) {    \
+        sp--;                                                                  \
+        tos = INT_VAL(r);                                                      \
+        break;                                                                 \
+    }                                                                          \
+    if (IS_NUMBER(a) && IS_NUMBER(tos)) {                                      \
+        sp--;                                                                  \
+        tos = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(tos));                      \
+        break;                                                                 \
+    }                                                                          \
+    goto spill;
+
+#define CACHED_COMPARE(op)                                                     \
+    Value a = sp[-1];                                                          \
+    if (a.type == VT_INT && tos.type == VT_INT) {                              \
+        sp--;                                                                  \
+        tos = BOOL_VAL(a.i op tos.i);                                          \
+        break;                                                                 \
+    }                                                                          \
+    if (IS_NUMBER(a) && IS_NUMBER(tos)) {                                      \
+        sp--;                                                                  \
+        tos = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(tos));                        \
+        break;                                                                 \
+    }                                                                          \
+    goto spill;
+
+// The handler for op as it is, entered with a cached top by spilling it
+#define SPILLING(op)                                                           \
+    case CACHED | op:                                                          \
+        *sp++ = tos;                                                           \
+        cached = 0;                                                            \
+        __attribute__((fallthrough));                                          \
+    case op
+#else
+#define SPILLING(op) case op
+#endif
+
+#define NUM_BINARY(op, res_val)                                                \
+    if (a.type == VT_NUMBER && b.type == VT_NUMBER) {                          \
+        PUSH(res_val(a.num op b.num));                                         \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+        PUSH(res_val(AS_NUMBER(a) op AS_NUMBER(b)));                           \
+    } else {                                                                   \
+        runtime_error("Invalid operand for '" #op "'.");                       \
+        return RUNTIME_ERROR;                                                  \
+    }
+
 #define BINARY(op, res_val)                                                    \
     POP(Value b);                                                              \
     POP(Value a);                                                              \
-    if (a.type != VT_NUMBER || b.type != VT_NUMBER) {                          \
-        runtime_error("Invalid operand for '" #op "'.");                       \
-        return RUNTIME_ERROR;                                                  \
-    }                                                                          \
-    PUSH(res_val(a.num op b.num));
+    NUM_BINARY(op, res_val);
+
+#define ARITH(op, int_op)                                                      \
+    POP(Value b);                                                              \
+    POP(Value a);                                                              \
+    i32 r;                                                                     \
+    if (a.type == VT_INT && b.type == VT_INT && int_op(a.i, b.i, &r)) {        \
+        PUSH(INT_VAL(r));                                                      \
+    } else {                                                                   \
+        NUM_BINARY(op, NUMBER_VAL);                                            \
+    }
 
+#define COMPARE(op)                                                            \
+    POP(Value b);                                                              \
+    POP(Value a);                                                              \
+    if (a.type == VT_INT && b.type == VT_INT) {                                \
+        PUSH(BOOL_VAL(a.i op b.i));                                            \
+    } else {                                                                   \
+        NUM_BINARY(op, BOOL_VAL);                                              \
+    }
+
+// v.b is only looked at for booleans, as GCC takes a bool to be 0 or 1 and
+// would otherwise mix in the low byte of other values
 bool truthy(Value v) {
-    return !(v.type == VT_NIL || (v.type == VT_BOOL && !v.b));
+    if (v.type == VT_BOOL) return v.b;
+    return v.type != VT_NIL;
+}
+
+// Whether to go on instrumented
+static bool interrupted() {
+    vm.interrupt = false;
+    if (profile_ticks) profile_sample();
+    if (heap_dump_pending) heap_dump_signalled();
+    vm_interrupt = debugging;
+    return debugging;
 }
 
 static inline void close_upvalues(Value* sp) {
@@ -91,41 +291,48 @@ static inline void close_upvalues(Value* sp) {
     }
 }
 
-int run(ObjFunction* toplevel) {
-    Value stack[STACK_SIZE];
-    vm.stack_base = stack;
-
-    register Value* sp = stack;
-    register CallFrame* csp = vm.call_stack;
+// The interpreter loops read the isolate through a local, so the thread
+// local is only looked up once per call.
+#undef vm
+#define vm (*self)
 
-    register CallFrame cur;
-    cur.fp = sp;
-    cur.func = toplevel;
-    cur.clos = NULL;
-    cur.ip = cur.func->chunk.code.d;
-
-    PUSH(OBJ_VAL(toplevel));
+static inline bool set_global(VM* const self, ObjString* id, Value v) {
+    Value* slot = table_lookup(&vm.globals, id);
+    if (!slot) return false;
+    *slot = v;
+    return true;
+}
 
-#ifdef DEBUG_TRACE
-    eprintf("-------------- Begin Trace --------------\n");
+// The stack code interpreter, carrying on with the frames in vm. It is
+// built twice, as the plain loop and with debug as the instrumented one.
+static inline __attribute__((always_inline)) int
+run_loop(VM* const self, const bool debug) {
+    register Value* sp;
+    register CallFrame* csp;
+#ifdef TOS_CACHE
+    register Value tos;
+    int cached;
 #endif
+    register CallFrame cur;
+    RESTORE_REGS();
 
     while (true) {
-#ifdef DEBUG_TRACE
-        eprintf("Stack:");
-        for (Value* p = cur.fp; p < sp; p++) eprintf(" "), eprint_value(*p);
-        eprintf("\n%04lx: ", cur.ip - cur.func->chunk.code.d);
-        disassemble_instr(&cur.func->chunk, cur.ip - cur.func->chunk.code.d);
-        eprintf("\n");
+        DEBUG_POINT();
+#ifdef DEBUG_OPSTATS
+        opstats_dispatch(&opstats, *cur.ip);
 #endif
+#ifdef TOS_CACHE
+    dispatch:
+        switch (FETCH() | cached) {
+#else
         switch (FETCH()) {
-            case OP_DEF_GLOBAL: {
+#endif
+            SPILLING(OP_DEF_GLOBAL): {
                 POP(Value v);
-                ObjString* id = GET_ID(FETCH());
-                table_set(&vm.globals, id, v);
+                table_set(&vm.globals, GET_ID(FETCH()), v);
                 break;
             }
-            case OP_PUSH_GLOBAL: {
+            SPILLING(OP_PUSH_GLOBAL): {
                 ObjString* id = GET_ID(FETCH());
                 Value v;
                 if (!table_get(&vm.globals, id, &v)) {
@@ -135,21 +342,20 @@ int run(ObjFunction* toplevel) {
                 PUSH(v);
                 break;
             }
-            case OP_POP_GLOBAL: {
+            SPILLING(OP_POP_GLOBAL): {
                 ObjString* id = GET_ID(FETCH());
                 POP(Value v);
-                if (table_set(&vm.globals, id, v)) {
-                    table_delete(&vm.globals, id);
+                if (!set_global(self, id, v)) {
                     runtime_error("Undefined variable \"%s\".", id->data);
                     return RUNTIME_ERROR;
                 }
                 break;
             }
-            case OP_GETATTR: {
+            SPILLING(OP_GETATTR): {
                 ObjString* id = GET_ID(FETCH());
                 POP(Value v);
                 if (isObjType(v, OT_ARRAY) && !strcmp(id->data, "len")) {
-                    PUSH(NUMBER_VAL(((ObjArray*) v.obj)->len));
+                    PUSH(INT_VAL(((ObjArray*) v.obj)->len));
                     break;
                 }
                 if (!isObjType(v, OT_INSTANCE)) {
@@ -164,7 +370,7 @@ int run(ObjFunction* toplevel) {
                 PUSH(v);
                 break;
             }
-            case OP_SETATTR: {
+            SPILLING(OP_SETATTR): {
                 ObjString* id = GET_ID(FETCH());
                 POP(Value a);
                 POP(Value v);
@@ -181,11 +387,13 @@ int run(ObjFunction* toplevel) {
                 POP(Value i);
                 POP(Value a);
                 if (isObjType(a, OT_ARRAY)) {
-                    if (i.type != VT_NUMBER) {
+                    size_t idx;
+                    if (i.type == VT_INT) idx = i.i;
+                    else if (i.type == VT_NUMBER) idx = i.num;
+                    else {
                         runtime_error("Index must be a number.");
                         return RUNTIME_ERROR;
                     }
-                    size_t idx = i.num;
                     ObjArray* arr = (ObjArray*) a.obj;
                     if (idx < 0) idx += arr->len;
                     if (idx < 0 || idx >= arr->len) {
@@ -201,16 +409,18 @@ int run(ObjFunction* toplevel) {
                 }
                 break;
             }
-            case OP_SETITEM: {
+            SPILLING(OP_SETITEM): {
                 POP(Value v);
                 POP(Value i);
                 POP(Value a);
                 if (isObjType(a, OT_ARRAY)) {
-                    if (i.type != VT_NUMBER) {
+                    size_t idx;
+                    if (i.type == VT_INT) idx = i.i;
+                    else if (i.type == VT_NUMBER) idx = i.num;
+                    else {
                         runtime_error("Index must be a number.");
                         return RUNTIME_ERROR;
                     }
-                    size_t idx = i.num;
                     ObjArray* arr = (ObjArray*) a.obj;
                     if (idx < 0) idx += arr->len;
                     if (idx < 0 || idx >= arr->len) {
@@ -227,30 +437,39 @@ int run(ObjFunction* toplevel) {
                 }
                 break;
             }
+#ifdef TOS_CACHE
+            case CACHED | OP_PUSH_LOCAL:
+                *sp++ = tos;
+                // fall through
+            case OP_PUSH_LOCAL:
+                tos = cur.fp[FETCH()];
+                cached = CACHED;
+                break;
+#else
             case OP_PUSH_LOCAL: {
                 PUSH(cur.fp[FETCH()]);
                 break;
             }
+#endif
             case OP_POP_LOCAL: {
                 POP(cur.fp[FETCH()]);
                 break;
             }
-            case OP_PUSH_UPVALUE: {
+            SPILLING(OP_PUSH_UPVALUE): {
                 PUSH(*cur.clos->upvalues[FETCH()]->loc);
                 break;
             }
-            case OP_POP_UPVALUE: {
+            SPILLING(OP_POP_UPVALUE): {
                 POP(*cur.clos->upvalues[FETCH()]->loc);
                 break;
             }
-            case OP_PUSH_CLOSURE: {
+            SPILLING(OP_PUSH_CLOSURE): {
                 ObjFunction* func = (ObjFunction*) CONST(FETCH()).obj;
                 FLUSH_REGS();
                 ObjClosure* clos = create_closure(func);
                 PUSH(OBJ_VAL(clos));
                 FLUSH_REGS();
-                clos->upvalues =
-                    malloc(func->nupvalues * sizeof *clos->upvalues);
+                clos->upvalues = ALLOCATE(ObjUpvalue*, func->nupvalues);
                 for (int i = 0; i < func->nupvalues; i++) {
                     if (func->upvalues[i].local) {
                         Value* loc = &cur.fp[func->upvalues[i].id];
@@ -274,17 +493,17 @@ int run(ObjFunction* toplevel) {
                 clos->nupvalues = func->nupvalues;
                 break;
             }
-            case OP_PUSH_ARRAY: {
+            SPILLING(OP_PUSH_ARRAY): {
                 POP(Value l);
-                if (l.type != VT_NUMBER) {
+                if (!IS_NUMBER(l)) {
                     runtime_error("Array lenght must be a number.");
                     return RUNTIME_ERROR;
                 }
                 FLUSH_REGS();
-                PUSH(OBJ_VAL(create_array(l.num)));
+                PUSH(OBJ_VAL(create_array(AS_NUMBER(l))));
                 break;
             }
-            case OP_PUSH_ARRAY_INIT: {
+            SPILLING(OP_PUSH_ARRAY_INIT): {
                 int len = FETCH();
                 FLUSH_REGS();
                 ObjArray* arr = create_array_full(len, sp - len);
@@ -292,39 +511,53 @@ int run(ObjFunction* toplevel) {
                 PUSH(OBJ_VAL(arr));
                 break;
             }
+#ifdef TOS_CACHE
+            case CACHED | OP_PUSH_CONST:
+                *sp++ = tos;
+                // fall through
+            case OP_PUSH_CONST:
+                tos = CONST(FETCH());
+                cached = CACHED;
+                break;
+#else
             case OP_PUSH_CONST:
                 PUSH(CONST(FETCH()));
                 break;
-            case OP_PUSH_NIL:
+#endif
+            SPILLING(OP_PUSH_NIL):
                 PUSH(NIL_VAL);
                 break;
-            case OP_PUSH_TRUE:
+            SPILLING(OP_PUSH_TRUE):
                 PUSH(BOOL_VAL(true));
                 break;
-            case OP_PUSH_FALSE:
+            SPILLING(OP_PUSH_FALSE):
                 PUSH(BOOL_VAL(false));
                 break;
-            case OP_PUSH:
+            SPILLING(OP_PUSH):
                 sp++;
                 break;
             case OP_POP:
                 --sp;
                 close_upvalues(sp);
                 break;
-            case OP_POPN:
+            SPILLING(OP_POPN):
                 sp -= FETCH();
                 close_upvalues(sp);
                 break;
-            case OP_NEG: {
+            SPILLING(OP_NEG): {
                 POP(Value a);
-                if (a.type != VT_NUMBER) {
+                if (a.type == VT_INT && a.i && a.i != INT32_MIN) {
+                    PUSH(INT_VAL(-a.i));
+                    break;
+                }
+                if (!IS_NUMBER(a)) {
                     runtime_error("Invalid operand for unary '-'.");
                     return RUNTIME_ERROR;
                 }
-                PUSH(NUMBER_VAL(-a.num));
+                PUSH(NUMBER_VAL(-AS_NUMBER(a)));
                 break;
             }
-            case OP_NOT: {
+            SPILLING(OP_NOT): {
                 POP(Value a);
                 PUSH(BOOL_VAL(!truthy(a)));
                 break;
@@ -332,8 +565,12 @@ int run(ObjFunction* toplevel) {
             case OP_ADD: {
                 POP(Value b);
                 POP(Value a);
-                if (a.type == VT_NUMBER && b.type == VT_NUMBER) {
-                    PUSH(NUMBER_VAL(a.num + b.num));
+                i32 r;
+                if (a.type == VT_INT && b.type == VT_INT &&
+                    int_add(a.i, b.i, &r)) {
+                    PUSH(INT_VAL(r));
+                } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
                 } else if (isObjType(a, OT_STRING) && isObjType(b, OT_STRING)) {
                     sp += 2;
                     FLUSH_REGS();
@@ -358,42 +595,49 @@ int run(ObjFunction* toplevel) {
                 break;
             }
             case OP_SUB: {
-                BINARY(-, NUMBER_VAL);
+                ARITH(-, int_sub);
                 break;
             }
             case OP_MUL: {
-                BINARY(*, NUMBER_VAL);
+                ARITH(*, int_mul);
                 break;
             }
-            case OP_DIV: {
+            SPILLING(OP_DIV): {
                 BINARY(/, NUMBER_VAL);
                 break;
             }
-            case OP_MOD: {
+            SPILLING(OP_MOD): {
                 POP(Value b);
                 POP(Value a);
-                if (a.type != VT_NUMBER || b.type != VT_NUMBER) {
+                i32 r;
+                if (a.type == VT_INT && b.type == VT_INT &&
+                    int_mod(a.i, b.i, &r)) {
+                    PUSH(INT_VAL(r));
+                    break;
+                }
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
                     runtime_error("Invalid operand for '%%'.");
                     return RUNTIME_ERROR;
                 }
-                PUSH(NUMBER_VAL(fmod(a.num, b.num)));
+                PUSH(NUMBER_VAL(fmod(AS_NUMBER(a), AS_NUMBER(b))));
                 break;
             }
-            case OP_TEQ: {
+            SPILLING(OP_TEQ): {
                 POP(Value a);
                 POP(Value b);
                 PUSH(BOOL_VAL(value_equal(a, b)));
                 break;
             }
             case OP_TGT: {
-                BINARY(>, BOOL_VAL);
+                COMPARE(>);
                 break;
             }
             case OP_TLT: {
-                BINARY(<, BOOL_VAL);
+                COMPARE(<);
                 break;
             }
-            case OP_JMP: {
+            SPILLING(OP_JMP): {
+                INTERRUPT_POINT();
                 int off = FETCH();
                 off |= FETCH() << 8;
                 off = off << 16 >> 16;
@@ -420,7 +664,8 @@ int run(ObjFunction* toplevel) {
                 }
                 break;
             }
-            case OP_CALL: {
+            SPILLING(OP_CALL): {
+                INTERRUPT_POINT();
                 int nargs = FETCH();
                 Value v = sp[-(nargs + 1)];
                 switch (v.type) {
@@ -437,6 +682,7 @@ int run(ObjFunction* toplevel) {
                                 cur.clos = NULL;
                                 cur.fp = sp - nargs - 1;
                                 cur.ip = func->chunk.code.d;
+                                TRACE_CALL();
                                 if (func->nargs != nargs) {
                                     runtime_error("Invalid argument count, "
                                                   "expected %d, got %d.",
@@ -457,6 +703,7 @@ int run(ObjFunction* toplevel) {
                                 cur.clos = clos;
                                 cur.fp = sp - nargs - 1;
                                 cur.ip = func->chunk.code.d;
+                                TRACE_CALL();
                                 if (func->nargs != nargs) {
                                     runtime_error("Invalid argument count, "
                                                   "expected %d, got %d.",
@@ -480,7 +727,11 @@ int run(ObjFunction* toplevel) {
                         break;
                     case VT_BUILTIN:
                         FLUSH_REGS();
-                        if (v.builtin(nargs, sp - nargs - 1) != OK) {
+                        u64 start = TRACE_NOW();
+                        int status = v.builtin(nargs, sp - nargs - 1);
+                        if (start) trace_builtin(v.builtin, start);
+                        if (status == HALTED) return HALTED;
+                        if (status != OK) {
                             runtime_error("Error from builtin function.");
                             return RUNTIME_ERROR;
                         }
@@ -492,19 +743,744 @@ int run(ObjFunction* toplevel) {
                 }
                 break;
             }
-            case OP_RET: {
-                if (csp == vm.call_stack) return OK;
+            SPILLING(OP_INLINE): {
+                int off = FETCH();
+                off |= FETCH() << 8;
+                off = off << 16 >> 16;
+                ObjFunction* f = (ObjFunction*) CONST(FETCH()).obj;
+                Value callee = sp[-FETCH() - 1];
+                // A trace gets a span from every call, made for real
+                if (callee.type == VT_OBJ && callee.obj == (Obj*) f &&
+                    !tracing) {
+                    INLINE_INTERRUPT_POINT();
+                } else {
+                    cur.ip += off;
+                }
+                break;
+            }
+            SPILLING(OP_INLINE_RET): {
+                int n = FETCH();
+                Value* dst = sp - (n + 1);
+                *dst = sp[-1];
+                sp = dst + 1;
+                cur.ip += 2;
+                break;
+            }
+            SPILLING(OP_PUSH_STACK): {
+                Value v = sp[-FETCH()];
+                PUSH(v);
+                break;
+            }
+            SPILLING(OP_POP_STACK): {
+                int n = FETCH();
+                POP(Value v);
+                sp[-n] = v;
+                break;
+            }
+            SPILLING(OP_RET): {
+                TRACE_RET();
                 POP(Value v);
-                sp = cur.fp;
+                Value* fp = cur.fp;
+                close_upvalues(fp);
+                if (csp == vm.call_stack) {
+                    vm.ret = v;
+                    return OK;
+                }
                 cur = *--csp;
-                close_upvalues(sp);
+                sp = fp;
                 PUSH(v);
                 break;
             }
+            SPILLING(OP_LAZY): {
+                gc_disable();
+                bool compiled = compile_lazy(cur.func);
+                gc_enable();
+                if (!compiled) return COMPILE_ERROR;
+                cur.ip = cur.func->chunk.code.d;
+                break;
+            }
+#ifdef TOS_CACHE
+            // With the top cached. Pops leave the value in its slot, as
+            // they do on the stack, for OP_PUSH to bring back.
+            case CACHED | OP_POP_LOCAL:
+                cur.fp[FETCH()] = tos;
+                *sp = tos;
+                cached = 0;
+                break;
+            case CACHED | OP_POP:
+                *sp = tos;
+                cached = 0;
+                close_upvalues(sp);
+                break;
+            case CACHED | OP_ADD: {
+                CACHED_ARITH(+, int_add);
+                break;
+            }
+            case CACHED | OP_SUB: {
+                CACHED_ARITH(-, int_sub);
+                break;
+            }
+            case CACHED | OP_MUL: {
+                CACHED_ARITH(*, int_mul);
+                break;
+            }
+            case CACHED | OP_TGT: {
+                CACHED_COMPARE(>);
+                break;
+            }
+            case CACHED | OP_TLT: {
+                CACHED_COMPARE(<);
+                break;
+            }
+            case CACHED | OP_GETITEM: {
+                Value a = sp[-1];
+                if (isObjType(a, OT_ARRAY) && tos.type == VT_INT) {
+                    ObjArray* arr = (ObjArray*) a.obj;
+                    size_t idx = tos.i;
+                    if (idx < arr->len) {
+                        sp--;
+                        tos = arr->data[idx];
+                        break;
+                    }
+                }
+                goto spill;
+            }
+            case CACHED | OP_JMP_TRUE: {
+                int off = FETCH();
+                off |= FETCH() << 8;
+                off = off << 16 >> 16;
+                *sp = tos;
+                cached = 0;
+                if (truthy(tos)) {
+                    cur.ip += off;
+                }
+                break;
+            }
+            case CACHED | OP_JMP_FALSE: {
+                int off = FETCH();
+                off |= FETCH() << 8;
+                off = off << 16 >> 16;
+                *sp = tos;
+                cached = 0;
+                if (!truthy(tos)) {
+                    cur.ip += off;
+                }
+                break;
+            }
+            spill:
+                // A fast path that does not apply runs the instruction again
+                // with the stack as it is
+                cur.ip--;
+                *sp++ = tos;
+                cached = 0;
+                goto dispatch;
+#endif
         }
     }
 }
 
+// The plain loop is inlined into run() and this one kept out of it, so that
+// the hot loop is as it was before the debugger
+static __attribute__((noinline)) int run_debug(VM* self) {
+    return run_loop(self, true);
+}
+
+// Runs argv[0], a function or closure taking argc arguments, as the
+// outermost call. What it returns is left in vm.ret. GCC would load the
+// frame registers as vectors on resuming a loop and then keep them in vector
+// registers, at a few moves for every instruction.
+__attribute__((optimize("no-tree-slp-vectorize"))) int
+run(int argc, Value* argv) {
+    VM* const self = cur_vm;
+    Value stack[STACK_SIZE];
+    vm.stack_base = stack;
+
+    for (int i = 0; i <= argc; i++) stack[i] = argv[i];
+    vm.sp = stack + argc + 1;
+    vm.csp = vm.call_stack;
+    CallFrame* f = vm.csp;
+    f->fp = stack;
+    if (argv[0].obj->type == OT_CLOSURE) {
+        f->clos = (ObjClosure*) argv[0].obj;
+        f->func = f->clos->f;
+    } else {
+        f->clos = NULL;
+        f->func = (ObjFunction*) argv[0].obj;
+    }
+    f->ip = f->func->chunk.code.d;
+    if (tracing) trace_call(0);
+
+    int code;
+    do {
+        code = debugging ? run_debug(self) : run_loop(self, false);
+    } while (code == SWITCH_LOOP);
+    return code;
+}
+
+#ifdef TOS_CACHE
+// The register interpreter keeps everything in the frame
+#undef FLUSH_REGS
+#undef RESTORE_REGS
+#define FLUSH_REGS() (vm.sp = sp, vm.csp = csp, *vm.csp = cur)
+#define RESTORE_REGS() (sp = vm.sp, csp = vm.csp, cur = *vm.csp)
+#endif
+
+#define R(n) cur.fp[n]
+#define RCONST(n) (cur.func->rchunk.constants.d[n])
+#define FETCH_OFF() (cur.ip += 2, (int16_t) (cur.ip[-2] | cur.ip[-1] << 8))
+
+#define RNUM_BINARY(op, res_val)                                               \
+    if (a.type == VT_NUMBER && b.type == VT_NUMBER) {                          \
+        R(dst) = res_val(a.num op b.num);                                      \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                                 \
+        R(dst) = res_val(AS_NUMBER(a) op AS_NUMBER(b));                        \
+    } else {                                                                   \
+        runtime_error("Invalid operand for '" #op "'.");                       \
+        return RUNTIME_ERROR;                                                  \
+    }
+
+#define RBINARY(op, res_val, rhs)                                              \
+    do {                                                                       \
+        int dst = FETCH();                                                     \
+        Value a = R(FETCH());                                                  \
+        Value b = rhs;                                                         \
+        RNUM_BINARY(op, res_val);                                              \
+    } while (false)
+
+#define RARITH(op, int_op, rhs)                                                \
+    do {                                                                       \
+        int dst = FETCH();                                                     \
+        Value a = R(FETCH());                                                  \
+        Value b = rhs;                                                         \
+        i32 r;                                                                 \
+        if (a.type == VT_INT && b.type == VT_INT && int_op(a.i, b.i, &r)) {    \
+            R(dst) = INT_VAL(r);                                               \
+        } else {                                                               \
+            RNUM_BINARY(op, NUMBER_VAL);                                       \
+        }                                                                      \
+    } while (false)
+
+#define RCOMPARE(op, rhs)                                                      \
+    do {                                                                       \
+        int dst = FETCH();                                                     \
+        Value a = R(FETCH());                                                  \
+        Value b = rhs;                                                         \
+        if (a.type == VT_INT && b.type == VT_INT) {                            \
+            R(dst) = BOOL_VAL(a.i op b.i);                                     \
+        } else {                                                               \
+            RNUM_BINARY(op, BOOL_VAL);                                         \
+        }                                                                      \
+    } while (false)
+
+#define RADD(rhs)                                                              \
+    do {                                                                       \
+        int dst = FETCH();                                                     \
+        Value a = R(FETCH());                                                  \
+        Value b = rhs;                                                         \
+        i32 r;                                                                 \
+        if (a.type == VT_INT && b.type == VT_INT && int_add(a.i, b.i, &r)) {   \
+            R(dst) = INT_VAL(r);                                               \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                             \
+            R(dst) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                  \
+        } else if (isObjType(a, OT_STRING)) {                                  \
+            /* keep both halves reachable past the frame top */               \
+            sp[0] = a;                                                         \
+            sp[1] = b;                                                         \
+            sp += 2;                                                           \
+            FLUSH_REGS();                                                      \
+            if (!isObjType(b, OT_STRING)) sp[-1] = OBJ_VAL(string_value(b));   \
+            ObjString* sum = concat_string((ObjString*) a.obj,                 \
+                                           (ObjString*) sp[-1].obj);           \
+            sp -= 2;                                                           \
+            R(dst) = OBJ_VAL(sum);                                             \
+        } else {                                                               \
+            runtime_error("Invalid operand for '+'.");                         \
+            return RUNTIME_ERROR;                                              \
+        }                                                                      \
+    } while (false)
+
+#define RBRANCH(op, rhs)                                                       \
+    do {                                                                       \
+        bool sense = FETCH();                                                  \
+        Value a = R(FETCH());                                                  \
+        Value b = rhs;                                                         \
+        int off = FETCH_OFF();                                                 \
+        if (a.type == VT_INT && b.type == VT_INT) {                            \
+            if ((a.i op b.i) == sense) cur.ip += off;                          \
+            break;                                                             \
+        }                                                                      \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                                  \
+            runtime_error("Invalid operand for '" #op "'.");                   \
+            return RUNTIME_ERROR;                                              \
+        }                                                                      \
+        if ((AS_NUMBER(a) op AS_NUMBER(b)) == sense) cur.ip += off;            \
+    } while (false)
+
+// Same as run_loop(), over register code. The frame holds exactly nregs
+// slots and sp stays at its top so the GC sees every register.
+static inline __attribute__((always_inline)) int
+run_reg_loop(VM* const self, const bool debug) {
+    register Value* sp;
+    register CallFrame* csp;
+    register CallFrame cur;
+    RESTORE_REGS();
+
+    while (true) {
+        DEBUG_POINT();
+#ifdef DEBUG_OPSTATS
+        opstats_dispatch(&ropstats, *cur.ip);
+#endif
+        switch (FETCH()) {
+            case R_MOV: {
+                int dst = FETCH();
+                R(dst) = R(FETCH());
+                break;
+            }
+            case R_LOADK: {
+                int dst = FETCH();
+                R(dst) = RCONST(FETCH());
+                break;
+            }
+            case R_DEF_GLOBAL: {
+                Value v = R(FETCH());
+                table_set(&vm.globals, (ObjString*) RCONST(FETCH()).obj, v);
+                break;
+            }
+            case R_GET_GLOBAL: {
+                int dst = FETCH();
+                ObjString* id = (ObjString*) RCONST(FETCH()).obj;
+                if (!table_get(&vm.globals, id, &R(dst))) {
+                    runtime_error("Undefined variable \"%s\".", id->data);
+                    return RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_SET_GLOBAL: {
+                Value v = R(FETCH());
+                ObjString* id = (ObjString*) RCONST(FETCH()).obj;
+                if (!set_global(self, id, v)) {
+                    runtime_error("Undefined variable \"%s\".", id->data);
+                    return RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_GET_UPVALUE: {
+                int dst = FETCH();
+                R(dst) = *cur.clos->upvalues[FETCH()]->loc;
+                break;
+            }
+            case R_SET_UPVALUE: {
+                Value v = R(FETCH());
+                *cur.clos->upvalues[FETCH()]->loc = v;
+                break;
+            }
+            case R_CLOSURE: {
+                int dst = FETCH();
+                ObjFunction* func = (ObjFunction*) RCONST(FETCH()).obj;
+                FLUSH_REGS();
+                ObjClosure* clos = create_closure(func);
+                R(dst) = OBJ_VAL(clos);
+                clos->upvalues = ALLOCATE(ObjUpvalue*, func->nupvalues);
+                for (int i = 0; i < func->nupvalues; i++) {
+                    if (func->upvalues[i].local) {
+                        Value* loc = &cur.fp[func->upvalues[i].id];
+                        ObjUpvalue** ptr = &vm.open_upvalues;
+                        while (*ptr && (*ptr)->loc > loc) ptr = &(*ptr)->next;
+                        ObjUpvalue* upval;
+                        if (*ptr && (*ptr)->loc == loc) {
+                            upval = *ptr;
+                        } else {
+                            upval = create_upvalue(loc);
+                            upval->next = *ptr;
+                            *ptr = upval;
+                        }
+                        clos->upvalues[i] = upval;
+                    } else {
+                        clos->upvalues[i] =
+                            cur.clos->upvalues[func->upvalues[i].id];
+                    }
+                }
+                clos->nupvalues = func->nupvalues;
+                break;
+            }
+            case R_ARRAY: {
+                int dst = FETCH();
+                Value l = R(FETCH());
+                if (!IS_NUMBER(l)) {
+                    runtime_error("Array lenght must be a number.");
+                    return RUNTIME_ERROR;
+                }
+                FLUSH_REGS();
+                R(dst) = OBJ_VAL(create_array(AS_NUMBER(l)));
+                break;
+            }
+            case R_ARRAY_INIT: {
+                int dst = FETCH();
+                int len = FETCH();
+                FLUSH_REGS();
+                R(dst) = OBJ_VAL(create_array_full(len, &R(dst)));
+                break;
+            }
+            case R_GETATTR: {
+                int dst = FETCH();
+                Value v = R(FETCH());
+                ObjString* id = (ObjString*) RCONST(FETCH()).obj;
+                if (isObjType(v, OT_ARRAY) && !strcmp(id->data, "len")) {
+                    R(dst) = INT_VAL(((ObjArray*) v.obj)->len);
+                    break;
+                }
+                if (!isObjType(v, OT_INSTANCE)) {
+                    runtime_error("Value must be an instance.");
+                    return RUNTIME_ERROR;
+                }
+                ObjInstance* inst = (ObjInstance*) v.obj;
+                if (!table_get(&inst->attrs, id, &R(dst))) {
+                    runtime_error("Unknown attribute \"%s\".", id->data);
+                    return RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_SETATTR: {
+                Value v = R(FETCH());
+                ObjString* id = (ObjString*) RCONST(FETCH()).obj;
+                Value a = R(FETCH());
+                if (!isObjType(v, OT_INSTANCE)) {
+                    runtime_error("Value must be an instance.");
+                    return RUNTIME_ERROR;
+                }
+                ObjInstance* inst = (ObjInstance*) v.obj;
+                table_set(&inst->attrs, id, a);
+                break;
+            }
+            case R_GETITEM: {
+                int dst = FETCH();
+                Value a = R(FETCH());
+                Value i = R(FETCH());
+                if (isObjType(a, OT_ARRAY)) {
+                    size_t idx;
+                    if (i.type == VT_INT) idx = i.i;
+                    else if (i.type == VT_NUMBER) idx = i.num;
+                    else {
+                        runtime_error("Index must be a number.");
+                        return RUNTIME_ERROR;
+                    }
+                    ObjArray* arr = (ObjArray*) a.obj;
+                    if (idx < 0) idx += arr->len;
+                    if (idx < 0 || idx >= arr->len) {
+                        runtime_error(
+                            "Index %d out of bounds for array of length %d.",
+                            idx, arr->len);
+                        return RUNTIME_ERROR;
+                    }
+                    R(dst) = arr->data[idx];
+                } else {
+                    runtime_error("Value not subscriptable.");
+                    return RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_SETITEM: {
+                Value a = R(FETCH());
+                Value i = R(FETCH());
+                Value v = R(FETCH());
+                if (isObjType(a, OT_ARRAY)) {
+                    size_t idx;
+                    if (i.type == VT_INT) idx = i.i;
+                    else if (i.type == VT_NUMBER) idx = i.num;
+                    else {
+                        runtime_error("Index must be a number.");
+                        return RUNTIME_ERROR;
+                    }
+                    ObjArray* arr = (ObjArray*) a.obj;
+                    if (idx < 0) idx += arr->len;
+                    if (idx < 0 || idx >= arr->len) {
+                        runtime_error(
+                            "Index %d out of bounds for array of length %d.",
+                            idx, arr->len);
+                        return RUNTIME_ERROR;
+                    }
+                    arr->data[idx] = v;
+                } else {
+                    runtime_error("Value not subscriptable.");
+                    return RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_NEG: {
+                int dst = FETCH();
+                Value a = R(FETCH());
+                if (a.type == VT_INT && a.i && a.i != INT32_MIN) {
+                    R(dst) = INT_VAL(-a.i);
+                    break;
+                }
+                if (!IS_NUMBER(a)) {
+                    runtime_error("Invalid operand for unary '-'.");
+                    return RUNTIME_ERROR;
+                }
+                R(dst) = NUMBER_VAL(-AS_NUMBER(a));
+                break;
+            }
+            case R_NOT: {
+                int dst = FETCH();
+                R(dst) = BOOL_VAL(!truthy(R(FETCH())));
+                break;
+            }
+            case R_ADD:
+                RADD(R(FETCH()));
+                break;
+            case R_ADDK:
+                RADD(RCONST(FETCH()));
+                break;
+            case R_SUB:
+                RARITH(-, int_sub, R(FETCH()));
+                break;
+            case R_SUBK:
+                RARITH(-, int_sub, RCONST(FETCH()));
+                break;
+            case R_MUL:
+                RARITH(*, int_mul, R(FETCH()));
+                break;
+            case R_MULK:
+                RARITH(*, int_mul, RCONST(FETCH()));
+                break;
+            case R_DIV:
+                RBINARY(/, NUMBER_VAL, R(FETCH()));
+                break;
+            case R_DIVK:
+                RBINARY(/, NUMBER_VAL, RCONST(FETCH()));
+                break;
+            case R_MOD:
+            case R_MODK: {
+                bool k = cur.ip[-1] == R_MODK;
+                int dst = FETCH();
+                Value a = R(FETCH());
+                Value b = k ? RCONST(FETCH()) : R(FETCH());
+                i32 r;
+                if (a.type == VT_INT && b.type == VT_INT &&
+                    int_mod(a.i, b.i, &r)) {
+                    R(dst) = INT_VAL(r);
+                    break;
+                }
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    runtime_error("Invalid operand for '%%'.");
+                    return RUNTIME_ERROR;
+                }
+                R(dst) = NUMBER_VAL(fmod(AS_NUMBER(a), AS_NUMBER(b)));
+                break;
+            }
+            case R_TEQ: {
+                int dst = FETCH();
+                Value a = R(FETCH());
+                R(dst) = BOOL_VAL(value_equal(a, R(FETCH())));
+                break;
+            }
+            case R_TEQK: {
+                int dst = FETCH();
+                Value a = R(FETCH());
+                R(dst) = BOOL_VAL(value_equal(a, RCONST(FETCH())));
+                break;
+            }
+            case R_TGT:
+                RCOMPARE(>, R(FETCH()));
+                break;
+            case R_TGTK:
+                RCOMPARE(>, RCONST(FETCH()));
+                break;
+            case R_TLT:
+                RCOMPARE(<, R(FETCH()));
+                break;
+            case R_TLTK:
+                RCOMPARE(<, RCONST(FETCH()));
+                break;
+            case R_JMP: {
+                INTERRUPT_POINT();
+                int off = FETCH_OFF();
+                cur.ip += off;
+                break;
+            }
+            case R_JMP_TRUE: {
+                Value cond = R(FETCH());
+                int off = FETCH_OFF();
+                if (truthy(cond)) cur.ip += off;
+                break;
+            }
+            case R_JMP_FALSE: {
+                Value cond = R(FETCH());
+                int off = FETCH_OFF();
+                if (!truthy(cond)) cur.ip += off;
+                break;
+            }
+            case R_JEQ:
+            case R_JEQK: {
+                bool k = cur.ip[-1] == R_JEQK;
+                bool sense = FETCH();
+                Value a = R(FETCH());
+                Value b = k ? RCONST(FETCH()) : R(FETCH());
+                int off = FETCH_OFF();
+                if (value_equal(a, b) == sense) cur.ip += off;
+                break;
+            }
+            case R_JGT:
+                RBRANCH(>, R(FETCH()));
+                break;
+            case R_JGTK:
+                RBRANCH(>, RCONST(FETCH()));
+                break;
+            case R_JLT:
+                RBRANCH(<, R(FETCH()));
+                break;
+            case R_JLTK:
+                RBRANCH(<, RCONST(FETCH()));
+                break;
+            case R_CALL: {
+                INTERRUPT_POINT();
+                int base = FETCH();
+                int nargs = FETCH();
+                Value v = R(base);
+                ObjFunction* func = NULL;
+                ObjClosure* clos = NULL;
+                switch (v.type) {
+                    case VT_OBJ:
+                        switch (v.obj->type) {
+                            case OT_FUNCTION:
+                                func = (ObjFunction*) v.obj;
+                                break;
+                            case OT_CLOSURE:
+                                clos = (ObjClosure*) v.obj;
+                                func = clos->f;
+                                break;
+                            case OT_CLASS: {
+                                FLUSH_REGS();
+                                ObjClass* cls = (ObjClass*) v.obj;
+                                R(base) = OBJ_VAL(create_instance(cls));
+                                break;
+                            }
+                            default:
+                                runtime_error("Value not callable.");
+                                return RUNTIME_ERROR;
+                        }
+                        break;
+                    case VT_BUILTIN:
+                        FLUSH_REGS();
+                        u64 start = TRACE_NOW();
+                        int status = v.builtin(nargs, &R(base));
+                        if (start) trace_builtin(v.builtin, start);
+                        if (status == HALTED) return HALTED;
+                        if (status != OK) {
+                            runtime_error("Error from builtin function.");
+                            return RUNTIME_ERROR;
+                        }
+                        break;
+                    default:
+                        runtime_error("Value not callable.");
+                        return RUNTIME_ERROR;
+                }
+                if (!func) break;
+                if (csp - vm.call_stack == MAX_CALLS) {
+                    runtime_error("Max call depth exceeded.");
+                    return RUNTIME_ERROR;
+                }
+                *csp++ = cur;
+                cur.func = func;
+                cur.clos = clos;
+                cur.fp += base;
+                cur.ip = func->rchunk.code.d;
+                TRACE_CALL();
+                for (int i = nargs + 1; i < func->nregs; i++) {
+                    R(i) = NIL_VAL;
+                }
+                sp = cur.fp + func->nregs;
+                if (func->nargs != nargs) {
+                    runtime_error("Invalid argument count, "
+                                  "expected %d, got %d.",
+                                  func->nargs, nargs);
+                    return RUNTIME_ERROR;
+                }
+                break;
+            }
+            case R_INLINE: {
+                Value callee = R(FETCH());
+                ObjFunction* f = (ObjFunction*) RCONST(FETCH()).obj;
+                int off = FETCH_OFF();
+                // A trace gets a span from every call, made for real
+                if (callee.type == VT_OBJ && callee.obj == (Obj*) f &&
+                    !tracing) {
+                    INLINE_INTERRUPT_POINT();
+                } else {
+                    cur.ip += off;
+                }
+                break;
+            }
+            case R_CLOSE:
+                close_upvalues(&R(FETCH()));
+                break;
+            case R_RET: {
+                TRACE_RET();
+                Value v = R(FETCH());
+                close_upvalues(cur.fp);
+                if (csp == vm.call_stack) {
+                    vm.ret = v;
+                    return OK;
+                }
+                R(0) = v;
+                cur = *--csp;
+                sp = cur.fp + cur.func->nregs;
+                break;
+            }
+            case R_LAZY: {
+                gc_disable();
+                bool compiled = compile_lazy(cur.func);
+                gc_enable();
+                if (!compiled) return COMPILE_ERROR;
+                cur.ip = cur.func->rchunk.code.d;
+                for (int i = cur.func->nargs + 1; i < cur.func->nregs; i++) {
+                    R(i) = NIL_VAL;
+                }
+                sp = cur.fp + cur.func->nregs;
+                break;
+            }
+        }
+    }
+}
+
+static __attribute__((noinline)) int run_reg_debug(VM* self) {
+    return run_reg_loop(self, true);
+}
+
+// Same as run(), over register code
+__attribute__((optimize("no-tree-slp-vectorize"))) int
+run_reg(int argc, Value* argv) {
+    VM* const self = cur_vm;
+    Value stack[STACK_SIZE];
+    vm.stack_base = stack;
+
+    vm.csp = vm.call_stack;
+    CallFrame* f = vm.csp;
+    f->fp = stack;
+    if (argv[0].obj->type == OT_CLOSURE) {
+        f->clos = (ObjClosure*) argv[0].obj;
+        f->func = f->clos->f;
+    } else {
+        f->clos = NULL;
+        f->func = (ObjFunction*) argv[0].obj;
+    }
+    f->ip = f->func->rchunk.code.d;
+    if (tracing) trace_call(0);
+
+    for (int i = 0; i <= argc; i++) stack[i] = argv[i];
+    for (int i = argc + 1; i < f->func->nregs; i++) stack[i] = NIL_VAL;
+    vm.sp = stack + f->func->nregs;
+
+    int code;
+    do {
+        code = debugging ? run_reg_debug(self) : run_reg_loop(self, false);
+    } while (code == SWITCH_LOOP);
+    return code;
+}
+
+#undef vm
+#define vm (*cur_vm)
+
 int interpret(char* source) {
 
     ObjFunction* toplevel = compile(source);
@@ -513,9 +1489,46 @@ int interpret(char* source) {
         return COMPILE_ERROR;
     }
 
+    return interpret_function(toplevel);
+}
+
+int interpret_function(ObjFunction* toplevel) {
+    Value v = OBJ_VAL(toplevel);
+    return VM_call(0, &v);
+}
+
+int VM_call(int argc, Value* argv) {
+    Value f = argv[0];
+    if (f.type == VT_BUILTIN) return f.builtin(argc, argv);
+
+    int nargs;
+    if (isObjType(f, OT_FUNCTION)) {
+        nargs = ((ObjFunction*) f.obj)->nargs;
+    } else if (isObjType(f, OT_CLOSURE)) {
+        nargs = ((ObjClosure*) f.obj)->f->nargs;
+    } else {
+        eprintf("Runtime error: Value not callable.\n");
+        return RUNTIME_ERROR;
+    }
+    if (nargs != argc) {
+        eprintf("Runtime error: Invalid argument count, expected %d, "
+                "got %d.\n",
+                nargs, argc);
+        return RUNTIME_ERROR;
+    }
+
     gc_enable();
-    int code = run(toplevel);
+    int code = vm.regvm ? run_reg(argc, argv) : run(argc, argv);
     gc_disable();
+    if (code == OK) argv[0] = vm.ret;
+
+    // The stack is gone if the call stopped early, so upvalues still open
+    // on it can only be dropped
+    for (ObjUpvalue* p = vm.open_upvalues; p; p = p->next) {
+        p->closed = NIL_VAL;
+        p->loc = &p->closed;
+    }
+    vm.open_upvalues = NULL;
 
     return code;
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
 #ifndef VM_H
 #define VM_H
 
+#include <signal.h>
+
 #include "chunk.h"
+#include "module.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -11,7 +14,8 @@
 
 #define STACK_SIZE (MAX_CALLS * MAX_LOCALS)
 
-enum { OK, NO_FILE, COMPILE_ERROR, RUNTIME_ERROR };
+#define GC_GROWTH 2
+#define GC_MIN_HEAP (256 << 10)
 
 typedef struct {
     ObjFunction* func;
@@ -20,10 +24,17 @@ typedef struct {
     u8* ip;
 } CallFrame;
 
-typedef struct {
+typedef struct VM {
     Obj* objs;
     Table strings;
     Table globals;
+    Table base_globals; // what each served job starts from, see serve.c
+    Vector(Module) modules;
+    Vector(Value) api_stack; // values held by an embedding host
+    Value ret;               // returned by the outermost call
+
+    bool regvm; // run register code instead of the stack code
+    bool lazy;  // compile function bodies on their first call
 
     ObjUpvalue* open_upvalues;
 
@@ -31,6 +42,16 @@ typedef struct {
     size_t gc_threshold;
     size_t alloc_bytes;
     int alloc_objs;
+    double gc_growth;
+    size_t gc_min_heap;
+    size_t max_heap;    // or 0
+    bool heap_exceeded; // for the running loop to report, see heap_configure
+
+    // Like vm_interrupt, for what concerns this isolate alone, so that
+    // isolates never take each other's interrupts
+    bool interrupt;
+    Vector(Obj*) frozen; // objects kept out of the GC, see heap_freeze
+    u8* frozen_marks;
 
     Value* sp;
     CallFrame* csp;
@@ -38,10 +59,22 @@ typedef struct {
     CallFrame call_stack[MAX_CALLS];
 } VM;
 
-extern VM vm;
+// Each thread runs the isolate it last entered, and everything in the
+// runtime works on that one through vm.
+extern _Thread_local VM* cur_vm;
+#define vm (*cur_vm)
+
+// Set, from a signal handler or another thread, for the running loops to
+// look up at their next call or jump. Polling this word and the isolate's
+// own interrupt is all the plain loops do for the profiler and debugger.
+extern volatile sig_atomic_t vm_interrupt;
+// Set along with vm_interrupt once the program has used up its time, for
+// the running loop to stop it with a runtime error
+extern volatile sig_atomic_t vm_time_up;
 
-void VM_init();
-void VM_free();
+VM* VM_init(); // also enters the new isolate
+void VM_free(VM* v);
+void VM_enter(VM* v);
 
 static inline void gc_enable() {
     vm.gc_on = true;
@@ -59,6 +92,12 @@ static inline void gc_disable() {
 #endif
 }
 
+bool truthy(Value v);
+
 int interpret(char* source);
+int interpret_function(ObjFunction* toplevel);
+// Calls argv[0] with the argc values after it and leaves the result in
+// argv[0], as for a builtin
+int VM_call(int argc, Value* argv);
 
 #endif
\ No newline at end of file
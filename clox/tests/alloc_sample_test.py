@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+# Checks that the totals --alloc-sample estimates stay close to the exact
+# ones from a run of alloc_sample.lox that is not sampled.
+#
+#   tests/alloc_sample_test.py [--clox path]
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SCRIPT = os.path.join(ROOT, "tests", "alloc_sample.lox")
+
+SAMPLE_BYTES = 4096
+TOLERANCE = 0.1
+
+
+def total_bytes(clox, flags):
+    with tempfile.NamedTemporaryFile(suffix=".txt") as out:
+        subprocess.run([clox, "--alloc-profile", out.name] + flags + [SCRIPT],
+                       stdout=subprocess.DEVNULL, check=True, timeout=60)
+        return float(out.readline().split()[0])
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--clox", default=os.path.join(ROOT, "clox"))
+    args = ap.parse_args()
+    clox = os.path.abspath(args.clox)
+
+    exact = total_bytes(clox, [])
+    sampled = total_bytes(clox, ["--alloc-sample", str(SAMPLE_BYTES)])
+    error = abs(sampled - exact) / exact
+    print("sampled %.0f of %.0f bytes allocated, off by %.1f%%" %
+          (sampled, exact, error * 100))
+    sys.exit(1 if error > TOLERANCE else 0)
+
+
+if __name__ == "__main__":
+    main()
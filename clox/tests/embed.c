@@ -0,0 +1,128 @@
+// An example host for libclox, built against clox.h alone. It calls into
+// a script through the host stack, with builtins of its own, and checks
+// that an error leaves the VM usable and that VMs do not share globals.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clox.h"
+
+static char* script = "var count = 0;\n"
+                      "fun bump() { count = count + 1; return count; }\n"
+                      "fun add(a, b) -> a + b;\n"
+                      "fun greet(who) -> \"hello \" + who;\n"
+                      "fun scaled(x) -> scale(x) + 1;\n"
+                      "fun signed() -> \"from \" + host();\n"
+                      "fun fail() -> nil + 1;\n";
+
+CLOX_BUILTIN(scale) {
+    Value* x = clox_arg(argv, 1);
+    if (argc != 1 || !clox_is_number(x)) return CLOX_RUNTIME_ERROR;
+    clox_set_number(argv, 10 * clox_number(x));
+    return CLOX_OK;
+}
+
+static VM* host_vm;
+
+CLOX_BUILTIN(host) {
+    clox_set_string(host_vm, argv, "the host", 8);
+    return CLOX_OK;
+}
+
+static int failures;
+
+static void expect(bool ok, char* what) {
+    if (!ok) {
+        fprintf(stderr, "embed: %s\n", what);
+        failures++;
+    }
+}
+
+// Calls the global name with the numbers given, leaving the result on the
+// stack
+static int call(VM* v, char* name, int nargs, double* args) {
+    if (!clox_get_global(v, name)) return CLOX_RUNTIME_ERROR;
+    for (int i = 0; i < nargs; i++) clox_push_number(v, args[i]);
+    return clox_call(v, nargs);
+}
+
+// The same for a call that fails, keeping the error it prints out of the
+// output
+static int failing_call(VM* v, char* name) {
+    fflush(stderr);
+    int err = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    int status = call(v, name, 0, NULL);
+    dup2(err, STDERR_FILENO);
+    close(err);
+    return status;
+}
+
+static bool number_result(VM* v, double want) {
+    Value* res = clox_peek(v, 0);
+    bool ok = res && clox_is_number(res) && clox_number(res) == want;
+    clox_pop(v);
+    return ok;
+}
+
+int main() {
+    VM* v = clox_new();
+    host_vm = v;
+    CLOX_REGISTER(v, scale);
+    CLOX_REGISTER(v, host);
+    expect(clox_run(v, script) == CLOX_OK, "script did not run");
+
+    double args[] = {2, 3};
+    expect(call(v, "add", 2, args) == CLOX_OK, "add failed");
+    expect(number_result(v, 5), "add(2, 3) is not 5");
+
+    expect(call(v, "scaled", 1, args) == CLOX_OK, "scaled failed");
+    expect(number_result(v, 21), "scaled(2) is not 21");
+
+    clox_get_global(v, "greet");
+    clox_push_string(v, "world", 5);
+    expect(clox_call(v, 1) == CLOX_OK, "greet failed");
+    char* s = clox_string(clox_peek(v, 0));
+    expect(s && !strcmp(s, "hello world"), "greet(\"world\") is wrong");
+    // A result goes back in as an argument
+    clox_get_global(v, "greet");
+    clox_push(v, clox_peek(v, 1));
+    expect(clox_call(v, 1) == CLOX_OK, "greet failed");
+    s = clox_string(clox_peek(v, 0));
+    expect(s && !strcmp(s, "hello hello world"), "greet of greet is wrong");
+    clox_pop(v);
+    clox_pop(v);
+
+    expect(call(v, "signed", 0, NULL) == CLOX_OK, "signed failed");
+    s = clox_string(clox_peek(v, 0));
+    expect(s && !strcmp(s, "from the host"), "signed() is wrong");
+    clox_pop(v);
+
+    expect(failing_call(v, "fail") == CLOX_RUNTIME_ERROR,
+           "fail() did not fail");
+    expect(clox_is_nil(clox_peek(v, 0)), "fail() did not leave nil");
+    clox_pop(v);
+    expect(!clox_get_global(v, "missing"), "found an undefined global");
+
+    // Globals live on between calls, in their own VM
+    call(v, "bump", 0, NULL);
+    VM* other = clox_new();
+    expect(clox_run(other, script) == CLOX_OK, "second VM did not run");
+    expect(call(other, "bump", 0, NULL) == CLOX_OK, "bump failed");
+    expect(number_result(other, 1), "second VM sees the first one's count");
+    clox_free(other);
+    expect(call(v, "bump", 0, NULL) == CLOX_OK, "bump failed");
+    expect(number_result(v, 2), "count was not kept");
+
+    expect(clox_top(v) == 1, "stack not back to the first bump");
+    clox_pop(v);
+    expect(!clox_peek(v, 0), "peeked past the bottom");
+    clox_free(v);
+
+    printf("embed test %s\n", failures ? "FAILED" : "passed");
+    return failures != 0;
+}
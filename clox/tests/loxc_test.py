@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+# Checks that compiled .loxc files are used while their source is unchanged
+# and ignored once it changes or they are damaged, for scripts and modules,
+# that the files a reloaded module was mapped from are let go, and that a
+# heap image brings back the globals it was saved with.
+#
+#   tests/loxc_test.py [--clox path]
+
+import argparse
+import os
+import pty
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+failures = []
+
+
+def expect(ok, what):
+    if not ok:
+        failures.append(what)
+        print("FAIL " + what)
+
+
+def write(path, text, stamp=None):
+    with open(path, "w") as f:
+        f.write(text)
+    if stamp:
+        os.utime(path, ns=stamp)
+
+
+def stamp(path):
+    st = os.stat(path)
+    return (st.st_atime_ns, st.st_mtime_ns)
+
+
+def run(clox, flags, script):
+    r = subprocess.run([clox] + flags + [script], stdin=subprocess.DEVNULL,
+                       stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                       timeout=60)
+    return r.returncode, r.stdout.decode(), r.stderr.decode()
+
+
+def scripts(clox, flags):
+    write("main.lox", 'println("compiled");\n')
+    expect(run(clox, ["--compile"], "main.lox")[0] == 0, "--compile failed")
+    old = stamp("main.lox")
+
+    # Same size and time, so only the .loxc can say compiled
+    write("main.lox", 'println("source!!");\n', old)
+    expect(run(clox, flags, "main.lox")[1] == "compiled\n",
+           "fresh .loxc not used %s" % flags)
+    expect(run(clox, flags, "main.loxc")[1] == "compiled\n",
+           ".loxc does not run on its own %s" % flags)
+
+    os.utime("main.lox", ns=(old[0], old[1] + 10**9))
+    expect(run(clox, flags, "main.lox")[1] == "source!!\n",
+           "stale .loxc used %s" % flags)
+
+
+def corrupt(clox, flags):
+    write("main.lox", 'var s = "ok"; fun f(x) -> s + x; println(f(1));\n')
+    run(clox, ["--compile"], "main.lox")
+    with open("main.loxc", "rb") as f:
+        good = f.read()
+    # Every cut short file, and a wrong magic and version
+    bad = [good[:n] for n in range(len(good))]
+    bad.append(b"X" + good[1:])
+    bad.append(good[:4] + bytes([good[4] + 1]) + good[5:])
+    for data in bad:
+        with open("main.loxc", "wb") as f:
+            f.write(data)
+        code, out, err = run(clox, flags, "main.lox")
+        if code != 0 or out != "ok1\n":
+            expect(False, "broken .loxc of %d bytes not ignored %s" %
+                   (len(data), flags))
+            return
+        code, out, err = run(clox, flags, "main.loxc")
+        if code != 2 or "Invalid compiled file" not in err:
+            expect(False, "broken .loxc of %d bytes ran %s" %
+                   (len(data), flags))
+            return
+
+
+# Runs main.lox up to the scanln after its first line of output, calls
+# between with the process, and lets it finish. Its output goes to a
+# terminal so that lines come out as they are printed.
+def interact(clox, flags, between):
+    master, slave = pty.openpty()
+    p = subprocess.Popen([clox] + flags + ["main.lox"],
+                         stdin=subprocess.PIPE, stdout=slave)
+    os.close(slave)
+    out = b""
+    while b"\n" not in out:
+        out += os.read(master, 4096)
+    between(p)
+    p.stdin.write(b"\n")
+    p.stdin.close()
+    while True:
+        try:
+            more = os.read(master, 4096)
+        except OSError:
+            break  # the terminal is closed once the process is gone
+        if not more:
+            break
+        out += more
+    os.close(master)
+    p.wait(timeout=60)
+    return out.decode().replace("\r", "").splitlines()
+
+
+def modules(clox, flags):
+    write("mod.lox", 'println("mod compiled");\n')
+    run(clox, ["--compile"], "mod.lox")
+    write("mod.lox", 'println("mod source!!");\n', stamp("mod.lox"))
+    write("main.lox", 'loadModule("mod.lox")();\n')
+    expect(run(clox, flags, "main.lox")[1] == "mod compiled\n",
+           "module .loxc not used %s" % flags)
+
+    def touch(p):
+        old = stamp("mod.lox")
+        os.utime("mod.lox", ns=(old[0], old[1] + 10**9))
+
+    write("main.lox", 'loadModule("mod.lox")();\n'
+                      'scanln(); reloadModule("mod.lox")();\n')
+    expect(interact(clox, flags, touch) == ["mod compiled", "mod source!!"],
+           "reloaded module kept a stale .loxc %s" % flags)
+
+
+def unmapped(clox, flags):
+    write("mod.lox", 'println("still mapped");\n')
+    run(clox, ["--compile"], "mod.lox")
+    # Reloads map the file again, and the garbage has the old ones collected
+    write("main.lox", 'var first = loadModule("mod.lox");\n'
+                      'for (var i = 0; i < 300; i = i + 1) {\n'
+                      '    reloadModule("mod.lox");\n'
+                      '    var garbage = array[2000];\n'
+                      '}\n'
+                      'println("reloaded"); scanln(); first();\n')
+    maps = []
+
+    def count(p):
+        path = os.path.abspath("mod.loxc")
+        try:
+            with open("/proc/%d/maps" % p.pid) as f:
+                maps.append(sum(path in l for l in f))
+        except OSError:
+            pass  # nothing to count without /proc
+
+    out = interact(clox, flags, count)
+    expect(out == ["reloaded", "still mapped"],
+           "code of a module gone while in use %s" % flags)
+    expect(not maps or maps[0] < 10, "%d mappings of a reloaded module left %s"
+           % (maps[0] if maps else 0, flags))
+
+
+PRELUDE = """var greeting = "hello";
+var n = 42;
+fun counter() {
+    var c = 0;
+    fun inc() { c = c + 1; return c; }
+    fun get() -> c;
+    var pair = array[2];
+    pair[0] = inc;
+    pair[1] = get;
+    return pair;
+}
+var pair = counter();
+pair[0]();
+var self = array[2];
+self[0] = self;
+self[1] = 2.5;
+class Point {}
+var p = Point();
+p.x = 3;
+p.y = greeting;
+var out = println;
+"""
+
+# Closures sharing an upvalue, a cycle, an instance and a builtin, read
+# after collections have run over what was loaded
+USES = """for (var i = 0; i < 300; i = i + 1) {
+    var garbage = array[2000];
+}
+println(greeting + " " + n);
+println(pair[0]());
+println(pair[1]());
+println(self[0][0] == self);
+println(self[1]);
+println(p.y + " " + p.x);
+out("builtin");
+"""
+
+
+def heap_image(clox, flags):
+    write("prelude.lox", PRELUDE)
+    expect(run(clox, ["--save-heap", "prelude.img"], "prelude.lox")[0] == 0,
+           "--save-heap failed")
+    write("main.lox", USES)
+    code, out, err = run(clox, flags + ["--load-heap", "prelude.img"],
+                         "main.lox")
+    expect(code == 0 and out == "hello 42\n2\n2\ntrue\n2.500000\n"
+                                "hello 3\nbuiltin\n",
+           "heap image did not round trip %s: %r %r" % (flags, out, err))
+
+    with open("prelude.img", "rb") as f:
+        good = f.read()
+    # A cut short image is refused before anything runs
+    for n in range(len(good)):
+        with open("broken.img", "wb") as f:
+            f.write(good[:n])
+        code, out, err = run(clox, flags + ["--load-heap", "broken.img"],
+                             "main.lox")
+        if code != 2 or out or "Invalid heap image" not in err:
+            expect(False, "heap image of %d bytes loaded %s" % (n, flags))
+            return
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--clox", default=os.path.join(ROOT, "clox"))
+    args = ap.parse_args()
+    clox = os.path.abspath(args.clox)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        os.chdir(tmp)
+        for flags in [[], ["--reg"]]:
+            scripts(clox, flags)
+            corrupt(clox, flags)
+            modules(clox, flags)
+            unmapped(clox, flags)
+            heap_image(clox, flags)
+    print("loxc test %s" % ("FAILED" if failures else "passed"))
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
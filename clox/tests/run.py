@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+# Runs the scripts in tests/lox and checks what they print and exit with.
+#
+#   tests/run.py [--clox path] [--args=...] [name...]
+#
+# A script states what it expects in comments:
+#
+#   // expect: text         a line of output, in order
+#   // expect error: text   a line on stderr, in order
+#   // expect exit: n       the exit code, 0 when not given
+#   // args: flags          a set of flags to run it with
+#   // input: text          a line on stdin, in order
+#   // then: tool args      a tool from tools/ to run afterwards, its output
+#                           expected after the script's
+#
+# Without args lines a script runs as is, with --reg and with --lazy, and
+# has to give the same results each time. Scripts run from tests/lox, so
+# the modules they load live in tests/lox/lib, and files they write there
+# are removed after each run. --args=... adds flags to every run, as in
+# --args=--reg.
+
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+LOX_DIR = os.path.join(ROOT, "tests", "lox")
+
+MODES = [[], ["--reg"], ["--lazy"]]
+EXPECT = re.compile(
+    r"// (expect|expect error|expect exit|args|input|then): ?(.*)$")
+
+
+class Script:
+    def __init__(self, path):
+        self.path = path
+        self.out = []
+        self.err = []
+        self.exit = 0
+        self.modes = []
+        self.input = []
+        self.then = []
+        with open(path) as f:
+            for line in f:
+                m = EXPECT.search(line)
+                if not m:
+                    continue
+                kind, text = m.group(1), m.group(2).rstrip()
+                if kind == "expect":
+                    self.out.append(text)
+                elif kind == "expect error":
+                    self.err.append(text)
+                elif kind == "expect exit":
+                    self.exit = int(text)
+                elif kind == "input":
+                    self.input.append(text + "\n")
+                elif kind == "then":
+                    self.then.append(shlex.split(text))
+                else:
+                    self.modes.append(shlex.split(text))
+        if not self.modes:
+            self.modes = MODES
+
+
+def lines(b):
+    return [l.rstrip() for l in b.decode(errors="replace").splitlines()]
+
+
+def diff(what, expected, got):
+    msg = ["  %s differs:" % what]
+    for i in range(max(len(expected), len(got))):
+        e = expected[i] if i < len(expected) else "<none>"
+        g = got[i] if i < len(got) else "<none>"
+        if e != g:
+            msg.append("    line %d: expected %r, got %r" % (i + 1, e, g))
+            break
+    return msg
+
+
+def run_tools(script):
+    out = []
+    for tool in script.then:
+        cmd = [sys.executable, os.path.join(ROOT, "tools", tool[0])] + tool[1:]
+        r = subprocess.run(cmd, cwd=LOX_DIR, stdin=subprocess.DEVNULL,
+                           stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                           timeout=60)
+        out += lines(r.stdout)
+    return out
+
+
+def run(clox, script, flags):
+    cmd = [clox] + flags + [os.path.basename(script.path)]
+    files = set(os.listdir(LOX_DIR))
+    try:
+        r = subprocess.run(cmd, cwd=LOX_DIR,
+                           input="".join(script.input).encode(),
+                           stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                           timeout=60)
+        out = lines(r.stdout) + run_tools(script)
+    except subprocess.TimeoutExpired:
+        return ["  timed out"]
+    finally:
+        for name in set(os.listdir(LOX_DIR)) - files:
+            os.unlink(os.path.join(LOX_DIR, name))
+    problems = []
+    if r.returncode != script.exit:
+        problems.append("  exit code %d, expected %d" %
+                        (r.returncode, script.exit))
+    err = lines(r.stderr)
+    if out != script.out:
+        problems += diff("output", script.out, out)
+    if err != script.err:
+        problems += diff("stderr", script.err, err)
+    return problems
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--clox", default=os.path.join(ROOT, "clox"))
+    ap.add_argument("--args", default="")
+    ap.add_argument("names", nargs="*")
+    args = ap.parse_args()
+    clox = os.path.abspath(args.clox)
+    extra = shlex.split(args.args)
+
+    names = args.names or sorted(n[:-4] for n in os.listdir(LOX_DIR)
+                                 if n.endswith(".lox"))
+    failed = 0
+    runs = 0
+    for name in names:
+        script = Script(os.path.join(LOX_DIR, name + ".lox"))
+        for flags in script.modes:
+            runs += 1
+            problems = run(clox, script, extra + flags)
+            if problems:
+                failed += 1
+                print("FAIL %s %s" % (name, " ".join(extra + flags)))
+                print("\n".join(problems))
+    print("%d of %d runs passed" % (runs - failed, runs))
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
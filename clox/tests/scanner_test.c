@@ -0,0 +1,132 @@
+// Differential test of the block at a time scanner against the byte at a
+// time one, over the files given and over random sources. Each random
+// source ends right before an unmapped page, so reading past its end
+// would crash.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SCALAR_SCANNER
+#define init_scanner scalar_init_scanner
+#define next_token scalar_next_token
+#define make_token scalar_make_token
+#define error_token scalar_error_token
+#define identifierType scalar_identifierType
+#include "../src/scanner.c"
+#undef init_scanner
+#undef next_token
+
+void init_scanner(Scanner* scanner, char* source);
+Token next_token(Scanner* scanner);
+
+static bool same_token(Token a, Token b) {
+    if (a.type != b.type || a.line != b.line) return false;
+    if (a.type == TOKEN_ERROR) return !strcmp(a.start, b.start);
+    return a.start == b.start && a.len == b.len;
+}
+
+static void print_token(char* src, Token t) {
+    if (t.type == TOKEN_ERROR) {
+        fprintf(stderr, "error '%s' line %d\n", t.start, t.line);
+    } else {
+        fprintf(stderr, "type %d at %ld len %d line %d\n", t.type,
+                t.start - src, t.len, t.line);
+    }
+}
+
+static bool check(char* name, char* src) {
+    Scanner a, b;
+    scalar_init_scanner(&a, src);
+    init_scanner(&b, src);
+    while (true) {
+        Token x = scalar_next_token(&a);
+        Token y = next_token(&b);
+        if (!same_token(x, y) || a.cur != b.cur) {
+            fprintf(stderr, "%s: scanners differ at offset %ld\n", name,
+                    a.cur - src);
+            print_token(src, x);
+            print_token(src, y);
+            return false;
+        }
+        if (x.type == TOKEN_EOF) return true;
+    }
+}
+
+static char* read_file(char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    long len = ftell(fp);
+    char* s = malloc(len + 1);
+    fseek(fp, 0, SEEK_SET);
+    len = fread(s, 1, len, fp);
+    s[len] = '\0';
+    fclose(fp);
+    return s;
+}
+
+static u32 rng = 12345;
+
+static u32 next_rand() {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Sources are made of runs of bytes drawn from one of these, the first
+// weighted towards the bytes that start or end a run
+static char* alphabets[] = {
+    "aZz_09x9q    \t\t\n\n\n\"\"\\\\''//**##..+-=!<>(){};,?:%\r\x80\xff",
+    "abcxyzABCXYZ_0123456789",
+    "0123456789",
+    "  \t\n",
+    "/*\n",
+};
+#define NALPHABETS (int) (sizeof alphabets / sizeof *alphabets)
+
+#define MAX_LEN 300
+#define RUNS 200000
+
+int main(int argc, char** argv) {
+    bool ok = true;
+    for (int i = 1; i < argc; i++) {
+        char* src = read_file(argv[i]);
+        if (!src) {
+            perror(argv[i]);
+            return 1;
+        }
+        ok &= check(argv[i], src);
+        free(src);
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    char* buf = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED || mprotect(buf + page, page, PROT_NONE)) {
+        perror("mmap");
+        return 1;
+    }
+    for (int run = 0; run < RUNS && ok; run++) {
+        int len = next_rand() % MAX_LEN;
+        char* src = buf + page - 1 - len;
+        for (int i = 0; i < len;) {
+            char* a = alphabets[next_rand() % NALPHABETS];
+            int n = a == alphabets[0] ? 1 : 1 + next_rand() % 40;
+            for (; n && i < len; n--, i++) {
+                src[i] = a[next_rand() % strlen(a)];
+            }
+        }
+        // A '#' skips the byte after it, even the end, in both scanners
+        if (len && src[len - 1] == '#') src[len - 1] = ' ';
+        src[len] = '\0';
+        ok &= check("random source", src);
+    }
+
+    printf("scanner test %s\n", ok ? "passed" : "FAILED");
+    return !ok;
+}
@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+# Checks that --serve and the workers of --pool run each job from the
+# globals they started with, an image's included, through collections in
+# the server or worker, and that a job over its time limit leaves the
+# server running the next.
+#
+#   tests/serve_test.py [--clox path]
+
+import argparse
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+failures = []
+
+
+def expect(ok, what):
+    if not ok:
+        failures.append(what)
+        print("FAIL " + what)
+
+
+def write(path, text):
+    with open(path, "w") as f:
+        f.write(text)
+
+
+def start_server(clox, flags):
+    server = subprocess.Popen([clox] + flags + ["--serve", "sock"],
+                              stdin=subprocess.DEVNULL)
+    for _ in range(500):
+        if os.path.exists("sock") or server.poll() is not None:
+            break
+        time.sleep(0.01)
+    return server
+
+
+def stop_server(server):
+    server.kill()
+    server.wait()
+    os.unlink("sock")
+
+
+# Sends the source of a job and returns what it printed and its status
+def job(source):
+    s = socket.socket(socket.AF_UNIX)
+    s.settimeout(60)
+    s.connect("sock")
+    s.sendall(source.encode())
+    s.shutdown(socket.SHUT_WR)
+    reply = b""
+    while True:
+        more = s.recv(4096)
+        if not more:
+            break
+        reply += more
+    s.close()
+    if not reply:
+        return "", None
+    return reply[:-1].decode(), reply[-1]
+
+
+GARBAGE = """for (var i = 0; i < 300; i = i + 1) {
+    var garbage = array[2000];
+}
+"""
+
+
+def rebinding(clox, flags):
+    write("base.lox", "var data = array[2];\ndata[0] = 1;\n")
+    run = subprocess.run([clox, "--save-heap", "base.img", "base.lox"])
+    expect(run.returncode == 0, "--save-heap failed")
+
+    server = start_server(clox, flags + ["--load-heap", "base.img"])
+    # What a job rebinds is back for the next, even after collections ran
+    # while nothing but the server held it
+    expect(job("data = nil; println = nil; var mine = 1;\n" + GARBAGE) ==
+           ("", 0), "rebinding job failed %s" % flags)
+    expect(job("println(data[0]);") == ("1\n", 0),
+           "base global lost after a rebinding job %s" % flags)
+    expect(job("println(mine);") ==
+           ('Runtime error at line 1: Undefined variable "mine".\n', 3),
+           "global of an earlier job kept %s" % flags)
+
+    # Objects are not copied, so what a job changes inside one it keeps
+    expect(job("data[1] = array[3];\n" + GARBAGE) == ("", 0),
+           "mutating job failed %s" % flags)
+    expect(job("println(data[1].len);") == ("3\n", 0),
+           "object stored into a base global lost %s" % flags)
+    expect(job("exit(7);") == ("", 7), "exit() not the job status %s" % flags)
+    stop_server(server)
+
+
+def time_limit(clox, flags):
+    server = start_server(clox, flags + ["--time-limit", "0.2"])
+    out, status = job("while (true) {}")
+    expect(status == 3 and "Time limit exceeded" in out,
+           "endless job not stopped %s: %r" % (flags, out))
+    expect(job('println("next");') == ("next\n", 0),
+           "job after a stopped one failed %s" % flags)
+    stop_server(server)
+
+
+# Runs the scripts at paths in a pool of workers, returning their output
+# lines sorted, since the workers take them in no set order, and the status
+def pool(clox, flags, paths, err=None):
+    r = subprocess.run([clox] + flags, input="\n".join(paths).encode(),
+                       stdout=subprocess.PIPE, stderr=err, timeout=60)
+    return sorted(r.stdout.decode().splitlines()), r.returncode
+
+
+def pool_image(clox, flags):
+    write("base.lox", 'var empty = [];\nvar none = "";\n'
+                      'var nested = [1, "two", []];\n')
+    run = subprocess.run([clox, "--save-heap", "base.img", "base.lox"])
+    expect(run.returncode == 0, "--save-heap failed")
+    paths = []
+    for i in range(4):
+        write("job%d.lox" % i, 'println("%d " + nested[1] + none);\n'
+                               'println(empty.len + nested[2].len + %d);\n'
+                               % (i, i))
+        paths.append("job%d.lox" % i)
+    out = pool(clox, flags + ["--pool", "2", "--load-heap", "base.img"],
+               paths)
+    want = ["0", "0 two", "1", "1 two", "2", "2 two", "3", "3 two"]
+    expect(out == (want, 0),
+           "image not loaded in pool workers %s: %r" % (flags, out))
+
+
+def pooled(clox, flags):
+    write("base.lox", "var counter = 0;\nvar box = array[1];\n")
+    run = subprocess.run([clox, "--save-heap", "base.img", "base.lox"])
+    expect(run.returncode == 0, "--save-heap failed")
+    # Each job stores a new object into a frozen one, and collects while
+    # only that holds it
+    paths = []
+    for i in range(8):
+        write("job%d.lox" % i, "counter = counter + 1;\n"
+                               "var mine = %d;\n"
+                               "box[0] = [mine];\n%s"
+                               'println("job %d: " + counter + " " + '
+                               "box[0][0]);\n" % (i, GARBAGE, i))
+        paths.append("job%d.lox" % i)
+    # Sent last, so its worker has most likely run some of the others, whose
+    # globals it must not see
+    write("reader.lox", "println(mine);\n")
+    paths.append("reader.lox")
+
+    with open("err", "w") as err:
+        out = pool(clox, flags + ["--pool", "3", "--load-heap", "base.img"],
+                   paths, err)
+    want = ["job %d: 1 %d" % (i, i) for i in range(8)]
+    expect(out == (want, 3), "pool jobs not isolated %s: %r" % (flags, out))
+    with open("err") as err:
+        expect(err.read() == 'Runtime error at line 1: Undefined variable '
+                             '"mine".\n',
+               "global of another job seen in a worker %s" % flags)
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--clox", default=os.path.join(ROOT, "clox"))
+    args = ap.parse_args()
+    clox = os.path.abspath(args.clox)
+
+    with tempfile.TemporaryDirectory() as tmp:
+        os.chdir(tmp)
+        for flags in [[], ["--reg"]]:
+            rebinding(clox, flags)
+            time_limit(clox, flags)
+            pool_image(clox, flags)
+            pooled(clox, flags)
+    print("serve test %s" % ("FAILED" if failures else "passed"))
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,261 @@
+#!/usr/bin/env python3
+# Reads a heap dump written by clox --heap-dump or dumpHeap(path) and finds
+# what keeps memory alive.
+#
+#   tools/heapdump.py [--top n] [--baseline old] dump
+#
+# An object's retained size is what a collection would free if nothing
+# pointed at it any more: itself and every object only reachable through
+# it. The report lists totals per kind of object and the objects retaining
+# the most, each with the chain of objects that in turn retain it back to
+# the roots. --baseline compares the kinds against an earlier dump of the same
+# program, which shows what keeps growing.
+
+import argparse
+import sys
+
+TYPES = ["String", "Function", "Closure", "Upvalue", "Class", "Instance",
+         "Array"]
+ROOTS = ["stack", "frame", "global", "module", "api", "upvalue"]
+
+
+class Heap:
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.buf = f.read()
+        self.pos = 0
+        if self.buf[:7] != b"LOXHEAP" or self.buf[7] != 1:
+            raise ValueError("%s: not a version 1 heap dump" % path)
+        self.pos = 8
+        n = self.num()
+        self.type = [0] * n
+        self.size = [0] * n
+        self.name = [0] * n
+        self.text = {}
+        self.refs = [None] * n
+        for i in range(n):
+            self.type[i] = self.byte()
+            self.size[i] = self.num()
+            self.name[i] = self.num()
+            if self.type[i] == 0:
+                length = self.byte()
+                self.text[i] = self.buf[self.pos:self.pos + length].decode(
+                    errors="replace")
+                self.pos += length
+            self.refs[i] = [self.num() for _ in range(self.num())]
+        self.roots = []
+        for _ in range(self.num()):
+            kind = self.byte()
+            obj = self.num()
+            length = self.num()
+            label = self.buf[self.pos:self.pos + length].decode(
+                errors="replace")
+            self.pos += length
+            self.roots.append((ROOTS[kind], obj, label))
+        self.n = n
+
+    def byte(self):
+        b = self.buf[self.pos]
+        self.pos += 1
+        return b
+
+    def num(self):
+        n = shift = 0
+        while True:
+            b = self.byte()
+            n |= (b & 0x7f) << shift
+            shift += 7
+            if not b & 0x80:
+                return n
+
+    def kind(self, i):
+        t = TYPES[self.type[i]]
+        name = self.name[i]
+        return "%s %s" % (t, self.text[name - 1]) if name else t
+
+    def describe(self, i):
+        if self.type[i] == 0:
+            return "String %r" % self.text[i]
+        return self.kind(i)
+
+
+def dominators(heap):
+    """Immediate dominators, with heap.n as a root above all the roots, by
+    Cooper, Harvey and Kennedy's iteration over reverse postorder."""
+    top = heap.n
+    succ = heap.refs + [sorted({obj for _, obj, _ in heap.roots})]
+    order = []  # postorder
+    seen = [False] * (heap.n + 1)
+    seen[top] = True
+    stack = [(top, 0)]
+    while stack:
+        v, k = stack[-1]
+        if k < len(succ[v]):
+            stack[-1] = (v, k + 1)
+            w = succ[v][k]
+            if not seen[w]:
+                seen[w] = True
+                stack.append((w, 0))
+        else:
+            stack.pop()
+            order.append(v)
+    index = [-1] * (heap.n + 1)
+    for k, v in enumerate(order):
+        index[v] = k
+    preds = [[] for _ in range(heap.n + 1)]
+    for v in order:
+        for w in succ[v]:
+            preds[w].append(v)
+
+    idom = [-1] * (heap.n + 1)
+    idom[top] = top
+    changed = True
+    while changed:
+        changed = False
+        for v in reversed(order):
+            if v == top:
+                continue
+            new = -1
+            for p in preds[v]:
+                if idom[p] < 0:
+                    continue
+                if new < 0:
+                    new = p
+                    continue
+                a, b = p, new
+                while a != b:
+                    while index[a] < index[b]:
+                        a = idom[a]
+                    while index[b] < index[a]:
+                        b = idom[b]
+                new = a
+            if idom[v] != new:
+                idom[v] = new
+                changed = True
+    return idom, order
+
+
+def analyze(heap):
+    idom, order = dominators(heap)
+    retained = heap.size + [0]
+    for v in order:  # children before their dominators
+        if v != heap.n:
+            retained[idom[v]] += retained[v]
+    return idom, retained, order
+
+
+def kind_totals(heap, idom, retained, order):
+    """Per kind: objects, bytes, and bytes retained by the objects of the
+    kind not already retained by another of the same kind."""
+    totals = {}
+    children = [[] for _ in range(heap.n + 1)]
+    for v in order:
+        if v != heap.n:
+            children[idom[v]].append(v)
+    on_path = {}
+    stack = [(heap.n, False)]
+    while stack:
+        v, leaving = stack.pop()
+        if v == heap.n:
+            if not leaving:
+                stack.append((v, True))
+                stack.extend((w, False) for w in children[v])
+            continue
+        k = heap.kind(v)
+        if leaving:
+            on_path[k] -= 1
+            continue
+        t = totals.setdefault(k, [0, 0, 0])
+        t[0] += 1
+        t[1] += heap.size[v]
+        if not on_path.get(k):
+            t[2] += retained[v]
+        on_path[k] = on_path.get(k, 0) + 1
+        stack.append((v, True))
+        stack.extend((w, False) for w in children[v])
+    return totals
+
+
+def holders(heap, idom, v, root_of):
+    """The chain retaining v, back to the roots"""
+    chain = []
+    while v != heap.n:
+        chain.append(heap.describe(v))
+        if idom[v] == heap.n:
+            names = root_of.get(v, ["several roots"])
+            chain.append(", ".join(names[:3]) +
+                         (" and %d more" % (len(names) - 3)
+                          if len(names) > 3 else ""))
+        v = idom[v]
+    return " <- ".join(chain)
+
+
+def biggest(heap, idom, retained, order, n):
+    """The n objects retaining the most, leaving out those retained by
+    one listed before, such as the rest of a linked list"""
+    shown = set()
+    for v in sorted((v for v in order if v != heap.n),
+                    key=lambda v: -retained[v]):
+        if len(shown) == n:
+            break
+        u = idom[v]
+        while u != heap.n and u not in shown:
+            u = idom[u]
+        if u == heap.n:
+            shown.add(v)
+            yield v
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--top", type=int, default=20)
+    ap.add_argument("--baseline")
+    ap.add_argument("dump")
+    args = ap.parse_args()
+
+    try:
+        heap = Heap(args.dump)
+        old = Heap(args.baseline) if args.baseline else None
+    except (OSError, ValueError, IndexError) as e:
+        sys.exit("heapdump: %s" % e)
+
+    idom, retained, order = analyze(heap)
+    live = len(order) - 1
+    live_bytes = retained[heap.n]
+    print("%d objects, %d bytes; %d objects, %d bytes reachable" %
+          (heap.n, sum(heap.size), live, live_bytes))
+
+    totals = kind_totals(heap, idom, retained, order)
+    old_totals = {}
+    if old:
+        oi, oret, oorder = analyze(old)
+        old_totals = kind_totals(old, oi, oret, oorder)
+        print("%d objects, %d bytes reachable in %s" %
+              (len(oorder) - 1, oret[old.n], args.baseline))
+    print()
+    head = "%10s %12s %12s" % ("objects", "bytes", "retained")
+    if old:
+        head += " %10s %12s" % ("+objects", "+retained")
+    print(head + "  kind")
+    kinds = sorted(totals, key=lambda k: -totals[k][2])
+    for k in kinds[:args.top]:
+        t = totals[k]
+        line = "%10d %12d %12d" % tuple(t)
+        if old:
+            o = old_totals.get(k, [0, 0, 0])
+            line += " %+10d %+12d" % (t[0] - o[0], t[2] - o[2])
+        print(line + "  " + k)
+
+    print("\n%12s  %s" % ("retained", "object <- retained by"))
+    root_of = {}
+    for kind, obj, label in heap.roots:
+        names = root_of.setdefault(obj, [])
+        name = "%s %s" % (kind, label) if label else kind
+        if name not in names:
+            names.append(name)
+    for v in biggest(heap, idom, retained, order, args.top):
+        print("%12d  %s" % (retained[v], holders(heap, idom, v, root_of)))
+
+
+if __name__ == "__main__":
+    main()